@@ -32,30 +32,86 @@
  * SPDX-License-Identifier: GPL-2.0-only
  *
  * Build:
- *   gcc -Wall -O2 -o brcm-iovar brcmfmac_iovar.c \
+ *   gcc -Wall -O2 -pthread -o brcm-iovar brcmfmac_iovar.c \
  *       $(pkg-config --cflags --libs libnl-3.0 libnl-genl-3.0)
  *
  * Usage:
- *   brcm-iovar <interface> get_int <iovar_name>
+ *   brcm-iovar <interface> get_int <iovar_name>...
  *   brcm-iovar <interface> set_int <iovar_name> <value>
+ *   brcm-iovar <interface> set_int <iovar_name>=<value>...
+ *   brcm-iovar <interface> get <name>...
+ *   brcm-iovar <interface> set <name> <value>
+ *   brcm-iovar <interface> set <name>=<value>...
+ *   brcm-iovar <interface> list
+ *   brcm-iovar <interface> profile [<name>]
+ *   brcm-iovar <interface> profile-verify <name> [seconds]
+ *   brcm-iovar <interface> stream-guard <seconds|release> [baseline] [5g]
+ *   brcm-iovar <interface> wme [<ac> key=value ...]
+ *   brcm-iovar <interface> probe <host> [count] [interval-ms]
+ *   brcm-iovar <interface> arp-offload|nd-offload <on|off> [addr ...]
+ *   brcm-iovar <interface> pkt-filter <subcommand> ...
+ *   brcm-iovar <interface> quiet-host <on|off> [seconds]
+ *   brcm-iovar <interface> wake-stats [seconds]
+ *   brcm-iovar <interface> bus
+ *   brcm-iovar <interface> bus-bench tx|rx|sweep <target> [seconds]
+ *   brcm-iovar <interface> ack-bench [bytes] [count]
+ *   brcm-iovar <interface> watch [interval] [count] [temp-limit]
+ *   brcm-iovar <interface> coex [seconds]
+ *   brcm-iovar <interface> antenna [0|1|auto]
+ *   brcm-iovar <interface> antenna-compare [seconds] [rounds]
+ *   brcm-iovar <interface> band [auto|5g|2g] [wait]
+ *   brcm-iovar <interface> batch <file|->
+ *   brcm-iovar <interface> shell
+ *   brcm-iovar <interface> serve [idle-seconds] [socket-path]
+ *   brcm-iovar --connect[=socket] <interface> <command> [args...]
+ *   brcm-iovar --connect[=socket] <interface> reply-bench [max] [rounds]
+ *   brcm-iovar - decode <file|->
+ *   brcm-iovar - hotplug <rules>
+ *
+ *   Options (before the interface): --json, --binary, --emulate, --no-ack,
+ *                                   --wait-for-iface[=seconds],
+ *                                   --connect[=socket], --profiles=<file>
  *
  * Examples:
  *   brcm-iovar wlan0 get_int btc_mode
  *   brcm-iovar wlan0 set_int btc_mode 4
  *   brcm-iovar wlan0 get_int btc_params
+ *   brcm-iovar wlan0 set frameburst 0
+ *   brcm-iovar wlan0 profile-verify tput-bt 5
  */
 
 /* Feature test macro - must be before any includes */
 #define _GNU_SOURCE
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <net/if.h>
 #include <netdb.h>
+#include <netinet/ip_icmp.h>
 
 /*
  * Suppress warnings from libnl system headers.
@@ -70,6 +126,7 @@
 #pragma GCC diagnostic pop
 
 #include <linux/nl80211.h>
+#include <linux/rtnetlink.h>
 
 /* -------------------------------------------------------------------------
  * Constants from kernel brcmfmac headers
@@ -89,6 +146,85 @@
 #define BRCMF_C_GET_VAR     262
 #define BRCMF_C_SET_VAR     263
 
+/* Dongle interface version, the cheapest command there is (fwil.h) */
+#define BRCMF_C_GET_VERSION 1
+
+/* Frame bursting is a plain dongle command, not an iovar */
+/* fwil.h: BRCMF_C_SET_FAKEFRAG (set), wlioctl_defs.h: WLC_GET_FAKEFRAG */
+#define BRCMF_C_GET_FAKEFRAG   218
+#define BRCMF_C_SET_FAKEFRAG   219
+
+/* Link state dongle commands (fwil.h) */
+#define BRCMF_C_GET_RATE       12
+#define BRCMF_C_GET_BSSID      23
+#define BRCMF_C_GET_RSSI       127
+
+/* Antenna selection (wlioctl_defs.h: WLC_*_TXANT, WLC_*_ANTDIV) */
+#define BRCMF_C_GET_TXANT      61
+#define BRCMF_C_SET_TXANT      62
+#define BRCMF_C_GET_ANTDIV     63
+#define BRCMF_C_SET_ANTDIV     64
+
+/* Band preference (wlioctl_defs.h: WLC_GET_BAND, WLC_SET_BAND) */
+#define BRCMF_C_GET_BAND       141
+#define BRCMF_C_SET_BAND       142
+
+/* Firmware-wide scan suppression (wlioctl_defs.h: WLC_*_SCANSUPPRESS) */
+#define BRCMF_C_GET_SCANSUPPRESS   115
+#define BRCMF_C_SET_SCANSUPPRESS   116
+
+/* Netlink ACK options (linux/netlink.h), for headers older than 4.12 */
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK     10
+#endif
+#ifndef NETLINK_EXT_ACK
+#define NETLINK_EXT_ACK     11
+#endif
+#ifndef NLM_F_CAPPED
+#define NLM_F_CAPPED        0x100
+#endif
+#ifndef NLM_F_ACK_TLVS
+#define NLM_F_ACK_TLVS      0x200
+#endif
+#define EXTACK_ATTR_MSG     1       /* NLMSGERR_ATTR_MSG */
+#define EXTACK_ATTR_MAX     EXTACK_ATTR_MSG
+#define EXTACK_MSG_MAX      128
+
+#ifdef STATIC_BUILD
+/*
+ * libnl-3 calls getprotobynumber/getprotobyname (utils.o: nl_ip_proto2str,
+ * nl_str2ip_proto) and getaddrinfo (addr.o: nl_addr_info), none of which
+ * this tool uses. glibc's versions go through NSS, which a static binary
+ * cannot use without the build host's shared libraries. Defining them
+ * here keeps glibc's out of the link: libnl prints protocol numbers
+ * instead of names and reports host names as unresolvable.
+ */
+struct protoent *getprotobyname(const char *name)
+{
+    (void)name;
+    return NULL;
+}
+
+struct protoent *getprotobynumber(int proto)
+{
+    (void)proto;
+    return NULL;
+}
+
+int getaddrinfo(const char *node, const char *service,
+                const struct addrinfo *hints, struct addrinfo **res)
+{
+    (void)node; (void)service; (void)hints;
+    *res = NULL;
+    return EAI_NONAME;
+}
+
+void freeaddrinfo(struct addrinfo *res)
+{
+    (void)res;
+}
+#endif
+
 /* nl80211 vendor response attribute IDs */
 /* vendor.h: enum brcmf_nlattrs */
 #define BRCMF_NLATTR_LEN     1
@@ -118,40 +254,276 @@ struct iovar_response {
     uint8_t *data;
     size_t   len;
     int      error;
+    char     msg[EXTACK_MSG_MAX];   /* kernel's extended-ACK text, or "" */
+};
+
+/* -------------------------------------------------------------------------
+ * Netlink session - one generic netlink socket shared by every command
+ * issued during a single invocation.
+ *
+ * Opening the socket and resolving the nl80211 family costs two extra
+ * round trips; multi-step commands (profiles, sampling) reuse it so that
+ * before/after measurements are not skewed by connection setup.
+ * ------------------------------------------------------------------------- */
+struct iovar_session {
+    struct nl_sock *sk;
+    int             nl80211_id;
+    int             ifindex;
+    char            ifname[IF_NAMESIZE];
+    int             emulated;   /* --emulate: no socket, see emu_batch */
+    int             cap_ack;    /* NETLINK_CAP_ACK enabled */
+    int             ext_ack;    /* NETLINK_EXT_ACK enabled */
+    size_t          rcvbuf;     /* SO_RCVBUF as the kernel reports it */
+    size_t          msg_buf;    /* libnl read buffer, 0 = libnl default */
+
+    /* Writes held across commands, see vendor_hold() */
+    int                     hold;
+    char                    where[128];     /* line now running */
+    char                    command[32];
+    struct vendor_deferred *deferred;
+    size_t                  n_deferred;
+};
+
+/* -------------------------------------------------------------------------
+ * Vendor requests
+ *
+ * Every request carries its own response. Requests can be sent back to
+ * back and their replies collected afterwards: the kernel answers each
+ * one with zero or more vendor replies followed by an ACK or error, all
+ * carrying the request's netlink sequence number, so replies are matched
+ * by sequence number rather than by arrival order. A single command is
+ * simply a batch of one.
+ *
+ * Requests marked unacked are sent without NLM_F_ACK. The kernel still
+ * answers them with an error if they fail, but says nothing on success.
+ * The kernel handles a socket's requests in order, so the ACK of any
+ * later request is a barrier: an unacked request with no error before
+ * it has succeeded. The last request of a batch is always acked, unless
+ * the session holds its writes (vendor_hold()): then unacked requests
+ * after the last ACK are deferred, and their errors are collected by
+ * whatever acked request comes next on the session.
+ * ------------------------------------------------------------------------- */
+struct vendor_req {
+    /* in */
+    uint32_t               cmd;
+    int                    is_set;
+    const uint8_t         *payload;
+    size_t                 payload_len;
+    int32_t                ret_len;
+    int                    unacked;     /* no ACK on success, see above */
+    const char            *label;       /* names it in a deferred error */
+
+    /* out */
+    struct iovar_response  resp;
+    struct timespec        done_ts;     /* ACK or error received */
+    uint32_t               ack_len;     /* bytes of that ACK or error */
+    int                    deferred;    /* held: no error so far */
+
+    /* private */
+    uint32_t               seq;
+    int                    sent;
+    int                    acked;       /* counted in vendor_batch.pending */
+    int                    done;
+    int                    redo;        /* reply lost, send again */
+    size_t                 cost;        /* receive buffer its replies take */
+};
+
+struct vendor_batch {
+    struct iovar_session *s;
+    struct vendor_req    *reqs;
+    size_t                n;
+    size_t                pending;
+    size_t                inflight;     /* cost of pending requests */
+    size_t                barrier;      /* requests before the last ACK */
+    int                   hold;         /* last request may go unacked */
+};
+
+/* A held write sent after the last ACK of its batch. Its error, if any,
+ * arrives while a later request is waited for. */
+#define VENDOR_DEFER_MAX    64
+
+struct vendor_deferred {
+    uint32_t seq;
+    int      err;                       /* 0 so far */
+    char     msg[EXTACK_MSG_MAX];
+    char     where[128];                /* line it came from, see hold */
+    char     command[32];
+    char     label[64];
 };
 
+static struct vendor_req *batch_find(struct vendor_batch *b, uint32_t seq)
+{
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        if (b->reqs[i].sent && b->reqs[i].seq == seq)
+            return &b->reqs[i];
+    }
+    return NULL;
+}
+
+static void batch_complete(struct vendor_batch *b, struct vendor_req *r,
+                           int error, uint32_t ack_len)
+{
+    if (!r || r->done)
+        return;
+    r->done = 1;
+    r->ack_len = ack_len;
+    clock_gettime(CLOCK_MONOTONIC, &r->done_ts);
+    if (r->resp.error == -EINPROGRESS || error != 0)
+        r->resp.error = error;
+    if (r->acked) {
+        b->pending--;
+        b->inflight -= r->cost;
+    }
+}
+
+/* The kernel answered acked request r, so it has run everything before */
+static void batch_barrier(struct vendor_batch *b, struct vendor_req *r)
+{
+    size_t i = (size_t)(r - b->reqs) + 1;
+
+    if (r->acked && !r->done && i > b->barrier)
+        b->barrier = i;
+}
+
+static struct vendor_deferred *deferred_find(struct iovar_session *s,
+                                             uint32_t seq)
+{
+    size_t i;
+
+    for (i = 0; i < s->n_deferred; i++) {
+        if (s->deferred[i].seq == seq)
+            return &s->deferred[i];
+    }
+    return NULL;
+}
+
+/* Give every held write still without an error this one; the barrier
+ * that would have told is lost */
+static void deferred_fail(struct iovar_session *s, int err, const char *msg)
+{
+    size_t i;
+
+    for (i = 0; i < s->n_deferred; i++) {
+        if (s->deferred[i].err == 0) {
+            s->deferred[i].err = err;
+            snprintf(s->deferred[i].msg, sizeof(s->deferred[i].msg), "%s",
+                     msg);
+        }
+    }
+}
+
+/* An ACK came in: held writes without an error have succeeded */
+static void deferred_bar(struct iovar_session *s)
+{
+    size_t i, keep = 0;
+
+    for (i = 0; i < s->n_deferred; i++) {
+        if (s->deferred[i].err != 0)
+            s->deferred[keep++] = s->deferred[i];
+    }
+    s->n_deferred = keep;
+}
+
+static void deferred_add(struct iovar_session *s, struct vendor_req *r)
+{
+    struct vendor_deferred *d;
+
+    if (!s->deferred)
+        s->deferred = calloc(VENDOR_DEFER_MAX, sizeof(*s->deferred));
+    if (!s->deferred || s->n_deferred == VENDOR_DEFER_MAX)
+        return;     /* vendor_batch_run() keeps room, not reached */
+
+    d = &s->deferred[s->n_deferred++];
+    memset(d, 0, sizeof(*d));
+    d->seq = r->seq;
+    snprintf(d->where, sizeof(d->where), "%s", s->where);
+    snprintf(d->command, sizeof(d->command), "%s", s->command);
+    snprintf(d->label, sizeof(d->label), "%s",
+             r->label ? r->label : "request");
+    r->deferred = 1;
+}
+
+/* -------------------------------------------------------------------------
+ * extack_msg - Copy the kernel's reason string out of a netlink error
+ *
+ * With NETLINK_EXT_ACK the error may carry attributes after the echoed
+ * request (or right after its header, with NETLINK_CAP_ACK). Only
+ * NLMSGERR_ATTR_MSG is of interest; buf is left alone if there is none.
+ * ------------------------------------------------------------------------- */
+static void extack_msg(struct nlmsghdr *nlh, const struct nlmsgerr *err,
+                       char *buf, size_t len)
+{
+    struct nlattr *tb[EXTACK_ATTR_MAX + 1];
+    size_t payload = sizeof(*err);
+    size_t off;
+
+    if (!(nlh->nlmsg_flags & NLM_F_ACK_TLVS))
+        return;
+    if (!(nlh->nlmsg_flags & NLM_F_CAPPED) &&
+        err->msg.nlmsg_len > NLMSG_HDRLEN)
+        payload += err->msg.nlmsg_len - NLMSG_HDRLEN;
+
+    off = NLMSG_HDRLEN + NLMSG_ALIGN(payload);
+    if (off >= nlh->nlmsg_len ||
+        nla_parse(tb, EXTACK_ATTR_MAX, (struct nlattr *)((uint8_t *)nlh + off),
+                  (int)(nlh->nlmsg_len - off), NULL) < 0 ||
+        !tb[EXTACK_ATTR_MSG])
+        return;
+    nla_strlcpy(buf, tb[EXTACK_ATTR_MSG], len);
+}
+
 /* -------------------------------------------------------------------------
  * nl80211 error handler - captures firmware/driver error codes
  * ------------------------------------------------------------------------- */
 static int error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
                          void *arg)
 {
-    struct iovar_response *resp = arg;
+    struct vendor_batch *b = arg;
+    struct nlmsghdr *nlh = (struct nlmsghdr *)((uint8_t *)err - NLMSG_HDRLEN);
+    struct vendor_req *r = batch_find(b, err->msg.nlmsg_seq);
+    struct vendor_deferred *d;
     (void)nla;
-    resp->error = err->error;
-    return NL_STOP;
+
+    if (!r) {
+        /* A held write from an earlier batch */
+        d = deferred_find(b->s, err->msg.nlmsg_seq);
+        if (d && d->err == 0) {
+            d->err = err->error;
+            extack_msg(nlh, err, d->msg, sizeof(d->msg));
+        }
+        return NL_SKIP;
+    }
+
+    if (!r->done) {
+        extack_msg(nlh, err, r->resp.msg, sizeof(r->resp.msg));
+        batch_barrier(b, r);
+    }
+    batch_complete(b, r, err->error, nlh->nlmsg_len);
+    return NL_SKIP;
 }
 
 /* -------------------------------------------------------------------------
- * nl80211 finish handler - signals completion of dump/multipart
+ * nl80211 ack / finish handler - signals successful command completion
  * ------------------------------------------------------------------------- */
-static int finish_handler(struct nl_msg *msg, void *arg)
+static int ack_handler(struct nl_msg *msg, void *arg)
 {
-    struct iovar_response *resp = arg;
-    (void)msg;
-    resp->error = 0;
+    struct vendor_batch *b = arg;
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    struct vendor_req *r = batch_find(b, nlh->nlmsg_seq);
+
+    if (r)
+        batch_barrier(b, r);
+    batch_complete(b, r, 0, nlh->nlmsg_len);
     return NL_SKIP;
 }
 
-/* -------------------------------------------------------------------------
- * nl80211 ack handler - signals successful command completion
- * ------------------------------------------------------------------------- */
-static int ack_handler(struct nl_msg *msg, void *arg)
+/* Replies are matched to requests by sequence number instead */
+static int seq_check_handler(struct nl_msg *msg, void *arg)
 {
-    struct iovar_response *resp = arg;
-    (void)msg;
-    resp->error = 0;
-    return NL_STOP;
+    (void)msg; (void)arg;
+    return NL_OK;
 }
 
 /* -------------------------------------------------------------------------
@@ -160,7 +532,10 @@ static int ack_handler(struct nl_msg *msg, void *arg)
  * The kernel brcmfmac vendor handler returns response data as:
  *   NL80211_ATTR_VENDOR_DATA containing:
  *     BRCMF_NLATTR_DATA (2) = response bytes
- *     BRCMF_NLATTR_LEN  (1) = chunk length (if multi-part, not typical)
+ *     BRCMF_NLATTR_LEN  (1) = chunk length
+ *
+ * Replies longer than one netlink message (about a page) are split by
+ * the kernel into several vendor replies; chunks are appended in order.
  * ------------------------------------------------------------------------- */
 static int response_handler(struct nl_msg *msg, void *arg)
 {
@@ -186,10 +561,12 @@ static int response_handler(struct nl_msg *msg, void *arg)
      */
     nla_for_each_nested(vendor_attr, tb[NL80211_ATTR_VENDOR_DATA], rem) {
         if (nla_type(vendor_attr) == BRCMF_NLATTR_DATA) {
-            resp->len = (size_t)nla_len(vendor_attr);
-            resp->data = malloc(resp->len);
-            if (resp->data) {
-                memcpy(resp->data, nla_data(vendor_attr), resp->len);
+            size_t chunk = (size_t)nla_len(vendor_attr);
+            uint8_t *grown = realloc(resp->data, resp->len + chunk);
+            if (grown) {
+                memcpy(grown + resp->len, nla_data(vendor_attr), chunk);
+                resp->data = grown;
+                resp->len += chunk;
             } else {
                 resp->error = -ENOMEM;
             }
@@ -200,238 +577,9354 @@ static int response_handler(struct nl_msg *msg, void *arg)
     return NL_SKIP;
 }
 
+static int netlink_option(struct nl_sock *sk, int opt, int on)
+{
+    return setsockopt(nl_socket_get_fd(sk), SOL_NETLINK, opt, &on,
+                      sizeof(on)) == 0 ? 0 : -errno;
+}
+
+static size_t rcvbuf_get(struct nl_sock *sk)
+{
+    int val = 0;
+    socklen_t len = sizeof(val);
+
+    if (getsockopt(nl_socket_get_fd(sk), SOL_SOCKET, SO_RCVBUF, &val,
+                   &len) != 0 || val < 0)
+        return 0;
+    return (size_t)val;
+}
+
+/* See the asynchronous error log below: sessions are opened and used
+ * by serve and hotplug too, whose errors must not block on stderr */
+static void log_error(const char *iovar, int err, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
 /* -------------------------------------------------------------------------
- * send_vendor_cmd - Send an nl80211 vendor command to brcmfmac
- *
- * Constructs and sends NL80211_CMD_VENDOR with:
- *   NL80211_ATTR_IFINDEX       = interface index
- *   NL80211_ATTR_VENDOR_ID     = BROADCOM_OUI (0x001018)
- *   NL80211_ATTR_VENDOR_SUBCMD = BRCMF_VNDR_CMDS_DCMD (1)
- *   NL80211_ATTR_VENDOR_DATA   = packed header + iovar payload
- *
- * Parameters:
- *   ifindex  - network interface index (from if_nametoindex)
- *   cmd      - BRCMF_C_GET_VAR (262) or BRCMF_C_SET_VAR (263)
- *   is_set   - 0 for get, 1 for set
- *   payload  - iovar name + optional value (already packed by caller)
- *   payload_len - length of payload
- *   ret_len  - expected return buffer length
- *   resp     - output: response data and error code
+ * session_open - Connect to generic netlink and resolve nl80211
  *
- * Returns: 0 on success, negative errno on failure
+ * Returns: 0 on success, negative error on failure
  * ------------------------------------------------------------------------- */
-static int send_vendor_cmd(int ifindex, uint32_t cmd, int is_set,
-                           const uint8_t *payload, size_t payload_len,
-                           int32_t ret_len, struct iovar_response *resp)
+static int session_open(struct iovar_session *s, int ifindex)
 {
-    struct nl_sock *sk = NULL;
-    struct nl_msg *msg = NULL;
-    struct nl_cb *cb = NULL;
-    int nl80211_id;
-    int ret = -1;
-    struct brcmf_vndr_dcmd_hdr hdr;
-    uint8_t *vendor_data = NULL;
-    size_t vendor_data_len;
+    int ret;
 
-    /* Initialise response */
-    memset(resp, 0, sizeof(*resp));
-    resp->error = -EINPROGRESS;
+    memset(s, 0, sizeof(*s));
+    s->ifindex = ifindex;
+    if (!if_indextoname((unsigned)ifindex, s->ifname))
+        snprintf(s->ifname, sizeof(s->ifname), "if%d", ifindex);
 
     /* Allocate netlink socket */
-    sk = nl_socket_alloc();
-    if (!sk) {
-        fprintf(stderr, "ERROR: Failed to allocate netlink socket\n");
+    s->sk = nl_socket_alloc();
+    if (!s->sk) {
+        log_error(NULL, 0, "ERROR: Failed to allocate netlink socket\n");
         return -ENOMEM;
     }
 
     /* Connect to generic netlink */
-    ret = genl_connect(sk);
+    ret = genl_connect(s->sk);
     if (ret < 0) {
-        fprintf(stderr, "ERROR: Failed to connect to generic netlink: %s\n",
-                nl_geterror(ret));
-        goto out;
+        log_error(NULL, 0, "ERROR: Failed to connect to generic netlink: "
+                  "%s\n", nl_geterror(ret));
+        goto fail;
     }
 
+    /* Header-only error replies and kernel reason strings; both are
+     * optional (Linux 4.3 / 4.12), the session works without them */
+    s->cap_ack = netlink_option(s->sk, NETLINK_CAP_ACK, 1) == 0;
+    s->ext_ack = netlink_option(s->sk, NETLINK_EXT_ACK, 1) == 0;
+    s->rcvbuf = rcvbuf_get(s->sk);
+
     /* Resolve nl80211 family ID */
-    nl80211_id = genl_ctrl_resolve(sk, "nl80211");
-    if (nl80211_id < 0) {
-        fprintf(stderr, "ERROR: nl80211 not found (is cfg80211 loaded?)\n");
-        ret = nl80211_id;
-        goto out;
+    s->nl80211_id = genl_ctrl_resolve(s->sk, "nl80211");
+    if (s->nl80211_id < 0) {
+        log_error(NULL, 0, "ERROR: nl80211 not found (is cfg80211 "
+                  "loaded?)\n");
+        ret = s->nl80211_id;
+        goto fail;
     }
 
+    return 0;
+
+fail:
+    nl_socket_free(s->sk);
+    s->sk = NULL;
+    return ret;
+}
+
+/* Session answered by the emulated firmware; no socket is opened */
+static void session_open_emulated(struct iovar_session *s, const char *ifname)
+{
+    memset(s, 0, sizeof(*s));
+    s->emulated = 1;
+    s->ifindex = (int)if_nametoindex(ifname);
+    snprintf(s->ifname, sizeof(s->ifname), "%s", ifname);
+}
+
+static void session_close(struct iovar_session *s)
+{
+    if (s->sk)
+        nl_socket_free(s->sk);
+    s->sk = NULL;
+    free(s->deferred);
+    s->deferred = NULL;
+    s->n_deferred = 0;
+}
+
+static int valid_handler(struct nl_msg *msg, void *arg)
+{
+    struct vendor_req *r = batch_find(arg, nlmsg_hdr(msg)->nlmsg_seq);
+
+    if (r && !r->done)
+        response_handler(msg, &r->resp);
+    return NL_SKIP;
+}
+
+/* Build NL80211_CMD_VENDOR for one request; NULL on allocation failure */
+static struct nl_msg *vendor_msg_build(struct iovar_session *s,
+                                       const struct vendor_req *r)
+{
+    struct brcmf_vndr_dcmd_hdr hdr;
+    struct nl_msg *msg;
+    uint8_t *vendor_data;
+    size_t vendor_data_len;
+
     /* Build the vendor data blob:
      *   [brcmf_vndr_dcmd_hdr][payload...]
      *
      * The header's offset field points to where payload begins
      * within the entire vendor data blob.
      */
-    vendor_data_len = sizeof(hdr) + payload_len;
+    vendor_data_len = sizeof(hdr) + r->payload_len;
     vendor_data = calloc(1, vendor_data_len);
-    if (!vendor_data) {
-        ret = -ENOMEM;
-        goto out;
-    }
+    if (!vendor_data)
+        return NULL;
 
     memset(&hdr, 0, sizeof(hdr));
-    hdr.cmd    = cmd;
-    hdr.len    = ret_len;
+    hdr.cmd    = r->cmd;
+    hdr.len    = r->ret_len;
     hdr.offset = sizeof(hdr);  /* payload starts right after header */
-    hdr.set    = is_set ? 1 : 0;
+    hdr.set    = r->is_set ? 1 : 0;
     hdr.magic  = 0;            /* not validated by mainline handler */
 
     memcpy(vendor_data, &hdr, sizeof(hdr));
-    memcpy(vendor_data + sizeof(hdr), payload, payload_len);
+    memcpy(vendor_data + sizeof(hdr), r->payload, r->payload_len);
 
-    /* Allocate nl80211 message */
-    msg = nlmsg_alloc();
-    if (!msg) {
-        fprintf(stderr, "ERROR: Failed to allocate netlink message\n");
-        ret = -ENOMEM;
-        goto out;
+    /* The default message size is one page; large set_buf payloads
+     * would silently lose NL80211_ATTR_VENDOR_DATA */
+    msg = nlmsg_alloc_size(NLMSG_HDRLEN + GENL_HDRLEN + 3 * nla_total_size(4) +
+                           nla_total_size((int)vendor_data_len));
+    if (msg &&
+        (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, s->nl80211_id, 0,
+                      0, NL80211_CMD_VENDOR, 0) ||
+         nla_put_u32(msg, NL80211_ATTR_IFINDEX, s->ifindex) < 0 ||
+         nla_put_u32(msg, NL80211_ATTR_VENDOR_ID, BROADCOM_OUI) < 0 ||
+         nla_put_u32(msg, NL80211_ATTR_VENDOR_SUBCMD,
+                     BRCMF_VNDR_CMDS_DCMD) < 0 ||
+         nla_put(msg, NL80211_ATTR_VENDOR_DATA, (int)vendor_data_len,
+                 vendor_data) < 0)) {
+        nlmsg_free(msg);
+        msg = NULL;
     }
 
-    /* Populate NL80211_CMD_VENDOR */
-    genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, nl80211_id, 0,
-                0, NL80211_CMD_VENDOR, 0);
+    free(vendor_data);
+    return msg;
+}
+
+static size_t emu_batch(struct vendor_req *reqs, size_t n);
 
-    nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifindex);
-    nla_put_u32(msg, NL80211_ATTR_VENDOR_ID, BROADCOM_OUI);
-    nla_put_u32(msg, NL80211_ATTR_VENDOR_SUBCMD, BRCMF_VNDR_CMDS_DCMD);
-    nla_put(msg, NL80211_ATTR_VENDOR_DATA, vendor_data_len, vendor_data);
+/* -------------------------------------------------------------------------
+ * Receive buffer sizing
+ *
+ * A batch's replies queue up in the socket until they are read. If they
+ * do not fit, the kernel drops them and reports ENOBUFS; if one message
+ * does not fit libnl's read buffer, it is cut off (MSG_TRUNC). Before
+ * sending, SO_RCVBUF is grown to the cost of the whole batch and the read
+ * buffer to its largest message. Where SO_RCVBUF cannot grow that far,
+ * requests are sent only while their replies fit (see send_vendor_batch).
+ *
+ * brcmfmac returns ret_len bytes in vendor replies of at most a page
+ * minus 256 bytes each. An error echoes the request unless
+ * NETLINK_CAP_ACK is on. The kernel charges each queued message at its
+ * allocated size, taken here as twice its length plus a fixed part.
+ * ------------------------------------------------------------------------- */
+#define VENDOR_CHUNK        (4096 - 256)    /* vendor.c: maxmsglen */
+#define VENDOR_MSG_OVERHEAD 128             /* nlmsg/genl headers, attrs */
+#define RCVBUF_MAX          (4u << 20)
+#define SKB_COST(len)       (2 * (len) + 512)
+#define VENDOR_RETRIES      3
 
-    /* Set up callback handlers */
-    cb = nl_cb_alloc(NL_CB_DEFAULT);
-    if (!cb) {
-        ret = -ENOMEM;
-        goto out;
+static size_t vendor_reply_cost(const struct iovar_session *s,
+                                const struct vendor_req *r, size_t *largest)
+{
+    size_t data = r->ret_len > 0 ? (size_t)r->ret_len : 0;
+    size_t chunk = data < VENDOR_CHUNK ? data : VENDOR_CHUNK;
+    size_t msg = chunk + VENDOR_MSG_OVERHEAD;
+    size_t err = NLMSG_HDRLEN + sizeof(struct nlmsgerr) + EXTACK_MSG_MAX;
+
+    if (!s->cap_ack)
+        err += VENDOR_MSG_OVERHEAD + sizeof(struct brcmf_vndr_dcmd_hdr) +
+               r->payload_len;
+    if (msg > *largest)
+        *largest = msg;
+    if (err > *largest)
+        *largest = err;
+    return (data / VENDOR_CHUNK + 1) * SKB_COST(msg) + SKB_COST(err);
+}
+
+static void vendor_buffers_fit(struct iovar_session *s,
+                               struct vendor_req *reqs, size_t n)
+{
+    size_t i, need = 0, largest = 0;
+    int fd = nl_socket_get_fd(s->sk);
+
+    for (i = 0; i < n; i++) {
+        reqs[i].cost = vendor_reply_cost(s, &reqs[i], &largest);
+        need += reqs[i].cost;
     }
 
-    nl_cb_err(cb, NL_CB_CUSTOM, error_handler, resp);
-    nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, resp);
-    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, resp);
-    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, response_handler, resp);
+    if (need > RCVBUF_MAX)
+        need = RCVBUF_MAX;
+    if (need > s->rcvbuf) {
+        /* The kernel doubles the value; FORCE passes rmem_max with
+         * CAP_NET_ADMIN, which nl80211 requires anyway */
+        int val = (int)(need / 2);
 
-    /* Send and receive */
-    ret = nl_send_auto(sk, msg);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: Failed to send netlink message: %s\n",
-                nl_geterror(ret));
-        goto out;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &val,
+                       sizeof(val)) != 0)
+            nl_socket_set_buffer_size(s->sk, val, 0);
+        s->rcvbuf = rcvbuf_get(s->sk);
     }
 
-    /* Process response(s) until completion */
-    while (resp->error == -EINPROGRESS) {
-        nl_recvmsgs(sk, cb);
+    if (largest > s->msg_buf) {
+        nl_socket_set_msg_buf_size(s->sk, largest);
+        s->msg_buf = largest;
     }
+}
 
-    ret = resp->error;
+/* Send one request; 0 or a negative errno, which is also stored in resp */
+static int vendor_send(struct iovar_session *s, struct vendor_batch *b,
+                       struct vendor_req *r, int last)
+{
+    struct nl_msg *msg = vendor_msg_build(s, r);
+    int ret;
 
-out:
-    if (cb)
-        nl_cb_put(cb);
-    if (msg)
-        nlmsg_free(msg);
-    free(vendor_data);
-    if (sk)
-        nl_socket_free(sk);
-    return ret;
+    if (!msg) {
+        log_error(NULL, 0, "ERROR: Failed to allocate netlink message\n");
+        r->resp.error = -ENOMEM;
+        return -ENOMEM;
+    }
+
+    /* nl_send_auto() adds NLM_F_ACK unless auto-ACK is off */
+    r->acked = !r->unacked || last;
+    if (!r->acked)
+        nl_socket_disable_auto_ack(s->sk);
+    ret = nl_send_auto(s->sk, msg);
+    nl_socket_enable_auto_ack(s->sk);
+    if (ret < 0) {
+        log_error(NULL, 0, "ERROR: Failed to send netlink message: %s\n",
+                  nl_geterror(ret));
+        r->resp.error = -EIO;
+    } else {
+        r->seq = nlmsg_hdr(msg)->nlmsg_seq;
+        r->sent = 1;
+        if (r->acked) {
+            b->pending++;
+            b->inflight += r->cost;
+        }
+    }
+    nlmsg_free(msg);
+    return ret < 0 ? -EIO : 0;
 }
 
 /* -------------------------------------------------------------------------
- * get_iovar_int - Read a 32-bit integer iovar from firmware
+ * vendor_overflow - Recover after replies were dropped or cut off
  *
- * For GET_VAR, the payload is the null-terminated iovar name.
- * The firmware replaces the buffer contents with the value.
- * ret_len must be large enough for the iovar name AND the response.
+ * The kernel handles each request while it is being sent, so every reply
+ * to the requests sent so far is already queued or lost. The survivors
+ * are read first. Reads are idempotent: every read sent so far is sent
+ * again, even one that completed, since a middle chunk of its data may
+ * be the part that was lost. A write whose ACK or error is missing has
+ * still run on the firmware, but its result is unknown.
  * ------------------------------------------------------------------------- */
-static int get_iovar_int(int ifindex, const char *iovar, uint32_t *value)
+static void vendor_overflow(struct iovar_session *s, struct vendor_batch *b,
+                            struct nl_cb *cb, int err, int attempt)
 {
-    struct iovar_response resp;
-    size_t name_len = strlen(iovar) + 1; /* include null terminator */
-    /* ret_len: firmware needs space to read name AND write response.
-     * For integer iovars, the response overwrites the name buffer.
-     * We need at least max(name_len, sizeof(uint32_t)). Add margin. */
-    int32_t ret_len = name_len > 256 ? name_len + 4 : 256;
-    int ret;
+    struct pollfd pfd = { .fd = nl_socket_get_fd(s->sk), .events = POLLIN };
+    size_t i;
 
-    ret = send_vendor_cmd(ifindex, BRCMF_C_GET_VAR, 0,
-                          (const uint8_t *)iovar, name_len,
-                          ret_len, &resp);
+    if (err == -NLE_MSG_TRUNC)
+        nl_socket_enable_msg_peek(s->sk);   /* never cut a message again */
 
-    if (ret != 0) {
-        fprintf(stderr, "ERROR: GET_VAR '%s' failed: %d (%s)\n",
-                iovar, ret, strerror(-ret));
-        return ret;
+    while (poll(&pfd, 1, 0) == 1)
+        nl_recvmsgs(s->sk, cb);
+
+    /* Errors of held writes may have been among the lost */
+    deferred_fail(s, -ENOBUFS, "reply lost in receive buffer overflow");
+
+    for (i = 0; i < b->n; i++) {
+        struct vendor_req *r = &b->reqs[i];
+
+        if (!r->sent)
+            continue;
+        if (!r->is_set && attempt < VENDOR_RETRIES) {
+            r->redo = 1;
+            batch_complete(b, r, -ENOBUFS, 0);
+        } else if (!r->done) {
+            snprintf(r->resp.msg, sizeof(r->resp.msg),
+                     "reply lost in receive buffer overflow");
+            batch_complete(b, r, -ENOBUFS, 0);
+        }
     }
+}
 
-    if (resp.data && resp.len >= sizeof(uint32_t)) {
-        memcpy(value, resp.data, sizeof(uint32_t));
-        /* Value is little-endian from firmware - host byte order on ARM */
-        free(resp.data);
-        return 0;
+static size_t vendor_batch_run(struct iovar_session *s,
+                               struct vendor_req *reqs, size_t n,
+                               int attempt);
+
+/* Send the requests marked redo again, as a batch of their own */
+static void vendor_redo(struct iovar_session *s, struct vendor_req *reqs,
+                        size_t n, int attempt)
+{
+    struct vendor_req *again;
+    size_t i, k = 0;
+
+    for (i = 0; i < n; i++)
+        k += reqs[i].redo;
+    if (k == 0)
+        return;
+
+    again = calloc(k, sizeof(*again));
+    for (i = 0, k = 0; again && i < n; i++) {
+        if (!reqs[i].redo)
+            continue;
+        free(reqs[i].resp.data);
+        reqs[i].resp.data = NULL;
+        again[k] = reqs[i];
+        again[k++].unacked = 0;
+    }
+    if (!again) {
+        for (i = 0; i < n; i++)
+            if (reqs[i].redo)
+                reqs[i].resp.error = -ENOMEM;
+        return;
     }
 
-    fprintf(stderr, "ERROR: GET_VAR '%s' returned insufficient data "
-            "(got %zu bytes, need %zu)\n", iovar, resp.len, sizeof(uint32_t));
-    free(resp.data);
-    return -ENODATA;
+    vendor_batch_run(s, again, k, attempt + 1);
+    for (i = 0, k = 0; i < n; i++) {
+        if (!reqs[i].redo)
+            continue;
+        reqs[i].resp = again[k].resp;
+        reqs[i].done_ts = again[k].done_ts;
+        reqs[i].ack_len = again[k++].ack_len;
+        reqs[i].redo = 0;
+    }
+    free(again);
 }
 
 /* -------------------------------------------------------------------------
- * set_iovar_int - Write a 32-bit integer iovar to firmware
+ * send_vendor_batch - Send several vendor commands, then collect replies
  *
- * For SET_VAR, the payload is:
- *   [iovar_name\0][uint32_t value]
- * The firmware reads the name, then the value following the null terminator.
+ * All requests are written to the socket before any reply is read. This
+ * does not overlap the firmware work: generic netlink runs each request
+ * to completion inside sendmsg(), including brcmfmac's synchronous
+ * firmware call, so every command still costs its own bus round trip.
+ * What is saved is the per-request recvmsg() wakeup and syscall; the
+ * queued replies are drained in as few reads as the buffer allows. If
+ * the receive buffer cannot hold all replies, sending pauses while the
+ * replies received so far are read.
+ *
+ * Each request's resp receives its data and error (0 or negative errno);
+ * resp.data is owned by the caller even on failure. Returns the number
+ * of requests that failed.
  * ------------------------------------------------------------------------- */
-static int set_iovar_int(int ifindex, const char *iovar, uint32_t value)
+static size_t vendor_batch_run(struct iovar_session *s,
+                               struct vendor_req *reqs, size_t n,
+                               int attempt)
 {
-    struct iovar_response resp;
-    size_t name_len = strlen(iovar) + 1;
-    size_t payload_len = name_len + sizeof(uint32_t);
-    uint8_t *payload;
+    struct vendor_batch b = { s, reqs, n, 0, 0, 0, 0 };
+    struct nl_cb *cb;
+    size_t i, next = 0, failed = 0;
     int ret;
 
-    payload = calloc(1, payload_len);
-    if (!payload)
-        return -ENOMEM;
+    for (i = 0; i < n; i++) {
+        memset(&reqs[i].resp, 0, sizeof(reqs[i].resp));
+        reqs[i].resp.error = -EINPROGRESS;
+        reqs[i].sent = 0;
+        reqs[i].acked = 0;
+        reqs[i].done = 0;
+        reqs[i].redo = 0;
+        reqs[i].deferred = 0;
+    }
 
-    /* Pack: "iovar_name\0" + le32(value) */
-    memcpy(payload, iovar, name_len);
-    memcpy(payload + name_len, &value, sizeof(uint32_t));
+    if (s->emulated)
+        return emu_batch(reqs, n);
 
-    ret = send_vendor_cmd(ifindex, BRCMF_C_SET_VAR, 1,
-                          payload, payload_len,
-                          (int32_t)payload_len, &resp);
+    cb = nl_cb_alloc(NL_CB_DEFAULT);
+    if (!cb) {
+        for (i = 0; i < n; i++)
+            reqs[i].resp.error = -ENOMEM;
+        return n;
+    }
 
-    free(payload);
-    free(resp.data);
+    nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &b);
+    nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, ack_handler, &b);
+    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &b);
+    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, valid_handler, &b);
+    nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, seq_check_handler, NULL);
 
-    if (ret != 0) {
-        fprintf(stderr, "ERROR: SET_VAR '%s' = %u failed: %d (%s)\n",
-                iovar, value, ret, strerror(-ret));
+    vendor_buffers_fit(s, reqs, n);
+    b.hold = s->hold && s->n_deferred + n <= VENDOR_DEFER_MAX;
+
+    /* Send while the replies fit, read while anything is pending */
+    while (next < n || b.pending > 0) {
+        if (next < n && (b.pending == 0 ||
+                         b.inflight + reqs[next].cost <= s->rcvbuf)) {
+            vendor_send(s, &b, &reqs[next], next == n - 1 && !b.hold);
+            next++;
+            continue;
+        }
+
+        ret = nl_recvmsgs(s->sk, cb);
+        if (ret == -NLE_NOMEM || ret == -NLE_MSG_TRUNC) {
+            vendor_overflow(s, &b, cb, ret, attempt);
+        } else if (ret < 0) {
+            log_error(NULL, 0, "ERROR: Failed to receive netlink reply: "
+                      "%s\n", nl_geterror(ret));
+            for (i = 0; i < n; i++) {
+                if (reqs[i].sent && !reqs[i].done)
+                    batch_complete(&b, &reqs[i], -EIO, 0);
+            }
+        }
     }
 
-    return ret;
+    nl_cb_put(cb);
+
+    /* Every ACK is in, so unacked requests before the last one without an
+     * error succeeded, as did held writes of earlier batches. Held ones
+     * after it wait for the session's next ACK. Others after it lost
+     * their barrier (its send failed): they ran, but nothing says how. */
+    if (b.barrier > 0)
+        deferred_bar(s);
+    for (i = 0; i < n; i++) {
+        struct vendor_req *r = &reqs[i];
+
+        if (!r->sent || r->done)
+            continue;
+        if (i < b.barrier) {
+            batch_complete(&b, r, 0, 0);
+        } else if (b.hold) {
+            deferred_add(s, r);
+            batch_complete(&b, r, 0, 0);
+        } else {
+            snprintf(r->resp.msg, sizeof(r->resp.msg),
+                     "result unknown: barrier not acknowledged");
+            batch_complete(&b, r, -EIO, 0);
+        }
+    }
+
+    vendor_redo(s, reqs, n, attempt);
+
+    for (i = 0; i < n; i++) {
+        if (reqs[i].resp.error != 0)
+            failed++;
+    }
+    return failed;
 }
 
-/* -------------------------------------------------------------------------
- * Usage and main
- * ------------------------------------------------------------------------- */
-static void usage(const char *prog)
+static size_t send_vendor_batch(struct iovar_session *s,
+                                struct vendor_req *reqs, size_t n)
 {
-    fprintf(stderr,
+    return vendor_batch_run(s, reqs, n, 0);
+}
+
+/* -------------------------------------------------------------------------
+ * send_vendor_cmd - Send an nl80211 vendor command to brcmfmac
+ *
+ * Constructs and sends NL80211_CMD_VENDOR with:
+ *   NL80211_ATTR_IFINDEX       = interface index
+ *   NL80211_ATTR_VENDOR_ID     = BROADCOM_OUI (0x001018)
+ *   NL80211_ATTR_VENDOR_SUBCMD = BRCMF_VNDR_CMDS_DCMD (1)
+ *   NL80211_ATTR_VENDOR_DATA   = packed header + iovar payload
+ *
+ * Parameters:
+ *   s        - open session (socket, nl80211 family, interface index)
+ *   cmd      - dongle command, e.g. BRCMF_C_GET_VAR (262)
+ *   is_set   - 0 for get, 1 for set
+ *   payload  - iovar name + optional value (already packed by caller)
+ *   payload_len - length of payload
+ *   ret_len  - expected return buffer length
+ *   resp     - output: response data and error code
+ *
+ * Returns: 0 on success, negative errno on failure.
+ * resp->data is owned by the caller even on failure.
+ * ------------------------------------------------------------------------- */
+static int send_vendor_cmd(struct iovar_session *s, uint32_t cmd, int is_set,
+                           const uint8_t *payload, size_t payload_len,
+                           int32_t ret_len, struct iovar_response *resp)
+{
+    struct vendor_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.cmd = cmd;
+    req.is_set = is_set;
+    req.payload = payload;
+    req.payload_len = payload_len;
+    req.ret_len = ret_len;
+
+    send_vendor_batch(s, &req, 1);
+    *resp = req.resp;
+    return resp->error;
+}
+
+/* -------------------------------------------------------------------------
+ * vendor_hold / vendor_release - One barrier for a run of commands
+ *
+ * Unacked writes save every ACK of a batch but the last, and a set of
+ * one name is a batch of its own. batch and shell hold the writes
+ * instead: nothing is acked just for being last, and the errors of held
+ * writes are collected by the next acked request on the session,
+ * whichever command sends it. vendor_release() sends one when the run
+ * ends. The errors are reported against the line that sent the write,
+ * see deferred_report(). At most VENDOR_DEFER_MAX writes are held.
+ * ------------------------------------------------------------------------- */
+static void vendor_hold(struct iovar_session *s, int on)
+{
+    s->hold = on;
+}
+
+static void vendor_release(struct iovar_session *s)
+{
+    struct vendor_req req;
+    uint32_t ver = 0;
+    size_t i;
+
+    for (i = 0; i < s->n_deferred && s->deferred[i].err != 0; i++)
+        ;
+    if (i == s->n_deferred)
+        return;
+
+    memset(&req, 0, sizeof(req));
+    req.cmd = BRCMF_C_GET_VERSION;
+    req.payload = (const uint8_t *)&ver;
+    req.payload_len = sizeof(ver);
+    req.ret_len = sizeof(ver);
+    send_vendor_batch(s, &req, 1);
+    free(req.resp.data);
+
+    /* Whatever the ACK did not settle stays unknown */
+    deferred_fail(s, -EIO, "result unknown: barrier not acknowledged");
+}
+
+/* strerror() followed by the kernel's extended-ACK reason, if it gave one */
+static const char *resp_strerror(int err, const struct iovar_response *resp)
+{
+    static char buf[EXTACK_MSG_MAX + 64];
+
+    if (resp->msg[0] == '\0')
+        return strerror(-err);
+    snprintf(buf, sizeof(buf), "%s: %s", strerror(-err), resp->msg);
+    return buf;
+}
+
+/* -------------------------------------------------------------------------
+ * Asynchronous error log for the long-running modes
+ *
+ * serve and hotplug must not stall their loop on a slow stderr (a busy
+ * journald, a full pipe) just when a burst of errors arrives. Between
+ * log_start() and log_stop(), log_error() only formats a record into a
+ * bounded ring and returns; a writer thread drains the ring to stderr as
+ * it was at log_start(). The ring is single-producer, single-consumer
+ * and lock-free: only the main thread logs, head is written by it alone
+ * and tail by the writer alone. A full ring drops the record and counts
+ * it instead of waiting; the writer reports the count as it grows.
+ *
+ * Records are logfmt lines:
+ *
+ *   seq=<n> [iovar=<name>] [errno=<err>] msg="<text>" [repeated=<n>]
+ *
+ * Every report takes a sequence number, also the dropped and repeated
+ * ones, so a gap shows where reports were lost. The same report (text,
+ * iovar and errno) again within LOG_REPEAT_MS is only counted; the count
+ * goes out with the next different report, the next repeat after the
+ * window, or at log_stop(), as a copy of the last one with repeated=<n>.
+ *
+ * Outside log_start()/log_stop(), and while paused (serve runs a client's
+ * command, whose stderr is the client), log_error() prints to stderr as
+ * before.
+ * ------------------------------------------------------------------------- */
+#define LOG_RING        256             /* power of two */
+#define LOG_MSG_MAX     160
+#define LOG_REPEAT_MS   5000
+
+struct log_record {
+    uint64_t seq;
+    int      err;
+    uint32_t repeated;
+    char     iovar[32];
+    char     msg[LOG_MSG_MAX];
+};
+
+struct log_state {
+    struct log_record ring[LOG_RING];
+    _Atomic size_t    head;             /* next record; producer only */
+    _Atomic size_t    tail;             /* next to write; writer only */
+    _Atomic uint64_t  dropped;
+    _Atomic int       sleeping;         /* writer waits for 'wake' */
+    _Atomic int       stop;
+    int               wake;             /* eventfd */
+    int               fd;               /* stderr at log_start() */
+    pthread_t         writer;
+
+    /* Main thread only */
+    int               paused;
+    uint64_t          seq;
+    struct log_record last;             /* last report queued */
+    struct timespec   last_ts;
+};
+
+static struct log_state *log_state;
+
+/* An eventfd write only fails on counter overflow, never here */
+static void log_wake(struct log_state *l)
+{
+    uint64_t one = 1;
+    ssize_t n = write(l->wake, &one, sizeof(one));
+
+    (void)n;
+}
+
+static void log_push(struct log_state *l, const struct log_record *rec)
+{
+    size_t head = atomic_load_explicit(&l->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&l->tail, memory_order_acquire);
+
+    if (head - tail == LOG_RING) {
+        atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    l->ring[head & (LOG_RING - 1)] = *rec;
+    atomic_store(&l->head, head + 1);
+
+    /* Pairs with the writer's sleeping/head check: one of us sees the
+     * other, so a record is never left behind a sleeping writer */
+    if (atomic_exchange(&l->sleeping, 0))
+        log_wake(l);
+}
+
+/* Queue the count of suppressed repeats, if any */
+static void log_repeats(struct log_state *l)
+{
+    if (l->last.repeated == 0)
+        return;
+    log_push(l, &l->last);
+    l->last.repeated = 0;
+}
+
+static void log_write(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return;
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void log_format(int fd, const struct log_record *r)
+{
+    char line[LOG_MSG_MAX * 2 + 128];
+    size_t len, i;
+
+    len = (size_t)snprintf(line, sizeof(line), "seq=%llu",
+                           (unsigned long long)r->seq);
+    if (r->iovar[0])
+        len += (size_t)snprintf(line + len, sizeof(line) - len,
+                                " iovar=%s", r->iovar);
+    if (r->err)
+        len += (size_t)snprintf(line + len, sizeof(line) - len,
+                                " errno=%d", r->err);
+    len += (size_t)snprintf(line + len, sizeof(line) - len, " msg=\"");
+    for (i = 0; r->msg[i]; i++) {
+        if (r->msg[i] == '"' || r->msg[i] == '\\')
+            line[len++] = '\\';
+        line[len++] = r->msg[i];
+    }
+    line[len++] = '"';
+    if (r->repeated)
+        len += (size_t)snprintf(line + len, sizeof(line) - len,
+                                " repeated=%u", r->repeated);
+    line[len++] = '\n';
+    log_write(fd, line, len);
+}
+
+static void *log_writer(void *arg)
+{
+    struct log_state *l = arg;
+    uint64_t reported = 0;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&l->tail, memory_order_relaxed);
+        uint64_t dropped = atomic_load_explicit(&l->dropped,
+                                                memory_order_relaxed);
+        struct pollfd pfd = { .fd = l->wake, .events = POLLIN };
+        uint64_t v;
+
+        if (dropped != reported) {
+            char line[80];
+            int len = snprintf(line, sizeof(line), "dropped=%llu msg=\"log "
+                               "queue full\"\n", (unsigned long long)dropped);
+
+            log_write(l->fd, line, (size_t)len);
+            reported = dropped;
+        }
+
+        if (tail != atomic_load_explicit(&l->head, memory_order_acquire)) {
+            log_format(l->fd, &l->ring[tail & (LOG_RING - 1)]);
+            atomic_store_explicit(&l->tail, tail + 1, memory_order_release);
+            continue;
+        }
+        if (atomic_load(&l->stop))
+            break;
+
+        atomic_store(&l->sleeping, 1);
+        if (tail != atomic_load(&l->head) || atomic_load(&l->stop)) {
+            atomic_store(&l->sleeping, 0);
+            continue;
+        }
+        if (poll(&pfd, 1, -1) > 0 && read(l->wake, &v, sizeof(v)) < 0)
+            v = 0;
+    }
+    return NULL;
+}
+
+/* Returns 0, or a negative errno and reports stay synchronous */
+static int log_start(void)
+{
+    struct log_state *l = calloc(1, sizeof(*l));
+    sigset_t all, old;
+    int ret = -1;
+
+    if (!l)
+        return -ENOMEM;
+    l->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    l->fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+
+    /* Signals must reach the main thread, where they end poll() */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (l->wake >= 0 && l->fd >= 0)
+        ret = pthread_create(&l->writer, NULL, log_writer, l);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0) {
+        if (l->wake >= 0)
+            close(l->wake);
+        if (l->fd >= 0)
+            close(l->fd);
+        free(l);
+        return -EAGAIN;
+    }
+    log_state = l;
+    return 0;
+}
+
+/* Flush what is queued, then report synchronously again */
+static void log_stop(void)
+{
+    struct log_state *l = log_state;
+
+    if (!l)
+        return;
+    log_repeats(l);
+    atomic_store(&l->stop, 1);
+    log_wake(l);
+    pthread_join(l->writer, NULL);
+    close(l->wake);
+    close(l->fd);
+    free(l);
+    log_state = NULL;
+}
+
+static void log_pause(int paused)
+{
+    if (log_state)
+        log_state->paused = paused;
+}
+
+/* An "ERROR: ...\n" report; iovar may be NULL, err 0 */
+static void log_error(const char *iovar, int err, const char *fmt, ...)
+{
+    struct log_state *l = log_state;
+    struct log_record rec;
+    struct timespec now;
+    size_t len;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (!l || l->paused) {
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.seq = ++l->seq;
+    rec.err = err;
+    snprintf(rec.iovar, sizeof(rec.iovar), "%s", iovar ? iovar : "");
+    vsnprintf(rec.msg, sizeof(rec.msg), fmt, ap);
+    va_end(ap);
+
+    /* The fields replace the "ERROR: " prefix, the line its newline */
+    len = strlen(rec.msg);
+    if (len > 0 && rec.msg[len - 1] == '\n')
+        rec.msg[len - 1] = '\0';
+    if (strncmp(rec.msg, "ERROR: ", 7) == 0)
+        memmove(rec.msg, rec.msg + 7, strlen(rec.msg + 7) + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (err == l->last.err && strcmp(rec.iovar, l->last.iovar) == 0 &&
+        strcmp(rec.msg, l->last.msg) == 0 &&
+        (now.tv_sec - l->last_ts.tv_sec) * 1000 +
+        (now.tv_nsec - l->last_ts.tv_nsec) / 1000000 < LOG_REPEAT_MS) {
+        l->last.seq = rec.seq;
+        l->last.repeated++;
+        return;
+    }
+    log_repeats(l);
+
+    log_push(l, &rec);
+    l->last = rec;
+    l->last_ts = now;
+}
+
+/* -------------------------------------------------------------------------
+ * get_iovar_int - Read a 32-bit integer iovar from firmware
+ *
+ * For GET_VAR, the payload is the null-terminated iovar name.
+ * The firmware replaces the buffer contents with the value.
+ * ret_len must be large enough for the iovar name AND the response.
+ * ------------------------------------------------------------------------- */
+static int get_iovar_int(struct iovar_session *s, const char *iovar,
+                         uint32_t *value)
+{
+    struct iovar_response resp;
+    size_t name_len = strlen(iovar) + 1; /* include null terminator */
+    /* ret_len: firmware needs space to read name AND write response.
+     * For integer iovars, the response overwrites the name buffer.
+     * We need at least max(name_len, sizeof(uint32_t)). Add margin. */
+    int32_t ret_len = name_len > 256 ? name_len + 4 : 256;
+    int ret;
+
+    ret = send_vendor_cmd(s, BRCMF_C_GET_VAR, 0,
+                          (const uint8_t *)iovar, name_len,
+                          ret_len, &resp);
+
+    if (ret != 0) {
+        log_error(iovar, ret, "ERROR: GET_VAR '%s' failed: %d (%s)\n",
+                  iovar, ret, resp_strerror(ret, &resp));
+        free(resp.data);
+        return ret;
+    }
+
+    if (resp.data && resp.len >= sizeof(uint32_t)) {
+        memcpy(value, resp.data, sizeof(uint32_t));
+        /* Value is little-endian from firmware - host byte order on ARM */
+        free(resp.data);
+        return 0;
+    }
+
+    log_error(iovar, -ENODATA, "ERROR: GET_VAR '%s' returned insufficient "
+              "data (got %zu bytes, need %zu)\n", iovar, resp.len,
+              sizeof(uint32_t));
+    free(resp.data);
+    return -ENODATA;
+}
+
+/* -------------------------------------------------------------------------
+ * iovar_probe_int - Quiet integer read for optional iovars
+ *
+ * Same as get_iovar_int() but prints nothing, so callers can treat
+ * "firmware does not have this iovar" (brcmfmac reports firmware errors
+ * as -EBADE) as a normal outcome.
+ * ------------------------------------------------------------------------- */
+static int iovar_probe_int(struct iovar_session *s, const char *iovar,
+                           uint32_t *value)
+{
+    struct iovar_response resp;
+    int ret;
+
+    ret = send_vendor_cmd(s, BRCMF_C_GET_VAR, 0, (const uint8_t *)iovar,
+                          strlen(iovar) + 1, 256, &resp);
+    if (ret == 0 && (!resp.data || resp.len < sizeof(uint32_t)))
+        ret = -ENODATA;
+    if (ret == 0)
+        memcpy(value, resp.data, sizeof(uint32_t));
+    free(resp.data);
+    return ret;
+}
+
+/* Buffer counterpart of iovar_probe_int(); *out_len as for get_iovar_buf() */
+static int iovar_probe_buf(struct iovar_session *s, const char *iovar,
+                           void *buf, size_t buf_len, size_t *out_len)
+{
+    struct iovar_response resp;
+    size_t name_len = strlen(iovar) + 1;
+    int ret;
+
+    ret = send_vendor_cmd(s, BRCMF_C_GET_VAR, 0, (const uint8_t *)iovar,
+                          name_len, (int32_t)(buf_len > name_len ?
+                                              buf_len : name_len), &resp);
+    if (ret == 0 && !resp.data)
+        ret = -ENODATA;
+    if (ret == 0) {
+        *out_len = resp.len < buf_len ? resp.len : buf_len;
+        memcpy(buf, resp.data, *out_len);
+    }
+    free(resp.data);
+    return ret;
+}
+
+/* -------------------------------------------------------------------------
+ * set_iovar_int - Write a 32-bit integer iovar to firmware
+ *
+ * For SET_VAR, the payload is:
+ *   [iovar_name\0][uint32_t value]
+ * The firmware reads the name, then the value following the null terminator.
+ * ------------------------------------------------------------------------- */
+static int set_iovar_int(struct iovar_session *s, const char *iovar,
+                         uint32_t value)
+{
+    struct iovar_response resp;
+    size_t name_len = strlen(iovar) + 1;
+    size_t payload_len = name_len + sizeof(uint32_t);
+    uint8_t *payload;
+    int ret;
+
+    payload = calloc(1, payload_len);
+    if (!payload)
+        return -ENOMEM;
+
+    /* Pack: "iovar_name\0" + le32(value) */
+    memcpy(payload, iovar, name_len);
+    memcpy(payload + name_len, &value, sizeof(uint32_t));
+
+    ret = send_vendor_cmd(s, BRCMF_C_SET_VAR, 1,
+                          payload, payload_len,
+                          (int32_t)payload_len, &resp);
+
+    free(payload);
+    free(resp.data);
+
+    if (ret != 0) {
+        log_error(iovar, ret, "ERROR: SET_VAR '%s' = %u failed: %d (%s)\n",
+                  iovar, value, ret, resp_strerror(ret, &resp));
+    }
+
+    return ret;
+}
+
+/* -------------------------------------------------------------------------
+ * get_iovar_buf - Read a structured (buffer) iovar from firmware
+ *
+ * Payload is [iovar_name\0][param...]. Some iovars take a parameter that
+ * selects what to return; most take none (param_len = 0).
+ * Up to buf_len bytes of the reply are copied to buf; *out_len receives
+ * the number of bytes copied.
+ * ------------------------------------------------------------------------- */
+static int get_iovar_buf(struct iovar_session *s, const char *iovar,
+                         const void *param, size_t param_len,
+                         void *buf, size_t buf_len, size_t *out_len)
+{
+    struct iovar_response resp;
+    size_t name_len = strlen(iovar) + 1;
+    size_t payload_len = name_len + param_len;
+    uint8_t *payload;
+    int ret;
+
+    payload = calloc(1, payload_len);
+    if (!payload)
+        return -ENOMEM;
+
+    memcpy(payload, iovar, name_len);
+    if (param_len)
+        memcpy(payload + name_len, param, param_len);
+
+    ret = send_vendor_cmd(s, BRCMF_C_GET_VAR, 0, payload, payload_len,
+                          (int32_t)(buf_len > payload_len ?
+                                    buf_len : payload_len),
+                          &resp);
+    free(payload);
+
+    if (ret != 0) {
+        log_error(iovar, ret, "ERROR: GET_VAR '%s' failed: %d (%s)\n",
+                  iovar, ret, resp_strerror(ret, &resp));
+        free(resp.data);
+        return ret;
+    }
+
+    if (!resp.data) {
+        log_error(iovar, -ENODATA, "ERROR: GET_VAR '%s' returned no data\n",
+                  iovar);
+        return -ENODATA;
+    }
+
+    *out_len = resp.len < buf_len ? resp.len : buf_len;
+    memcpy(buf, resp.data, *out_len);
+    free(resp.data);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * set_iovar_buf - Write a structured (buffer) iovar to firmware
+ *
+ * Payload is [iovar_name\0][data...], same framing as set_iovar_int().
+ * ------------------------------------------------------------------------- */
+static int set_iovar_buf(struct iovar_session *s, const char *iovar,
+                         const void *data, size_t data_len)
+{
+    struct iovar_response resp;
+    size_t name_len = strlen(iovar) + 1;
+    size_t payload_len = name_len + data_len;
+    uint8_t *payload;
+    int ret;
+
+    payload = calloc(1, payload_len);
+    if (!payload)
+        return -ENOMEM;
+
+    memcpy(payload, iovar, name_len);
+    if (data_len)
+        memcpy(payload + name_len, data, data_len);
+
+    ret = send_vendor_cmd(s, BRCMF_C_SET_VAR, 1, payload, payload_len,
+                          (int32_t)payload_len, &resp);
+
+    free(payload);
+    free(resp.data);
+
+    if (ret != 0) {
+        log_error(iovar, ret,
+                  "ERROR: SET_VAR '%s' (%zu bytes) failed: %d (%s)\n",
+                  iovar, data_len, ret, resp_strerror(ret, &resp));
+    }
+
+    return ret;
+}
+
+/* -------------------------------------------------------------------------
+ * get_dcmd_buf - Read a structure through a plain dongle command
+ *
+ * buf is sent as the request (most get commands expect it zeroed, some
+ * take a selector such as a MAC address) and overwritten with the reply.
+ * ------------------------------------------------------------------------- */
+static int get_dcmd_buf(struct iovar_session *s, uint32_t cmd,
+                        const char *label, void *buf, size_t len)
+{
+    struct iovar_response resp;
+    int ret;
+
+    ret = send_vendor_cmd(s, cmd, 0, buf, len, (int32_t)len, &resp);
+
+    if (ret != 0) {
+        log_error(label, ret, "ERROR: dcmd %u (%s) get failed: %d (%s)\n",
+                  cmd, label, ret, resp_strerror(ret, &resp));
+        free(resp.data);
+        return ret;
+    }
+
+    if (resp.data && resp.len >= len) {
+        memcpy(buf, resp.data, len);
+        free(resp.data);
+        return 0;
+    }
+
+    log_error(label, -ENODATA, "ERROR: dcmd %u (%s) returned insufficient "
+              "data (got %zu bytes, need %zu)\n", cmd, label, resp.len, len);
+    free(resp.data);
+    return -ENODATA;
+}
+
+/* -------------------------------------------------------------------------
+ * get_dcmd_int / set_dcmd_int - 32-bit value through a plain dongle command
+ *
+ * Some firmware settings (frame bursting, band, antenna) are not iovars but
+ * numbered dongle commands. The vendor handler passes any cmd through, so
+ * these use the same path with a 4-byte payload instead of a name.
+ * ------------------------------------------------------------------------- */
+static int get_dcmd_int(struct iovar_session *s, uint32_t cmd,
+                        const char *label, uint32_t *value)
+{
+    *value = 0;
+    return get_dcmd_buf(s, cmd, label, value, sizeof(*value));
+}
+
+static int set_dcmd_int(struct iovar_session *s, uint32_t cmd,
+                        const char *label, uint32_t value)
+{
+    struct iovar_response resp;
+    int ret;
+
+    ret = send_vendor_cmd(s, cmd, 1, (const uint8_t *)&value, sizeof(value),
+                          (int32_t)sizeof(value), &resp);
+    free(resp.data);
+
+    if (ret != 0) {
+        log_error(label, ret, "ERROR: dcmd %u (%s) = %u failed: %d (%s)\n",
+                  cmd, label, value, ret, resp_strerror(ret, &resp));
+    }
+
+    return ret;
+}
+
+/* -------------------------------------------------------------------------
+ * Little-endian field access for firmware structures
+ * ------------------------------------------------------------------------- */
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, (uint16_t)v);
+    put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* -------------------------------------------------------------------------
+ * WMM / EDCA parameters ("wme_ac_sta" iovar)
+ *
+ * GET returns one edcf_acparam_t per access category; SET takes a single
+ * edcf_acparam_t and the ACI bits select which category it replaces.
+ * The AP advertises EDCA parameters in its beacons and the firmware
+ * re-applies them when the advertised parameter set changes, so local
+ * overrides last until the next reassociation or AP-side change.
+ * ------------------------------------------------------------------------- */
+#define WME_AC_COUNT    4
+
+static const char *const wme_ac_names[WME_AC_COUNT] = {
+    "be", "bk", "vi", "vo"      /* index = ACI */
+};
+
+/* wlioctl.h: edcf_acparam_t */
+struct edcf_acparam {
+    uint8_t  aci;       /* [3:0] AIFSN, [4] ACM, [6:5] ACI */
+    uint8_t  ecw;       /* [3:0] ECWmin, [7:4] ECWmax (CW = 2^ECW - 1) */
+    uint16_t txop;      /* TXOP limit in 32 us units, little-endian */
+} __attribute__((packed));
+
+enum wme_field {
+    WME_AIFSN,
+    WME_ECWMIN,
+    WME_ECWMAX,
+    WME_TXOP,
+};
+
+static int wme_read(struct iovar_session *s,
+                    struct edcf_acparam ac[WME_AC_COUNT])
+{
+    struct edcf_acparam buf[WME_AC_COUNT];
+    unsigned seen = 0;
+    size_t len = 0;
+    int ret, i;
+
+    ret = get_iovar_buf(s, "wme_ac_sta", NULL, 0, buf, sizeof(buf), &len);
+    if (ret != 0)
+        return ret;
+    if (len < sizeof(buf)) {
+        log_error("wme_ac_sta", -ENODATA,
+                  "ERROR: wme_ac_sta returned %zu bytes, need %zu\n",
+                  len, sizeof(buf));
+        return -ENODATA;
+    }
+
+    /* Each ACI must appear exactly once, or an AC would be missing and
+     * a later write would send stale or zeroed parameters for it */
+    memset(ac, 0, sizeof(buf));
+    for (i = 0; i < WME_AC_COUNT; i++) {
+        unsigned aci = (buf[i].aci >> 5) & 3;
+
+        if (seen & (1u << aci)) {
+            log_error("wme_ac_sta", -EPROTO, "ERROR: wme_ac_sta lists "
+                      "ACI %u twice\n", aci);
+            return -EPROTO;
+        }
+        seen |= 1u << aci;
+        ac[aci] = buf[i];
+    }
+    return 0;
+}
+
+static int wme_write(struct iovar_session *s, const struct edcf_acparam *p)
+{
+    return set_iovar_buf(s, "wme_ac_sta", p, sizeof(*p));
+}
+
+static uint32_t wme_field_get(const struct edcf_acparam *p,
+                              enum wme_field field)
+{
+    switch (field) {
+    case WME_AIFSN:  return p->aci & 0x0f;
+    case WME_ECWMIN: return p->ecw & 0x0f;
+    case WME_ECWMAX: return p->ecw >> 4;
+    case WME_TXOP:   return get_le16((const uint8_t *)&p->txop);
+    }
+    return 0;
+}
+
+static void wme_field_set(struct edcf_acparam *p, enum wme_field field,
+                          uint32_t value)
+{
+    uint8_t *txop = (uint8_t *)&p->txop;
+
+    switch (field) {
+    case WME_AIFSN:
+        p->aci = (uint8_t)((p->aci & 0xf0) | (value & 0x0f));
+        break;
+    case WME_ECWMIN:
+        p->ecw = (uint8_t)((p->ecw & 0xf0) | (value & 0x0f));
+        break;
+    case WME_ECWMAX:
+        p->ecw = (uint8_t)((p->ecw & 0x0f) | ((value & 0x0f) << 4));
+        break;
+    case WME_TXOP:
+        txop[0] = (uint8_t)value;
+        txop[1] = (uint8_t)(value >> 8);
+        break;
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Typed iovar registry
+ *
+ * Known settings with their access method and accepted range, so that
+ * `get`/`set` can validate values and profiles can mix iovars and plain
+ * dongle commands. Ranges are what the firmware accepts on CYW43455
+ * 7.45.x; anything outside is rejected before it reaches the dongle.
+ * ------------------------------------------------------------------------- */
+enum iovar_kind {
+    IOVAR_INT,      /* GET_VAR/SET_VAR with a 32-bit value */
+    DCMD_INT,       /* plain dongle command get/set pair */
+    WME_PARAM,      /* one field of one AC in wme_ac_sta */
+};
+
+struct iovar_def {
+    const char     *name;
+    enum iovar_kind kind;
+    uint32_t        get_cmd;    /* DCMD_INT: get command; WME_PARAM: ACI */
+    uint32_t        set_cmd;    /* DCMD_INT: set command; WME_PARAM: field */
+    uint32_t        min;
+    uint32_t        max;
+    const char     *desc;
+};
+
+#define WME_DEFS(ac, AC, aci) \
+    { "wme_" ac "_aifsn",  WME_PARAM, aci, WME_AIFSN,  1, 15, \
+      "EDCA AIFSN, AC_" AC }, \
+    { "wme_" ac "_ecwmin", WME_PARAM, aci, WME_ECWMIN, 0, 15, \
+      "EDCA CWmin exponent (CW = 2^n - 1), AC_" AC }, \
+    { "wme_" ac "_ecwmax", WME_PARAM, aci, WME_ECWMAX, 0, 15, \
+      "EDCA CWmax exponent (CW = 2^n - 1), AC_" AC }, \
+    { "wme_" ac "_txop",   WME_PARAM, aci, WME_TXOP,   0, 65535, \
+      "EDCA TXOP limit in 32 us units, AC_" AC }
+
+static const struct iovar_def iovar_registry[] = {
+    { "btc_mode",        IOVAR_INT, 0, 0, 0, 5,
+      "BT coexistence mode (see btc_mode values)" },
+    { "ampdu",           IOVAR_INT, 0, 0, 0, 1,
+      "A-MPDU aggregation enable" },
+    { "ampdu_density",   IOVAR_INT, 0, 0, 0, 7,
+      "minimum MPDU start spacing (0 = none .. 7 = 16 us)" },
+    { "ampdu_ba_wsize",  IOVAR_INT, 0, 0, 1, 64,
+      "block-ack window size offered to peers" },
+    { "ampdu_rx_factor", IOVAR_INT, 0, 0, 0, 3,
+      "max rx A-MPDU length exponent (8K << n)" },
+    { "ampdu_mpdu",      IOVAR_INT, 0, 0, 1, 64,
+      "max MPDUs per transmitted A-MPDU" },
+    { "frameburst",      DCMD_INT, BRCMF_C_GET_FAKEFRAG,
+      BRCMF_C_SET_FAKEFRAG, 0, 1,
+      "frame bursting (TXOP sharing) enable" },
+    { "roam_off",        IOVAR_INT, 0, 0, 0, 1,
+      "disable firmware roaming" },
+    { "scansuppress",    DCMD_INT, BRCMF_C_GET_SCANSUPPRESS,
+      BRCMF_C_SET_SCANSUPPRESS, 0, 1,
+      "reject all scans, host- and firmware-initiated" },
+    { "txant",           DCMD_INT, BRCMF_C_GET_TXANT,
+      BRCMF_C_SET_TXANT, 0, 3,
+      "TX antenna (0, 1, 3 = auto)" },
+    { "antdiv",          DCMD_INT, BRCMF_C_GET_ANTDIV,
+      BRCMF_C_SET_ANTDIV, 0, 3,
+      "RX antenna diversity (0, 1 = fixed, 3 = auto)" },
+    { "band",            DCMD_INT, BRCMF_C_GET_BAND,
+      BRCMF_C_SET_BAND, 0, 2,
+      "band preference (0 = auto, 1 = 5 GHz only, 2 = 2.4 GHz only)" },
+    { "arpoe",           IOVAR_INT, 0, 0, 0, 1,
+      "ARP offload enable" },
+    { "arp_ol",          IOVAR_INT, 0, 0, 0, 15,
+      "ARP offload mode bits (1 agent, 2 snoop, 4 host, 8 peer reply)" },
+    { "ndoe",            IOVAR_INT, 0, 0, 0, 1,
+      "IPv6 neighbour discovery offload enable" },
+    { "pkt_filter_mode", IOVAR_INT, 0, 0, 0, 1,
+      "packet filter mode (1 = forward on match)" },
+    { "bus:txglom",      IOVAR_INT, 0, 0, 0, 1,
+      "SDIO tx glomming (dongle to host aggregation)" },
+    { "bus:txglomalign", IOVAR_INT, 0, 0, 4, 512,
+      "SDIO tx glom alignment in bytes" },
+    { "bus:rxglom",      IOVAR_INT, 0, 0, 0, 1,
+      "SDIO rx glomming (host to dongle; fixed at driver init)" },
+    WME_DEFS("be", "BE", 0),
+    WME_DEFS("bk", "BK", 1),
+    WME_DEFS("vi", "VI", 2),
+    WME_DEFS("vo", "VO", 3),
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const struct iovar_def *iovar_lookup(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(iovar_registry); i++) {
+        if (strcmp(iovar_registry[i].name, name) == 0)
+            return &iovar_registry[i];
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------
+ * Emulated firmware (--emulate)
+ *
+ * Answers vendor requests in-process instead of sending them to nl80211,
+ * so the request, output and sampling paths can run and be profiled
+ * without a brcmfmac device ('make pgo'). Integer settings from the
+ * registry keep the last value written and read 0 until then; the sensor
+ * values below read plausible, slowly changing numbers, and the counters,
+ * btc_stats and "dump ampdu" buffers are synthesised (emu_buffer).
+ * Anything else, including the other buffer iovars (wme_ac_sta), fails
+ * with -EBADE like firmware that lacks it.
+ * ------------------------------------------------------------------------- */
+#define EMU_SLOTS       64
+#define EMU_NAME_MAX    32
+
+struct emu_slot {
+    char        name[EMU_NAME_MAX];     /* iovar; "" for a dongle command */
+    uint32_t    cmd;                    /* dongle get command, 0 for iovars */
+    uint32_t    value;
+};
+
+static const struct {
+    const char *name;
+    uint32_t    cmd;
+    uint32_t    value;
+    uint32_t    drift;                  /* reads value + tick % drift */
+} emu_sensors[] = {
+    { "phy_tempsense",  0,                47,            4 },
+    { "phy_tempthresh", 0,                90,            0 },
+    { "qtxpower",       0,                72,            0 },
+    { "pwrthrottle",    0,                0,             0 },
+    { "",               BRCMF_C_GET_RSSI, (uint32_t)-58, 6 },
+    { "",               BRCMF_C_GET_RATE, 2 * 433,       0 },
+};
+
+static struct {
+    struct emu_slot slot[EMU_SLOTS];
+    size_t          n;
+    uint32_t        tick;               /* requests answered */
+    struct timespec start;              /* first buffer request */
+} emu;
+
+static struct emu_slot *emu_slot(const char *name, uint32_t cmd, int create)
+{
+    size_t i;
+
+    for (i = 0; i < emu.n; i++) {
+        if (emu.slot[i].cmd == cmd && strcmp(emu.slot[i].name, name) == 0)
+            return &emu.slot[i];
+    }
+    if (!create || emu.n == EMU_SLOTS || strlen(name) >= EMU_NAME_MAX)
+        return NULL;
+
+    snprintf(emu.slot[emu.n].name, EMU_NAME_MAX, "%s", name);
+    emu.slot[emu.n].cmd = cmd;
+    emu.slot[emu.n].value = 0;
+    return &emu.slot[emu.n++];
+}
+
+/* Initial value of a setting the emulated firmware knows; 0 if unknown */
+static int emu_known(const char *name, uint32_t cmd, uint32_t *value)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(emu_sensors); i++) {
+        uint32_t drift = emu_sensors[i].drift;
+
+        if (emu_sensors[i].cmd == cmd &&
+            strcmp(emu_sensors[i].name, name) == 0) {
+            *value = emu_sensors[i].value + (drift ? emu.tick % drift : 0);
+            return 1;
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(iovar_registry); i++) {
+        const struct iovar_def *def = &iovar_registry[i];
+
+        if ((cmd == 0 && def->kind == IOVAR_INT &&
+             strcmp(def->name, name) == 0) ||
+            (cmd != 0 && def->kind == DCMD_INT && def->get_cmd == cmd)) {
+            *value = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Synthetic buffer iovars, enough for the counters, coex and AMPDU paths
+ * (watch, coex, probe, profile-verify) to run their decoders. Totals grow
+ * with the time since the first request at the per-second rates below;
+ * A-MPDUs carry ampdu_mpdu MPDUs as last written (default 32), so
+ * profile switches show up in profile-verify.
+ */
+#define EMU_CNT_VERSION     10          /* legacy wl_cnt_t, see counters */
+#define EMU_CNT_WORDS       64
+
+static const struct {
+    unsigned    idx;                    /* legacy wl_cnt_t u32 index */
+    uint32_t    per_s;
+} emu_counters[] = {
+    { 0,  900 },                        /* txframe */
+    { 1,  900 * 1400 },                 /* txbyte */
+    { 2,  45 },                         /* txretrans */
+    { 3,  2 },                          /* txerror */
+    { 4,  6 },                          /* txctl */
+    { 15, 1200 },                       /* rxframe */
+    { 16, 1200 * 1100 },                /* rxbyte */
+    { 17, 3 },                          /* rxerror */
+    { 18, 40 },                         /* rxctl */
+};
+
+/* wlc_btc_stats_t version 1 running counters, from bt_req_cnt on */
+static const uint32_t emu_btc_per_s[] = { 220, 180, 9000, 1, 0, 2 };
+
+static double emu_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (emu.start.tv_sec == 0 && emu.start.tv_nsec == 0)
+        emu.start = now;
+    return (double)(now.tv_sec - emu.start.tv_sec) +
+           (double)(now.tv_nsec - emu.start.tv_nsec) / 1e9;
+}
+
+/* 0 with r->resp filled, -EBADE for a buffer iovar it does not have */
+static int emu_buffer(const char *name, const uint8_t *param,
+                      size_t param_len, struct vendor_req *r)
+{
+    double t = emu_seconds();
+    uint8_t *buf;
+    size_t i, len;
+
+    if (strcmp(name, "counters") == 0) {
+        len = 4 + 4 * EMU_CNT_WORDS;
+        buf = calloc(1, len);
+        if (!buf)
+            return -ENOMEM;
+        put_le16(buf, EMU_CNT_VERSION);
+        put_le16(buf + 2, (uint16_t)len);
+        for (i = 0; i < ARRAY_SIZE(emu_counters); i++)
+            put_le32(buf + 4 + 4 * emu_counters[i].idx,
+                     (uint32_t)(uint64_t)(emu_counters[i].per_s * t));
+    } else if (strcmp(name, "btc_stats") == 0) {
+        len = 44;
+        buf = calloc(1, len);
+        if (!buf)
+            return -ENOMEM;
+        put_le16(buf, 1);                       /* version */
+        put_le16(buf + 2, 1);                   /* valid */
+        put_le32(buf + 4, (uint32_t)(t * 1000));
+        put_le32(buf + 12, 0x3);                /* bt_req_type_map */
+        for (i = 0; i < ARRAY_SIZE(emu_btc_per_s); i++)
+            put_le32(buf + 16 + 4 * i,
+                     (uint32_t)(uint64_t)(emu_btc_per_s[i] * t));
+    } else if (strcmp(name, "dump") == 0 && param_len >= 6 &&
+               memcmp(param, "ampdu", 6) == 0) {
+        const struct emu_slot *mpdu = emu_slot("ampdu_mpdu", 0, 0);
+        uint32_t per = mpdu && mpdu->value ? mpdu->value : 32;
+        uint32_t ampdus = (uint32_t)(uint64_t)(6000.0 / per * t);
+        uint32_t rx = (uint32_t)(uint64_t)(150 * t);
+
+        buf = malloc(512);
+        if (!buf)
+            return -ENOMEM;
+        len = (size_t)snprintf((char *)buf, 512,
+            "AMPDU counters:\n"
+            "txampdu %u txmpdu %u txmpduperampdu %u noampdu 0 "
+            "retry_ampdu %u retry_mpdu %u\n"
+            "txbar %u rxba %u\n"
+            "rxampdu %u rxmpdu %u rxmpduperampdu 8 rxht %u rxlegacy 0\n"
+            "rxholes %u rxdup %u\n",
+            ampdus, ampdus * per, per, ampdus / 50, ampdus * per / 40,
+            ampdus / 200, ampdus, rx, rx * 8, rx * 8, rx / 30, rx / 90) + 1;
+    } else {
+        return -EBADE;
+    }
+
+    r->resp.data = buf;
+    r->resp.len = len;
+    return 0;
+}
+
+static int emu_answer(struct vendor_req *r)
+{
+    const char *name = "";
+    struct emu_slot *slot;
+    uint32_t cmd = 0, value = 0;
+    size_t i, off = 0, len;
+
+    emu.tick++;
+    if (r->cmd == BRCMF_C_GET_VAR || r->cmd == BRCMF_C_SET_VAR) {
+        if (!memchr(r->payload, '\0', r->payload_len))
+            return -EINVAL;
+        name = (const char *)r->payload;
+        off = strlen(name) + 1;
+        if (!r->is_set && !emu_slot(name, 0, 0) && !emu_known(name, 0, &value))
+            return emu_buffer(name, r->payload + off, r->payload_len - off,
+                              r);
+    } else {
+        /* Writes are stored under the matching get command */
+        cmd = r->cmd;
+        for (i = 0; r->is_set && i < ARRAY_SIZE(iovar_registry); i++) {
+            if (iovar_registry[i].kind == DCMD_INT &&
+                iovar_registry[i].set_cmd == r->cmd)
+                cmd = iovar_registry[i].get_cmd;
+        }
+    }
+
+    slot = emu_slot(name, cmd, 0);
+    if (slot)
+        value = slot->value;
+    else if (!emu_known(name, cmd, &value))
+        return -EBADE;
+
+    if (r->is_set) {
+        if (r->payload_len < off + sizeof(uint32_t))
+            return -EINVAL;
+        slot = slot ? slot : emu_slot(name, cmd, 1);
+        if (!slot)
+            return -ENOMEM;
+        memcpy(&slot->value, r->payload + off, sizeof(uint32_t));
+        return 0;
+    }
+
+    /* A dongle command answers in the buffer it was given (GET_RSSI: a
+     * whole scb_val_t), the value in its first word */
+    len = cmd && r->payload_len > sizeof(uint32_t) ? r->payload_len :
+                                                     sizeof(uint32_t);
+    r->resp.data = calloc(1, len);
+    if (!r->resp.data)
+        return -ENOMEM;
+    if (cmd)
+        memcpy(r->resp.data, r->payload, r->payload_len);
+    memcpy(r->resp.data, &value, sizeof(uint32_t));
+    r->resp.len = len;
+    return 0;
+}
+
+/* send_vendor_batch for an emulated session */
+static size_t emu_batch(struct vendor_req *reqs, size_t n)
+{
+    size_t i, failed = 0;
+
+    for (i = 0; i < n; i++) {
+        reqs[i].resp.error = emu_answer(&reqs[i]);
+        reqs[i].done = 1;
+        clock_gettime(CLOCK_MONOTONIC, &reqs[i].done_ts);
+        if (reqs[i].resp.error != 0)
+            failed++;
+    }
+    return failed;
+}
+
+static int iovar_read(struct iovar_session *s, const struct iovar_def *def,
+                      uint32_t *value)
+{
+    if (def->kind == WME_PARAM) {
+        struct edcf_acparam ac[WME_AC_COUNT];
+        int ret = wme_read(s, ac);
+
+        if (ret == 0)
+            *value = wme_field_get(&ac[def->get_cmd], def->set_cmd);
+        return ret;
+    }
+    if (def->kind == DCMD_INT)
+        return get_dcmd_int(s, def->get_cmd, def->name, value);
+    return get_iovar_int(s, def->name, value);
+}
+
+static int iovar_write(struct iovar_session *s, const struct iovar_def *def,
+                       uint32_t value)
+{
+    if (value < def->min || value > def->max) {
+        log_error(def->name, -ERANGE,
+                  "ERROR: %s = %u out of range (%u..%u)\n",
+                  def->name, value, def->min, def->max);
+        return -ERANGE;
+    }
+
+    if (def->kind == WME_PARAM) {
+        struct edcf_acparam ac[WME_AC_COUNT];
+        int ret = wme_read(s, ac);
+
+        if (ret != 0)
+            return ret;
+        wme_field_set(&ac[def->get_cmd], def->set_cmd, value);
+        return wme_write(s, &ac[def->get_cmd]);
+    }
+    if (def->kind == DCMD_INT)
+        return set_dcmd_int(s, def->set_cmd, def->name, value);
+    return set_iovar_int(s, def->name, value);
+}
+
+/* -------------------------------------------------------------------------
+ * iovar_ops_run - Several gets/sets over one session, pipelined
+ *
+ * Raw iovars and typed iovar/dcmd settings are sent back to back through
+ * send_vendor_batch(), which saves reads, not firmware round trips. WME
+ * fields need a read-modify-write of the whole wme_ac_sta structure, so
+ * they run on their own after the requests before them have completed;
+ * order of effect is always input order.
+ *
+ * Each op receives err (0 or negative errno), value (for gets) and
+ * latency_us (from the start of its batch to its reply).
+ * ------------------------------------------------------------------------- */
+#define IOVAR_NAME_MAX  64
+
+struct iovar_op {
+    const char             *name;
+    const struct iovar_def *def;        /* NULL: raw iovar */
+    int                     is_set;
+    int                     unacked;    /* set without ACK (--no-ack) */
+    int                     quiet;      /* failures are not printed */
+    int                     deferred;   /* held, see vendor_hold() */
+    int                     invalid;    /* name or value did not parse */
+    uint32_t                value;
+    int                     err;
+    char                    err_msg[EXTACK_MSG_MAX];
+    long                    latency_us;
+
+    /* private */
+    uint8_t                 payload[IOVAR_NAME_MAX + sizeof(uint32_t)];
+};
+
+/* --no-ack: writes of the get/set commands go out unacked */
+static int sets_unacked;
+
+static long timespec_us(const struct timespec *a, const struct timespec *b)
+{
+    return (long)((b->tv_sec - a->tv_sec) * 1000000L +
+                  (b->tv_nsec - a->tv_nsec) / 1000);
+}
+
+/* Fill req for op; returns 0, or a negative errno that ends the op early */
+static int iovar_op_prepare(struct iovar_op *op, struct vendor_req *req)
+{
+    size_t name_len = strlen(op->name) + 1;
+
+    memset(req, 0, sizeof(*req));
+    req->payload = op->payload;
+    req->label = op->name;
+
+    if (op->def && op->def->kind == DCMD_INT) {
+        req->cmd = op->is_set ? op->def->set_cmd : op->def->get_cmd;
+        req->is_set = op->is_set;
+        req->unacked = op->is_set && op->unacked;
+        memset(op->payload, 0, sizeof(uint32_t));
+        if (op->is_set)
+            memcpy(op->payload, &op->value, sizeof(uint32_t));
+        req->payload_len = sizeof(uint32_t);
+        req->ret_len = sizeof(uint32_t);
+        return 0;
+    }
+
+    if (name_len > IOVAR_NAME_MAX) {
+        fprintf(stderr, "ERROR: iovar name '%s' too long\n", op->name);
+        return -ENAMETOOLONG;
+    }
+    memcpy(op->payload, op->name, name_len);
+    if (op->is_set) {
+        memcpy(op->payload + name_len, &op->value, sizeof(uint32_t));
+        req->cmd = BRCMF_C_SET_VAR;
+        req->is_set = 1;
+        req->unacked = op->unacked;
+        req->payload_len = name_len + sizeof(uint32_t);
+        req->ret_len = (int32_t)req->payload_len;
+    } else {
+        req->cmd = BRCMF_C_GET_VAR;
+        req->payload_len = name_len;
+        req->ret_len = 256;     /* room for the name and the reply */
+    }
+    return 0;
+}
+
+static void iovar_op_finish(struct iovar_op *op, struct vendor_req *req,
+                            const struct timespec *t0)
+{
+    int err = req->resp.error;
+
+    if (err == 0 && !op->is_set) {
+        if (req->resp.data && req->resp.len >= sizeof(uint32_t))
+            memcpy(&op->value, req->resp.data, sizeof(uint32_t));
+        else
+            err = -ENODATA;
+    }
+    free(req->resp.data);
+    req->resp.data = NULL;
+
+    op->err = err;
+    op->deferred = req->deferred;
+    snprintf(op->err_msg, sizeof(op->err_msg), "%s", req->resp.msg);
+    op->latency_us = timespec_us(t0, req->done ? &req->done_ts : t0);
+    if (err == 0 || op->quiet)
+        return;
+
+    if (op->def && op->def->kind == DCMD_INT)
+        log_error(op->name, err, "ERROR: dcmd %u (%s) %s failed: %d (%s)\n",
+                  req->cmd, op->name, op->is_set ? "set" : "get", err,
+                  resp_strerror(err, &req->resp));
+    else if (op->is_set)
+        log_error(op->name, err,
+                  "ERROR: SET_VAR '%s' = %u failed: %d (%s)\n",
+                  op->name, op->value, err, resp_strerror(err, &req->resp));
+    else
+        log_error(op->name, err, "ERROR: GET_VAR '%s' failed: %d (%s)\n",
+                  op->name, err, resp_strerror(err, &req->resp));
+}
+
+/* Ops that arrive with err set were rejected by the caller and are only
+ * counted; the rest are sent, pipelined where the kind allows */
+static int iovar_ops_run(struct iovar_session *s, struct iovar_op *ops,
+                         size_t n)
+{
+    struct vendor_req *reqs;
+    size_t i, start = 0;
+    int failed = 0;
+
+    reqs = calloc(n ? n : 1, sizeof(*reqs));
+    if (!reqs)
+        return -ENOMEM;
+
+    while (start < n) {
+        struct timespec t0;
+        size_t end = start;
+
+        /* Longest run of pipelinable ops */
+        while (end < n && !(ops[end].def && ops[end].def->kind == WME_PARAM))
+            end++;
+
+        if (end == start) {
+            struct iovar_op *op = &ops[start];
+            struct timespec t1;
+
+            if (op->err != 0) {
+                failed++;
+                start++;
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            op->err = op->is_set ? iovar_write(s, op->def, op->value) :
+                                   iovar_read(s, op->def, &op->value);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            op->latency_us = timespec_us(&t0, &t1);
+            failed += op->err != 0;
+            start++;
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = start; i < end; i++) {
+            struct iovar_op *op = &ops[i];
+
+            if (op->err != 0)
+                continue;
+            if (op->is_set && op->def &&
+                (op->value < op->def->min || op->value > op->def->max)) {
+                log_error(op->def->name, -ERANGE,
+                          "ERROR: %s = %u out of range (%u..%u)\n",
+                          op->def->name, op->value, op->def->min,
+                          op->def->max);
+                op->err = -ERANGE;
+            } else {
+                op->err = iovar_op_prepare(op, &reqs[i]);
+            }
+        }
+
+        /* Ops rejected locally are left out of the batch */
+        for (i = start; i < end; ) {
+            size_t j = i;
+
+            while (j < end && ops[j].err == 0)
+                j++;
+            if (j > i)
+                send_vendor_batch(s, &reqs[i], j - i);
+            i = j + (j < end);
+        }
+
+        for (i = start; i < end; i++) {
+            if (ops[i].err == 0)
+                iovar_op_finish(&ops[i], &reqs[i], &t0);
+            failed += ops[i].err != 0;
+        }
+        start = end;
+    }
+
+    free(reqs);
+    return failed;
+}
+
+/* -------------------------------------------------------------------------
+ * Profiles - named groups of registry settings applied together
+ *
+ * The tput-* family trades 2.4 GHz airtime between WiFi and Bluetooth.
+ * Long aggregates and frame bursts hold the medium for several ms per
+ * TXOP, which is time the TDM arbiter cannot hand to BT; shrinking them
+ * gives btc_mode 4 more slots to work with at some cost in throughput.
+ * ------------------------------------------------------------------------- */
+struct profile_entry {
+    const char *name;       /* registry name */
+    uint32_t    value;
+};
+
+struct profile {
+    const char                 *name;
+    const char                 *desc;
+    const struct profile_entry *entries;
+    size_t                      n_entries;
+};
+
+/*
+ * audio-wme favours AC_VI/AC_VO, which carry DSCP-marked audio: shortest
+ * legal STA AIFSN, small contention windows and a TXOP cap of ~1.5 ms so
+ * one burst cannot starve BT either. AC_BE backs off slightly more than
+ * the 802.11 default so local bulk traffic yields to the audio ACs.
+ */
+static const struct profile_entry audio_wme_entries[] = {
+    { "wme_vi_aifsn",  2 },
+    { "wme_vi_ecwmin", 2 },
+    { "wme_vi_ecwmax", 3 },
+    { "wme_vi_txop",   47 },
+    { "wme_vo_aifsn",  2 },
+    { "wme_vo_ecwmin", 2 },
+    { "wme_vo_ecwmax", 3 },
+    { "wme_vo_txop",   47 },
+    { "wme_be_ecwmin", 5 },
+};
+
+static const struct profile_entry tput_max_entries[] = {
+    { "btc_mode",       1 },
+    { "ampdu",          1 },
+    { "ampdu_ba_wsize", 64 },
+    { "ampdu_mpdu",     32 },
+    { "frameburst",     1 },
+};
+
+static const struct profile_entry tput_balanced_entries[] = {
+    { "btc_mode",       4 },
+    { "ampdu",          1 },
+    { "ampdu_ba_wsize", 32 },
+    { "ampdu_mpdu",     16 },
+    { "frameburst",     1 },
+};
+
+static const struct profile_entry tput_bt_entries[] = {
+    { "btc_mode",       4 },
+    { "ampdu",          1 },
+    { "ampdu_ba_wsize", 16 },
+    { "ampdu_mpdu",     8 },
+    { "frameburst",     0 },
+};
+
+#define PROFILE(n, d, e) { n, d, e, ARRAY_SIZE(e) }
+
+static const struct profile profiles[] = {
+    PROFILE("tput-max",      "WiFi throughput first (default coex)",
+            tput_max_entries),
+    PROFILE("tput-balanced", "full TDM with medium aggregates",
+            tput_balanced_entries),
+    PROFILE("tput-bt",       "full TDM, short aggregates, no bursting",
+            tput_bt_entries),
+    PROFILE("audio-wme",     "EDCA priority for AC_VI/AC_VO audio",
+            audio_wme_entries),
+};
+
+/* -------------------------------------------------------------------------
+ * Configuration - profiles from a file, reloadable while running
+ *
+ * --profiles=<file> adds the profiles in the file to the built-in ones
+ * (format: see config_profiles_load). hotplug keeps its rules in the same
+ * object, so rules always refer to profiles of their own generation.
+ *
+ * The tables live in a refcounted struct config published through
+ * config_current. A reload builds a complete new config on a loader
+ * thread and the main loop adopts it with one atomic pointer swap, between
+ * two requests, so nothing waits for the file to be read. Whatever still
+ * holds the old config (a hotplug interface whose firmware has not
+ * answered yet, the profile serve re-applies after a firmware reset)
+ * keeps using it until it drops its reference; the last one frees it.
+ * References are only taken and dropped on the main thread.
+ * ------------------------------------------------------------------------- */
+#define CONFIG_PROFILES_MAX     32
+#define CONFIG_ENTRIES_MAX      24
+
+struct config_profile {
+    struct profile       p;
+    char                 name[32];
+    char                 desc[80];
+    struct profile_entry entries[CONFIG_ENTRIES_MAX];
+};
+
+struct hotplug_rule;
+
+struct config {
+    _Atomic unsigned      refs;
+    unsigned              gen;          /* 1 = loaded at start */
+    struct config_profile profiles[CONFIG_PROFILES_MAX];
+    size_t                n_profiles;
+    struct hotplug_rule  *rules;        /* hotplug only */
+    size_t                n_rules;
+};
+
+static struct config *_Atomic config_current;
+static const char *config_profiles_path;        /* --profiles */
+
+static struct config *config_get(void)
+{
+    struct config *cf = atomic_load(&config_current);
+
+    if (cf)
+        atomic_fetch_add(&cf->refs, 1);
+    return cf;
+}
+
+static void config_put(struct config *cf)
+{
+    if (cf && atomic_fetch_sub(&cf->refs, 1) == 1) {
+        free(cf->rules);
+        free(cf);
+    }
+}
+
+/* Built-in profiles first, then those of 'cf' (may be NULL) */
+static const struct profile *profile_find(const struct config *cf,
+                                          const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(profiles); i++) {
+        if (strcmp(profiles[i].name, name) == 0)
+            return &profiles[i];
+    }
+    for (i = 0; cf && i < cf->n_profiles; i++) {
+        if (strcmp(cf->profiles[i].name, name) == 0)
+            return &cf->profiles[i].p;
+    }
+    return NULL;
+}
+
+/* The result is valid until the main loop adopts a reload; keep a
+ * config_get() reference to hold it longer */
+static const struct profile *profile_lookup(const char *name)
+{
+    return profile_find(atomic_load(&config_current), name);
+}
+
+/* -------------------------------------------------------------------------
+ * profile_apply - Write every entry of a profile over one session
+ *
+ * Every entry is looked up first; a profile naming an unknown setting is
+ * rejected before anything is written. The writes then go out unacked, so
+ * only failures come back. All of them are attempted even if one fails
+ * (some firmware builds reject individual iovars while associated), each
+ * failure is reported and the first error is returned. When the session
+ * holds its writes (vendor_hold()), failures can come in after return;
+ * they are reported against the line then.
+ * ------------------------------------------------------------------------- */
+static int profile_apply(struct iovar_session *s, const struct profile *p)
+{
+    struct iovar_op *ops;
+    int first_err = 0;
+    size_t i;
+
+    ops = calloc(p->n_entries ? p->n_entries : 1, sizeof(*ops));
+    if (!ops)
+        return -ENOMEM;
+
+    for (i = 0; i < p->n_entries; i++) {
+        ops[i].def = iovar_lookup(p->entries[i].name);
+        if (!ops[i].def) {
+            log_error(p->entries[i].name, -EINVAL, "ERROR: profile '%s' "
+                      "references unknown setting '%s'\n", p->name,
+                      p->entries[i].name);
+            free(ops);
+            return -EINVAL;
+        }
+        ops[i].name = ops[i].def->name;
+        ops[i].is_set = 1;
+        ops[i].unacked = 1;
+        ops[i].value = p->entries[i].value;
+    }
+
+    if (iovar_ops_run(s, ops, p->n_entries) < 0)
+        first_err = -ENOMEM;
+    for (i = 0; i < p->n_entries && first_err == 0; i++)
+        first_err = ops[i].err;
+
+    free(ops);
+    return first_err;
+}
+
+/* -------------------------------------------------------------------------
+ * Firmware counters ("counters" iovar)
+ *
+ * Two layouts exist in the wild:
+ *   - legacy wl_cnt_t (version < 30): [u16 version][u16 length][u32 ...]
+ *   - xtlv-packed wl_cnt_info_t (version 30): [u16 version][u16 datalen]
+ *     followed by xtlvs; the WLC block (id 0x100) is wl_cnt_wlc_t.
+ *
+ * Both start with the same tx/rx stat block, so only fields from that
+ * common prefix are decoded, by position. Fields past the prefix moved
+ * between layouts and carry one index per layout.
+ * ------------------------------------------------------------------------- */
+#define WL_CNT_BUF_LEN          2048
+#define WL_CNT_XTLV_VERSION     30
+#define WL_CNT_XTLV_WLC         0x100
+
+enum cnt_field {
+    CNT_TXFRAME,
+    CNT_TXBYTE,
+    CNT_TXRETRANS,
+    CNT_TXERROR,
+    CNT_TXCTL,
+    CNT_TXNOBUF,
+    CNT_TXPHYERR,
+    CNT_RXFRAME,
+    CNT_RXBYTE,
+    CNT_RXERROR,
+    CNT_RXCTL,
+    CNT_RXNOBUF,
+    CNT_RXOFLO,
+    CNT_RESET,
+    CNT_COUNT
+};
+
+static const struct {
+    const char *name;
+    unsigned    legacy_idx;     /* u32 index after the 4-byte header */
+    unsigned    xtlv_idx;       /* u32 index within wl_cnt_wlc_t */
+} counter_fields[CNT_COUNT] = {
+    [CNT_TXFRAME]   = { "txframe",   0,  0 },
+    [CNT_TXBYTE]    = { "txbyte",    1,  1 },
+    [CNT_TXRETRANS] = { "txretrans", 2,  2 },
+    [CNT_TXERROR]   = { "txerror",   3,  3 },
+    [CNT_TXCTL]     = { "txctl",     4,  4 },
+    [CNT_TXNOBUF]   = { "txnobuf",   7,  7 },
+    [CNT_TXPHYERR]  = { "txphyerr",  13, 13 },
+    [CNT_RXFRAME]   = { "rxframe",   15, 15 },
+    [CNT_RXBYTE]    = { "rxbyte",    16, 16 },
+    [CNT_RXERROR]   = { "rxerror",   17, 17 },
+    [CNT_RXCTL]     = { "rxctl",     18, 18 },
+    [CNT_RXNOBUF]   = { "rxnobuf",   19, 19 },
+    [CNT_RXOFLO]    = { "rxoflo",    31, 31 },
+    [CNT_RESET]     = { "reset",     44, 41 },
+};
+
+struct counter_snapshot {
+    uint32_t        val[CNT_COUNT];
+    struct timespec ts;
+};
+
+static int counters_decode(const uint8_t *buf, size_t len,
+                           struct counter_snapshot *snap)
+{
+    const uint8_t *block = NULL;
+    size_t block_len = 0;
+    int xtlv;
+    uint16_t version;
+    unsigned i;
+
+    if (len < 4)
+        return -ENODATA;
+
+    version = get_le16(buf);
+    xtlv = version == WL_CNT_XTLV_VERSION;
+
+    if (xtlv) {
+        size_t end = 4 + (size_t)get_le16(buf + 2);
+        size_t pos = 4;
+
+        if (end > len)
+            end = len;
+
+        /* xtlv: [u16 id][u16 len][data], each padded to 4 bytes */
+        while (pos + 4 <= end) {
+            uint16_t id = get_le16(buf + pos);
+            uint16_t xlen = get_le16(buf + pos + 2);
+
+            if (pos + 4 + xlen > end)
+                break;
+            if (id == WL_CNT_XTLV_WLC) {
+                block = buf + pos + 4;
+                block_len = xlen;
+                break;
+            }
+            pos += 4 + (((size_t)xlen + 3) & ~(size_t)3);
+        }
+        if (!block)
+            return -ENODATA;
+    } else if (version < WL_CNT_XTLV_VERSION) {
+        block = buf + 4;
+        block_len = len - 4;
+    } else {
+        return -EPROTONOSUPPORT;
+    }
+
+    for (i = 0; i < CNT_COUNT; i++) {
+        size_t off = 4 * (size_t)(xtlv ? counter_fields[i].xtlv_idx :
+                                         counter_fields[i].legacy_idx);
+        snap->val[i] = off + 4 <= block_len ? get_le32(block + off) : 0;
+    }
+
+    return 0;
+}
+
+static int counters_read(struct iovar_session *s,
+                         struct counter_snapshot *snap)
+{
+    uint8_t *buf;
+    size_t len = 0;
+    int ret;
+
+    buf = malloc(WL_CNT_BUF_LEN);
+    if (!buf)
+        return -ENOMEM;
+
+    ret = get_iovar_buf(s, "counters", NULL, 0, buf, WL_CNT_BUF_LEN, &len);
+    clock_gettime(CLOCK_MONOTONIC, &snap->ts);
+    if (ret == 0) {
+        ret = counters_decode(buf, len, snap);
+        if (ret != 0)
+            log_error("counters", ret, "ERROR: Unrecognised counters layout "
+                      "(version %u, %zu bytes)\n",
+                      len >= 2 ? get_le16(buf) : 0, len);
+    }
+
+    free(buf);
+    return ret;
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (double)(b->tv_sec - a->tv_sec) +
+           (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Per-second rate of change; unsigned subtraction handles 32-bit wrap */
+static void counters_rate(const struct counter_snapshot *a,
+                          const struct counter_snapshot *b, double *rate)
+{
+    double secs = timespec_diff(&a->ts, &b->ts);
+    unsigned i;
+
+    for (i = 0; i < CNT_COUNT; i++)
+        rate[i] = secs > 0 ? (double)(uint32_t)(b->val[i] - a->val[i]) / secs
+                           : 0.0;
+}
+
+/* -------------------------------------------------------------------------
+ * Bluetooth coexistence statistics ("btc_stats" iovar)
+ *
+ * Some CYW43455/43456 firmware builds keep counters of the arbitration
+ * between the WiFi and BT radios (wlc_btc_stats_t, version 1):
+ *
+ *   [u16 version][u16 valid][u32 update timestamp][u32 btc_status]
+ *   [u32 bt_req_type_map][u32 bt_req_cnt][u32 bt_gnt_cnt][u32 bt_gnt_dur]
+ *   [u32 bt_abort_cnt][u32 bt_rxf1ovfl_cnt][u32 bt_latency_cnt][u32 rsvd]
+ *
+ * Every BT grant is a slot WiFi was denied; requests minus grants are BT
+ * requests that WiFi won. Aborts and latency misses are what an A2DP
+ * stream hears as dropouts, so they are the figures that show whether a
+ * btc_mode works. Other firmware rejects the iovar (-EBADE).
+ * ------------------------------------------------------------------------- */
+#define BTC_STATS_VERSION       1
+#define BTC_STATS_LEN           44
+
+enum coex_field {
+    COEX_STATUS,
+    COEX_REQ_TYPE_MAP,
+    COEX_REQ,
+    COEX_GRANT,
+    COEX_GRANT_DUR,
+    COEX_ABORT,
+    COEX_RXF1OVFL,
+    COEX_LATENCY,
+    COEX_COUNT
+};
+
+/* Fields at or after COEX_REQ are running counters */
+#define COEX_FIRST_COUNTER      COEX_REQ
+
+static const char *const coex_field_names[COEX_COUNT] = {
+    [COEX_STATUS]       = "btc_status",
+    [COEX_REQ_TYPE_MAP] = "bt_req_type_map",
+    [COEX_REQ]          = "bt_req",
+    [COEX_GRANT]        = "bt_grant",
+    [COEX_GRANT_DUR]    = "bt_grant_dur",
+    [COEX_ABORT]        = "bt_abort",
+    [COEX_RXF1OVFL]     = "bt_rxf1ovfl",
+    [COEX_LATENCY]      = "bt_latency",
+};
+
+struct coex_snapshot {
+    uint32_t        val[COEX_COUNT];
+    struct timespec ts;
+};
+
+static int coex_decode(const uint8_t *buf, size_t len,
+                       struct coex_snapshot *snap)
+{
+    unsigned i;
+
+    if (len < BTC_STATS_LEN)
+        return -ENODATA;
+    if (get_le16(buf) != BTC_STATS_VERSION)
+        return -EPROTONOSUPPORT;
+    if (get_le16(buf + 2) == 0)     /* firmware has not collected yet */
+        return -EAGAIN;
+
+    for (i = 0; i < COEX_COUNT; i++)
+        snap->val[i] = get_le32(buf + 8 + 4 * i);
+    return 0;
+}
+
+/* Quiet: absence of btc_stats is normal, callers decide what to report */
+static int coex_read(struct iovar_session *s, struct coex_snapshot *snap)
+{
+    uint8_t buf[BTC_STATS_LEN];
+    size_t len = 0;
+    int ret;
+
+    ret = iovar_probe_buf(s, "btc_stats", buf, sizeof(buf), &len);
+    clock_gettime(CLOCK_MONOTONIC, &snap->ts);
+    if (ret == 0)
+        ret = coex_decode(buf, len, snap);
+    return ret;
+}
+
+/* Counter deltas b - a; state fields are taken from b */
+static void coex_delta(const struct coex_snapshot *a,
+                       const struct coex_snapshot *b, uint32_t *delta)
+{
+    unsigned i;
+
+    for (i = 0; i < COEX_COUNT; i++)
+        delta[i] = i < COEX_FIRST_COUNTER ? b->val[i] :
+                   (uint32_t)(b->val[i] - a->val[i]);
+}
+
+/* -------------------------------------------------------------------------
+ * AMPDU statistics ("dump" iovar, section "ampdu")
+ *
+ * The firmware renders its aggregation counters (wlc_ampdu_dump) as text,
+ * "name value" pairs on lines such as
+ *
+ *   txampdu 120 txmpdu 540 txmpduperampdu 4 noampdu 0 retry_ampdu 2 ...
+ *   rxampdu 98 rxmpdu 410 rxmpduperampdu 4 rxht 410 rxlegacy 0
+ *
+ * The set of pairs differs between firmware branches, so each field is
+ * looked up by name and a missing one is only marked absent. The request
+ * is GET_VAR with payload "dump\0ampdu\0". The totals run from the last
+ * "ampdu_clear_dump", which is not issued here (wl users read the same
+ * counters), so windows are compared by difference like "counters".
+ * ------------------------------------------------------------------------- */
+#define AMPDU_DUMP_LEN          4096
+
+enum ampdu_field {
+    AMPDU_TXAMPDU,
+    AMPDU_TXMPDU,
+    AMPDU_RETRY_AMPDU,
+    AMPDU_RETRY_MPDU,
+    AMPDU_TXBAR,
+    AMPDU_RXAMPDU,
+    AMPDU_RXMPDU,
+    AMPDU_RXHOLES,
+    AMPDU_RXDUP,
+    AMPDU_COUNT
+};
+
+static const char *const ampdu_field_names[AMPDU_COUNT] = {
+    [AMPDU_TXAMPDU]     = "txampdu",
+    [AMPDU_TXMPDU]      = "txmpdu",
+    [AMPDU_RETRY_AMPDU] = "retry_ampdu",
+    [AMPDU_RETRY_MPDU]  = "retry_mpdu",
+    [AMPDU_TXBAR]       = "txbar",
+    [AMPDU_RXAMPDU]     = "rxampdu",
+    [AMPDU_RXMPDU]      = "rxmpdu",
+    [AMPDU_RXHOLES]     = "rxholes",
+    [AMPDU_RXDUP]       = "rxdup",
+};
+
+struct ampdu_snapshot {
+    uint32_t        val[AMPDU_COUNT];
+    uint32_t        present;        /* bit per ampdu_field */
+    struct timespec ts;
+};
+
+static void ampdu_decode(char *text, struct ampdu_snapshot *snap)
+{
+    char *save = NULL;
+    char *tok, *next;
+    unsigned i;
+
+    snap->present = 0;
+    for (tok = strtok_r(text, " \t\r\n", &save); tok; tok = next) {
+        next = strtok_r(NULL, " \t\r\n", &save);
+        if (!next)
+            break;
+        for (i = 0; i < AMPDU_COUNT; i++) {
+            char *end;
+            unsigned long v;
+
+            if (strcmp(tok, ampdu_field_names[i]) != 0 ||
+                (snap->present & (1u << i)))
+                continue;
+            errno = 0;
+            v = strtoul(next, &end, 10);
+            if (errno == 0 && end != next && *end == '\0' &&
+                v <= UINT32_MAX) {
+                snap->val[i] = (uint32_t)v;
+                snap->present |= 1u << i;
+            }
+            break;
+        }
+    }
+}
+
+/* Quiet like coex_read(): many firmware builds leave "dump" out */
+static int ampdu_read(struct iovar_session *s, struct ampdu_snapshot *snap)
+{
+    static const char req[] = "dump\0ampdu";
+    struct iovar_response resp;
+    char *text;
+    int ret;
+
+    ret = send_vendor_cmd(s, BRCMF_C_GET_VAR, 0, (const uint8_t *)req,
+                          sizeof(req), AMPDU_DUMP_LEN, &resp);
+    clock_gettime(CLOCK_MONOTONIC, &snap->ts);
+    if (ret == 0 && (!resp.data || resp.len == 0))
+        ret = -ENODATA;
+    if (ret == 0) {
+        text = malloc(resp.len + 1);
+        if (!text) {
+            ret = -ENOMEM;
+        } else {
+            memcpy(text, resp.data, resp.len);
+            text[resp.len] = '\0';
+            ampdu_decode(text, snap);
+            free(text);
+            if (snap->present == 0)
+                ret = -EPROTO;
+        }
+    }
+    free(resp.data);
+    return ret;
+}
+
+/* -------------------------------------------------------------------------
+ * Helpers
+ * ------------------------------------------------------------------------- */
+
+/* Strict unsigned parse: decimal, 0x hex or 0 octal, nothing trailing */
+static int parse_u32(const char *str, uint32_t *out)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(str, &end, 0);
+    if (errno || end == str || *end != '\0' || v > UINT32_MAX)
+        return -EINVAL;
+    *out = (uint32_t)v;
+    return 0;
+}
+
+/* Set by SIGINT/SIGTERM/SIGHUP in long-running commands */
+static volatile sig_atomic_t stop_requested;
+
+static void stop_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* Route termination signals to stop_signal without SA_RESTART, so sleeps
+ * and blocking reads return early */
+static void install_stop_handlers(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+static void sleep_seconds(unsigned secs)
+{
+    struct timespec ts = { .tv_sec = secs, .tv_nsec = 0 };
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !stop_requested)
+        ;
+}
+
+static void sleep_ms(unsigned ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000,
+                           .tv_nsec = (long)(ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !stop_requested)
+        ;
+}
+
+/* -------------------------------------------------------------------------
+ * Output
+ *
+ * Text by default. With --json each result is one self-describing JSON
+ * object on its own line (NDJSON): "interface" and "command" first, then
+ * the command's fields. Objects are built in one static line buffer and
+ * written with a single fwrite, so sampling at a high rate does not
+ * allocate per line. A field that would overflow the buffer is dropped;
+ * the object stays well-formed.
+ * ------------------------------------------------------------------------- */
+enum output_format {
+    OUT_TEXT,
+    OUT_JSON,
+    OUT_BINARY,     /* fixed-size records, see bin_write() */
+};
+
+#define JSON_LINE_MAX   1024
+
+static enum output_format out_format = OUT_TEXT;
+static const char *out_ifname = "";
+
+static struct {
+    char          buf[JSON_LINE_MAX];
+    size_t        len;
+    int           fields;
+    unsigned long objects;  /* written so far */
+} json_line;
+
+/* Append formatted text; the whole append is undone if it does not fit */
+static int json_append(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static int json_append(const char *fmt, ...)
+{
+    size_t room = sizeof(json_line.buf) - json_line.len - 2; /* "}\n" */
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(json_line.buf + json_line.len, room + 1, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n > room) {
+        json_line.buf[json_line.len] = '\0';
+        return -ENOSPC;
+    }
+    json_line.len += (size_t)n;
+    return 0;
+}
+
+/* Append a quoted, escaped JSON string */
+static int json_quote(const char *str)
+{
+    size_t start = json_line.len;
+    const unsigned char *p;
+
+    if (json_append("\"") != 0)
+        return -ENOSPC;
+    for (p = (const unsigned char *)str; *p; p++) {
+        int ret;
+
+        if (*p == '"' || *p == '\\')
+            ret = json_append("\\%c", *p);
+        else if (*p < 0x20)
+            ret = json_append("\\u%04x", *p);
+        else
+            ret = json_append("%c", *p);
+        if (ret != 0) {
+            json_line.len = start;
+            return ret;
+        }
+    }
+    if (json_append("\"") != 0) {
+        json_line.len = start;
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+static int json_key(const char *key)
+{
+    size_t start = json_line.len;
+
+    if ((json_line.fields++ && json_append(",") != 0) ||
+        json_quote(key) != 0 || json_append(":") != 0) {
+        json_line.len = start;
+        json_line.fields--;
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+static void json_str(const char *key, const char *val)
+{
+    size_t start = json_line.len;
+
+    if (json_key(key) != 0)
+        return;
+    if ((val ? json_quote(val) : json_append("null")) != 0) {
+        json_line.len = start;
+        json_line.fields--;
+    }
+}
+
+static void json_num(const char *key, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void json_num(const char *key, const char *fmt, ...)
+{
+    char num[32];
+    size_t start = json_line.len;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(num, sizeof(num), fmt, ap);
+    va_end(ap);
+    if (json_key(key) != 0)
+        return;
+    if (json_append("%s", num) != 0) {
+        json_line.len = start;
+        json_line.fields--;
+    }
+}
+
+static void json_u32(const char *key, uint32_t v)
+{
+    json_num(key, "%u", v);
+}
+
+static void json_i32(const char *key, int32_t v)
+{
+    json_num(key, "%d", v);
+}
+
+static void json_double(const char *key, double v)
+{
+    json_num(key, "%.3f", v);
+}
+
+static void json_bool(const char *key, int v)
+{
+    json_num(key, "%s", v ? "true" : "false");
+}
+
+static void json_null(const char *key)
+{
+    json_num(key, "null");
+}
+
+/* Error code (0 or negative errno) plus its text */
+static void json_error(int err)
+{
+    json_i32("error", err);
+    if (err)
+        json_str("error_text", strerror(-err));
+}
+
+static void json_begin(const char *command)
+{
+    json_line.len = 0;
+    json_line.fields = 0;
+    json_append("{");
+    json_str("interface", out_ifname);
+    json_str("command", command);
+}
+
+static void json_end(void)
+{
+    json_line.buf[json_line.len++] = '}';
+    json_line.buf[json_line.len++] = '\n';
+    fwrite(json_line.buf, 1, json_line.len, stdout);
+    fflush(stdout);
+    json_line.objects++;
+}
+
+/* Object for a result that failed before it could write one of its own;
+ * the explanation is on stderr */
+static void json_failure(const char *command, int err)
+{
+    json_begin(command);
+    json_error(err);
+    json_end();
+}
+
+static long elapsed_us(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (long)((t1.tv_sec - t0->tv_sec) * 1000000L +
+                  (t1.tv_nsec - t0->tv_nsec) / 1000);
+}
+
+/* -------------------------------------------------------------------------
+ * Binary records (--binary)
+ *
+ * For high-rate pipelines every result is one fixed 32-byte little-endian
+ * record instead of a formatted line:
+ *
+ *   0  u8   kind        BIN_HEADER, BIN_SCHEMA, BIN_GET, BIN_SET, BIN_SAMPLE
+ *   1  u8   type        BIN_T_U32 / BIN_T_I32
+ *   2  u16  id          iovar or sample field id, named by a schema record
+ *   4  i32  status      0 or negative errno
+ *   8  u64  timestamp   CLOCK_REALTIME, ns
+ *  16  u32  ifindex
+ *  20  u32  value
+ *  24  u32  latency_us  get/set round trip
+ *  28  u32  seq         sample tick number
+ *
+ * The stream starts with a header record (id = format version, magic at
+ * offset 8, record size at offset 4) followed by schema records naming
+ * every id: bytes 4..31 carry the NUL-padded name. Registry settings and
+ * sample fields are described up front; raw iovar names get a schema
+ * record the first time they appear. `decode` turns a stream back into
+ * text or JSON.
+ * ------------------------------------------------------------------------- */
+#define BIN_RECORD_LEN      32
+#define BIN_VERSION         1
+#define BIN_MAGIC           "brcmiov"
+#define BIN_NAME_MAX        (BIN_RECORD_LEN - 4)
+#define BIN_IDS             1024
+#define BIN_ID_SAMPLE       256     /* sample fields */
+#define BIN_ID_RAW          512     /* raw iovar names, assigned on use */
+
+enum bin_kind {
+    BIN_HEADER,
+    BIN_SCHEMA,
+    BIN_GET,
+    BIN_SET,
+    BIN_SAMPLE,
+};
+
+enum bin_type {
+    BIN_T_U32,
+    BIN_T_I32,
+};
+
+/* Fields of one watch tick */
+enum bin_sample_field {
+    BS_TEMP,
+    BS_TXPOWER,
+    BS_TXFRAME,
+    BS_RXFRAME,
+    BS_TXRETRANS,
+    BS_BT_REQ,
+    BS_BT_GRANT,
+    BS_BT_ABORT,
+    BS_THROTTLE,
+    BS_COUNT
+};
+
+static const struct {
+    const char   *name;
+    enum bin_type type;
+} bin_sample_fields[BS_COUNT] = {
+    [BS_TEMP]      = { "temp_c",       BIN_T_I32 },
+    [BS_TXPOWER]   = { "txpower_qdbm", BIN_T_U32 },
+    [BS_TXFRAME]   = { "txframe",      BIN_T_U32 },
+    [BS_RXFRAME]   = { "rxframe",      BIN_T_U32 },
+    [BS_TXRETRANS] = { "txretrans",    BIN_T_U32 },
+    [BS_BT_REQ]    = { "bt_req",       BIN_T_U32 },
+    [BS_BT_GRANT]  = { "bt_grant",     BIN_T_U32 },
+    [BS_BT_ABORT]  = { "bt_abort",     BIN_T_U32 },
+    [BS_THROTTLE]  = { "throttle",     BIN_T_U32 },
+};
+
+static struct {
+    int         started;
+    uint32_t    ifindex;
+    unsigned    n_raw;
+    char        raw[BIN_IDS - BIN_ID_RAW][BIN_NAME_MAX];   /* as in schema */
+} bin_out;
+
+static void bin_write(uint8_t kind, uint8_t type, uint16_t id, int32_t status,
+                      uint32_t value, uint32_t latency_us, uint32_t seq)
+{
+    uint8_t rec[BIN_RECORD_LEN];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec[0] = kind;
+    rec[1] = type;
+    put_le16(rec + 2, id);
+    put_le32(rec + 4, (uint32_t)status);
+    put_le64(rec + 8, (uint64_t)ts.tv_sec * 1000000000ULL +
+                      (uint64_t)ts.tv_nsec);
+    put_le32(rec + 16, bin_out.ifindex);
+    put_le32(rec + 20, value);
+    put_le32(rec + 24, latency_us);
+    put_le32(rec + 28, seq);
+    fwrite(rec, 1, sizeof(rec), stdout);
+}
+
+static void bin_schema(uint16_t id, uint8_t type, const char *name)
+{
+    uint8_t rec[BIN_RECORD_LEN];
+
+    memset(rec, 0, sizeof(rec));
+    rec[0] = BIN_SCHEMA;
+    rec[1] = type;
+    put_le16(rec + 2, id);
+    strncpy((char *)rec + 4, name, BIN_NAME_MAX - 1);
+    fwrite(rec, 1, sizeof(rec), stdout);
+}
+
+/* Header and the fixed part of the schema, once per stream */
+static void bin_start(void)
+{
+    uint8_t rec[BIN_RECORD_LEN];
+    size_t i;
+
+    if (bin_out.started)
+        return;
+    bin_out.started = 1;
+    bin_out.ifindex = if_nametoindex(out_ifname);
+
+    memset(rec, 0, sizeof(rec));
+    rec[0] = BIN_HEADER;
+    put_le16(rec + 2, BIN_VERSION);
+    put_le32(rec + 4, BIN_RECORD_LEN);
+    memcpy(rec + 8, BIN_MAGIC, sizeof(BIN_MAGIC));
+    fwrite(rec, 1, sizeof(rec), stdout);
+
+    for (i = 0; i < ARRAY_SIZE(iovar_registry); i++)
+        bin_schema((uint16_t)i, BIN_T_U32, iovar_registry[i].name);
+    for (i = 0; i < BS_COUNT; i++)
+        bin_schema((uint16_t)(BIN_ID_SAMPLE + i), bin_sample_fields[i].type,
+                   bin_sample_fields[i].name);
+}
+
+/* Id of an iovar name; raw names get a schema record on first use */
+static uint16_t bin_iovar_id(const char *name)
+{
+    const struct iovar_def *def = iovar_lookup(name);
+    char key[BIN_NAME_MAX];
+    unsigned i;
+
+    if (def)
+        return (uint16_t)(def - iovar_registry);
+
+    /* Match on the name as a schema record carries it: longer names that
+     * share their first BIN_NAME_MAX - 1 bytes decode the same anyway */
+    snprintf(key, sizeof(key), "%s", name);
+    for (i = 0; i < bin_out.n_raw; i++) {
+        if (strcmp(bin_out.raw[i], key) == 0)
+            return (uint16_t)(BIN_ID_RAW + i);
+    }
+    if (bin_out.n_raw == ARRAY_SIZE(bin_out.raw))
+        return BIN_IDS - 1;     /* table full: last id is reused */
+
+    memcpy(bin_out.raw[i], key, sizeof(key));
+    bin_out.n_raw++;
+    bin_schema((uint16_t)(BIN_ID_RAW + i), BIN_T_U32, bin_out.raw[i]);
+    return (uint16_t)(BIN_ID_RAW + i);
+}
+
+static void bin_sample(unsigned field, int32_t value, uint32_t seq)
+{
+    bin_write(BIN_SAMPLE, (uint8_t)bin_sample_fields[field].type,
+              (uint16_t)(BIN_ID_SAMPLE + field), 0, (uint32_t)value, 0, seq);
+}
+
+static const char *iovar_kind_name(const struct iovar_def *def)
+{
+    return def->kind == DCMD_INT ? "dcmd" :
+           def->kind == WME_PARAM ? "wme" : "iovar";
+}
+
+/* -------------------------------------------------------------------------
+ * emit_iovar - Report the result of one get or set
+ *
+ * Text output only reports successes; failures were already explained
+ * on stderr.
+ * ------------------------------------------------------------------------- */
+static void emit_iovar(const char *command, const struct iovar_op *op)
+{
+    const char *type = op->def ? iovar_kind_name(op->def) : "int";
+
+    if (out_format == OUT_BINARY) {
+        bin_start();
+        bin_write(op->is_set ? BIN_SET : BIN_GET, BIN_T_U32,
+                  bin_iovar_id(op->name), op->err, op->value,
+                  (uint32_t)op->latency_us, 0);
+    } else if (out_format == OUT_JSON) {
+        json_begin(command);
+        json_str("iovar", op->name);
+        json_str("type", type);
+        if (op->err == 0 || (op->is_set && !op->invalid))
+            json_u32("value", op->value);
+        else
+            json_null("value");
+        json_error(op->err);
+        if (op->err_msg[0])
+            json_str("error_msg", op->err_msg);
+        json_num("latency_us", "%ld", op->latency_us);
+        if (op->deferred)
+            json_bool("deferred", 1);
+        json_end();
+    } else if (op->err == 0) {
+        if (op->is_set)
+            printf("%s set to %u\n", op->name, op->value);
+        else
+            printf("%s = %u\n", op->name, op->value);
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Commands
+ *
+ * Each handler receives the open session and the arguments following the
+ * command name. Return value is the process exit status.
+ * ------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------
+ * get_int / set_int / get / set
+ *
+ *   get_int <iovar>...                  raw iovars
+ *   set_int <iovar> <value>             one raw iovar, or
+ *   set_int <iovar>=<value>...          several
+ *   get <name>... / set <name>=<value>... typed settings (see list)
+ *
+ * All names of one invocation are sent pipelined over the session and
+ * reported in input order. A name that is unknown or has a bad value is
+ * reported with its own error and does not stop the others. The exit
+ * status is 1 if any of them failed.
+ * ------------------------------------------------------------------------- */
+static int iovar_cmd(struct iovar_session *s, const char *command, int typed,
+                     int is_set, int argc, char **argv)
+{
+    struct iovar_op *ops;
+    int classic = is_set && argc == 2 && !strchr(argv[0], '=') &&
+                  !strchr(argv[1], '=');
+    int n = classic ? 1 : argc;
+    int i, failed;
+
+    ops = calloc((size_t)n, sizeof(*ops));
+    if (!ops)
+        return 1;
+
+    for (i = 0; i < n; i++) {
+        struct iovar_op *op = &ops[i];
+        char *val = NULL;
+        int bad;
+
+        op->name = argv[i];
+        op->is_set = is_set;
+        op->unacked = is_set && sets_unacked;
+        if (classic) {
+            val = argv[1];
+        } else if (is_set) {
+            val = strchr(argv[i], '=');
+            if (!val) {
+                log_error(op->name, -EINVAL,
+                          "ERROR: Expected name=value, got '%s'\n", argv[i]);
+                op->err = -EINVAL;
+                op->invalid = 1;
+                continue;
+            }
+            *val++ = '\0';
+        }
+
+        if (typed) {
+            op->def = iovar_lookup(op->name);
+            if (!op->def) {
+                log_error(op->name, -ENOENT, "ERROR: Unknown setting '%s' "
+                          "(see 'list', or use %s for raw iovars)\n",
+                          op->name, is_set ? "set_int" : "get_int");
+                op->err = -ENOENT;
+                op->invalid = 1;
+                continue;
+            }
+            op->name = op->def->name;
+        }
+
+        if (!val)
+            continue;
+        if (typed) {
+            bad = parse_u32(val, &op->value) != 0;
+        } else {
+            char *end;
+
+            /* raw writes keep strtoul semantics ("-1" = 0xffffffff) */
+            op->value = (uint32_t)strtoul(val, &end, 0);
+            bad = end == val || *end != '\0';
+        }
+        if (bad) {
+            log_error(op->name, -EINVAL, "ERROR: Invalid value '%s'\n", val);
+            op->err = -EINVAL;
+            op->invalid = 1;
+        }
+    }
+
+    failed = iovar_ops_run(s, ops, (size_t)n);
+    if (failed >= 0) {
+        for (i = 0; i < n; i++)
+            emit_iovar(command, &ops[i]);
+    }
+    free(ops);
+    return failed != 0;
+}
+
+static int cmd_get_int(struct iovar_session *s, int argc, char **argv)
+{
+    return iovar_cmd(s, "get_int", 0, 0, argc, argv);
+}
+
+static int cmd_set_int(struct iovar_session *s, int argc, char **argv)
+{
+    return iovar_cmd(s, "set_int", 0, 1, argc, argv);
+}
+
+static int cmd_get(struct iovar_session *s, int argc, char **argv)
+{
+    return iovar_cmd(s, "get", 1, 0, argc, argv);
+}
+
+static int cmd_set(struct iovar_session *s, int argc, char **argv)
+{
+    return iovar_cmd(s, "set", 1, 1, argc, argv);
+}
+
+static int cmd_list(struct iovar_session *s, int argc, char **argv)
+{
+    size_t i;
+    (void)s; (void)argc; (void)argv;
+
+    for (i = 0; i < ARRAY_SIZE(iovar_registry); i++) {
+        const struct iovar_def *d = &iovar_registry[i];
+
+        if (out_format == OUT_JSON) {
+            json_begin("list");
+            json_str("iovar", d->name);
+            json_str("type", iovar_kind_name(d));
+            json_u32("min", d->min);
+            json_u32("max", d->max);
+            json_str("desc", d->desc);
+            json_end();
+            continue;
+        }
+        printf("%-16s %-5s %3u..%-5u %s\n", d->name, iovar_kind_name(d),
+               d->min, d->max, d->desc);
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * decode - Turn a --binary stream back into text or JSON (offline)
+ *
+ *   decode <file|->
+ *
+ * Record kinds this version does not know are skipped, so newer streams
+ * still decode as far as they can.
+ * ------------------------------------------------------------------------- */
+static int cmd_decode(struct iovar_session *s, int argc, char **argv)
+{
+    static char names[BIN_IDS][BIN_NAME_MAX + 1];
+    static uint8_t types[BIN_IDS];
+    uint8_t rec[BIN_RECORD_LEN];
+    char ifname[IF_NAMESIZE] = "";
+    uint32_t last_ifindex = 0;
+    FILE *f;
+    (void)s; (void)argc;
+
+    if (out_format == OUT_BINARY) {
+        fprintf(stderr, "ERROR: decode writes text or --json\n");
+        return 1;
+    }
+
+    f = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "rb");
+    if (!f) {
+        fprintf(stderr, "ERROR: Cannot open %s: %s\n", argv[0],
+                strerror(errno));
+        return 1;
+    }
+
+    if (fread(rec, 1, sizeof(rec), f) != sizeof(rec) ||
+        rec[0] != BIN_HEADER || memcmp(rec + 8, BIN_MAGIC,
+                                       sizeof(BIN_MAGIC)) != 0 ||
+        get_le16(rec + 2) != BIN_VERSION ||
+        get_le32(rec + 4) != BIN_RECORD_LEN) {
+        fprintf(stderr, "ERROR: %s is not a brcm-iovar binary stream "
+                "(version %u)\n", argv[0], BIN_VERSION);
+        if (f != stdin)
+            fclose(f);
+        return 1;
+    }
+
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+        uint16_t id = get_le16(rec + 2);
+        int32_t status = (int32_t)get_le32(rec + 4);
+        uint64_t ts = (uint64_t)get_le32(rec + 8) |
+                      (uint64_t)get_le32(rec + 12) << 32;
+        uint32_t ifindex = get_le32(rec + 16);
+        uint32_t value = get_le32(rec + 20);
+        const char *kind, *name;
+        char idbuf[16];
+
+        if (id >= BIN_IDS)
+            continue;
+        if (rec[0] == BIN_SCHEMA) {
+            memcpy(names[id], rec + 4, BIN_NAME_MAX);
+            types[id] = rec[1];
+            continue;
+        }
+        if (rec[0] == BIN_GET)
+            kind = "get";
+        else if (rec[0] == BIN_SET)
+            kind = "set";
+        else if (rec[0] == BIN_SAMPLE)
+            kind = "sample";
+        else
+            continue;
+
+        if (ifindex != last_ifindex) {
+            last_ifindex = ifindex;
+            if (!if_indextoname(ifindex, ifname))
+                snprintf(ifname, sizeof(ifname), "if%u", ifindex);
+        }
+        name = names[id];
+        if (!name[0]) {
+            snprintf(idbuf, sizeof(idbuf), "#%u", id);
+            name = idbuf;
+        }
+
+        if (out_format == OUT_JSON) {
+            out_ifname = ifname;
+            json_begin(kind);
+            json_num("time", "%llu.%06llu",
+                     (unsigned long long)(ts / 1000000000ULL),
+                     (unsigned long long)(ts % 1000000000ULL / 1000));
+            json_str(rec[0] == BIN_SAMPLE ? "field" : "iovar", name);
+            json_str("type", types[id] == BIN_T_I32 ? "i32" : "u32");
+            if (status == 0 || rec[0] == BIN_SET) {
+                if (types[id] == BIN_T_I32)
+                    json_i32("value", (int32_t)value);
+                else
+                    json_u32("value", value);
+            } else {
+                json_null("value");
+            }
+            json_error(status);
+            if (rec[0] == BIN_SAMPLE)
+                json_u32("seq", get_le32(rec + 28));
+            else
+                json_u32("latency_us", get_le32(rec + 24));
+            json_end();
+            continue;
+        }
+
+        printf("%llu.%06llu %s %s", (unsigned long long)(ts / 1000000000ULL),
+               (unsigned long long)(ts % 1000000000ULL / 1000), ifname, kind);
+        if (rec[0] == BIN_SAMPLE)
+            printf(" %u", get_le32(rec + 28));
+        if (status != 0)
+            printf(" %s failed: %d (%s)\n", name, status, strerror(-status));
+        else if (types[id] == BIN_T_I32)
+            printf(" %s = %d\n", name, (int32_t)value);
+        else
+            printf(" %s = %u\n", name, value);
+    }
+
+    if (f != stdin)
+        fclose(f);
+    return 0;
+}
+
+static int cmd_profile(struct iovar_session *s, int argc, char **argv)
+{
+    const struct profile *p;
+    struct timespec t0;
+    size_t i;
+    int ret;
+
+    if (argc == 0) {
+        const struct config *cf = atomic_load(&config_current);
+        size_t n = ARRAY_SIZE(profiles) + (cf ? cf->n_profiles : 0);
+
+        for (i = 0; i < n; i++) {
+            p = i < ARRAY_SIZE(profiles) ? &profiles[i] :
+                &cf->profiles[i - ARRAY_SIZE(profiles)].p;
+            if (out_format == OUT_JSON) {
+                json_begin("profile");
+                json_str("profile", p->name);
+                json_str("desc", p->desc);
+                json_end();
+            } else {
+                printf("%-16s %s\n", p->name, p->desc);
+            }
+        }
+        return 0;
+    }
+
+    p = profile_lookup(argv[0]);
+    if (!p) {
+        fprintf(stderr, "ERROR: Unknown profile '%s'\n", argv[0]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = profile_apply(s, p);
+    if (out_format == OUT_JSON) {
+        json_begin("profile");
+        json_str("profile", p->name);
+        json_u32("entries", (uint32_t)p->n_entries);
+        json_error(ret);
+        json_num("latency_us", "%ld", elapsed_us(&t0));
+        json_end();
+    } else if (ret == 0) {
+        printf("profile %s applied\n", p->name);
+    }
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * profile-verify - Apply a profile and measure its effect
+ *
+ * Within one session: read the profile's settings, sample counters over a
+ * baseline window, apply the profile, read the settings back, then sample
+ * the same window again. Reports the per-second counter rates of both
+ * windows so the airtime trade-off is visible (e.g. txframe vs. txretrans).
+ * The AMPDU totals from "dump ampdu" are compared the same way, with the
+ * MPDUs per A-MPDU of each window, which is what an aggregation profile
+ * changes directly. Where the firmware keeps BT coex statistics their
+ * rates are compared too, which is what shows whether a btc_mode change
+ * helped. A source the firmware cannot provide is left out; the profile
+ * is applied and read back even when none can be read.
+ * ------------------------------------------------------------------------- */
+/* One rate of the comparison; 'change' 0 for ratios that have none */
+static void verify_row(const char *name, double a, double b, int change)
+{
+    if (out_format == OUT_JSON) {
+        json_begin("profile-verify");
+        json_str("counter", name);
+        json_double("baseline", a);
+        json_double("profile", b);
+        json_end();
+        return;
+    }
+    printf("  %-12s %12.1f %12.1f", name, a, b);
+    if (!change)
+        printf("\n");
+    else if (a > 0)
+        printf(" %+8.1f%%\n", 100.0 * (b - a) / a);
+    else
+        printf(" %9s\n", "-");
+}
+
+/* MPDUs per A-MPDU over a window, 0 when nothing was aggregated */
+static double ampdu_density(const struct ampdu_snapshot *a,
+                            const struct ampdu_snapshot *b,
+                            enum ampdu_field mpdu, enum ampdu_field ampdu)
+{
+    uint32_t n = b->val[ampdu] - a->val[ampdu];
+
+    return n ? (double)(uint32_t)(b->val[mpdu] - a->val[mpdu]) / n : 0.0;
+}
+
+static int cmd_profile_verify(struct iovar_session *s, int argc, char **argv)
+{
+    const struct profile *p = profile_lookup(argv[0]);
+    struct counter_snapshot c0, c1, c2, c3;
+    struct coex_snapshot x0, x1, x2, x3;
+    struct ampdu_snapshot a0, a1, a2, a3;
+    double before[CNT_COUNT], after[CNT_COUNT];
+    uint32_t *old_vals;
+    uint32_t secs = 5;
+    uint32_t ampdu_fields = 0;
+    int have_counters, have_coex, have_ampdu;
+    int status = 0;
+    size_t i;
+
+    if (!p) {
+        fprintf(stderr, "ERROR: Unknown profile '%s'\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1 && (parse_u32(argv[1], &secs) != 0 || secs == 0)) {
+        fprintf(stderr, "ERROR: Invalid sample window '%s'\n", argv[1]);
+        return 1;
+    }
+
+    old_vals = calloc(p->n_entries, sizeof(*old_vals));
+    if (!old_vals)
+        return 1;
+
+    for (i = 0; i < p->n_entries; i++) {
+        const struct iovar_def *def = iovar_lookup(p->entries[i].name);
+        if (!def || iovar_read(s, def, &old_vals[i]) != 0)
+            old_vals[i] = UINT32_MAX;
+    }
+
+    have_counters = counters_read(s, &c0) == 0;
+    have_coex = coex_read(s, &x0) == 0;
+    have_ampdu = ampdu_read(s, &a0) == 0;
+    if (have_counters || have_coex || have_ampdu) {
+        sleep_seconds(secs);
+        have_counters = have_counters && counters_read(s, &c1) == 0;
+        have_coex = have_coex && coex_read(s, &x1) == 0;
+        have_ampdu = have_ampdu && ampdu_read(s, &a1) == 0;
+    }
+
+    if (profile_apply(s, p) != 0)
+        status = 1;
+
+    if (out_format != OUT_JSON)
+        printf("Profile %s (%s)\n", p->name, p->desc);
+    for (i = 0; i < p->n_entries; i++) {
+        const struct iovar_def *def = iovar_lookup(p->entries[i].name);
+        uint32_t now;
+        int ret = def ? iovar_read(s, def, &now) : -EINVAL;
+
+        if (ret == 0 && now != p->entries[i].value)
+            status = 1;
+        if (ret != 0)
+            status = 1;
+        if (out_format == OUT_JSON) {
+            json_begin("profile-verify");
+            json_str("profile", p->name);
+            json_str("iovar", p->entries[i].name);
+            if (old_vals[i] == UINT32_MAX)
+                json_null("old");
+            else
+                json_u32("old", old_vals[i]);
+            if (ret == 0)
+                json_u32("value", now);
+            else
+                json_null("value");
+            json_bool("applied", ret == 0 && now == p->entries[i].value);
+            json_error(ret);
+            json_end();
+            continue;
+        }
+
+        printf("  %-16s ", p->entries[i].name);
+        if (old_vals[i] == UINT32_MAX)
+            printf("%8s", "?");
+        else
+            printf("%8u", old_vals[i]);
+        if (ret == 0)
+            printf(" -> %-8u%s\n", now,
+                   now == p->entries[i].value ? "" : "  (NOT APPLIED)");
+        else
+            printf(" -> ?\n");
+    }
+
+    if (have_counters || have_coex || have_ampdu) {
+        have_counters = have_counters && counters_read(s, &c2) == 0;
+        have_coex = have_coex && coex_read(s, &x2) == 0;
+        have_ampdu = have_ampdu && ampdu_read(s, &a2) == 0;
+        sleep_seconds(secs);
+        have_counters = have_counters && counters_read(s, &c3) == 0;
+        have_coex = have_coex && coex_read(s, &x3) == 0;
+        have_ampdu = have_ampdu && ampdu_read(s, &a3) == 0;
+    }
+    if (have_ampdu)
+        ampdu_fields = a0.present & a1.present & a2.present & a3.present;
+
+    if (!have_counters && !have_coex && !ampdu_fields) {
+        if (out_format != OUT_JSON)
+            printf("\nNo counters readable; effect not measured\n");
+        free(old_vals);
+        return status;
+    }
+
+    if (out_format != OUT_JSON) {
+        printf("\nRates per second (%u s windows):\n", secs);
+        printf("  %-12s %12s %12s %9s\n", "counter", "baseline", "profile",
+               "change");
+    }
+    if (have_counters) {
+        counters_rate(&c0, &c1, before);
+        counters_rate(&c2, &c3, after);
+        for (i = 0; i < CNT_COUNT; i++) {
+            if (i != CNT_RESET)
+                verify_row(counter_fields[i].name, before[i], after[i], 1);
+        }
+    }
+    for (i = 0; i < AMPDU_COUNT; i++) {
+        if (ampdu_fields & (1u << i))
+            verify_row(ampdu_field_names[i],
+                       (uint32_t)(a1.val[i] - a0.val[i]) /
+                       timespec_diff(&a0.ts, &a1.ts),
+                       (uint32_t)(a3.val[i] - a2.val[i]) /
+                       timespec_diff(&a2.ts, &a3.ts), 1);
+    }
+    if (have_coex) {
+        uint32_t d0[COEX_COUNT], d1[COEX_COUNT];
+
+        coex_delta(&x0, &x1, d0);
+        coex_delta(&x2, &x3, d1);
+        for (i = COEX_FIRST_COUNTER; i < COEX_COUNT; i++)
+            verify_row(coex_field_names[i],
+                       d0[i] / timespec_diff(&x0.ts, &x1.ts),
+                       d1[i] / timespec_diff(&x2.ts, &x3.ts), 1);
+    }
+    if ((ampdu_fields & (1u << AMPDU_TXAMPDU)) &&
+        (ampdu_fields & (1u << AMPDU_TXMPDU)))
+        verify_row("txmpdu/ampdu",
+                   ampdu_density(&a0, &a1, AMPDU_TXMPDU, AMPDU_TXAMPDU),
+                   ampdu_density(&a2, &a3, AMPDU_TXMPDU, AMPDU_TXAMPDU), 0);
+    if ((ampdu_fields & (1u << AMPDU_RXAMPDU)) &&
+        (ampdu_fields & (1u << AMPDU_RXMPDU)))
+        verify_row("rxmpdu/ampdu",
+                   ampdu_density(&a0, &a1, AMPDU_RXMPDU, AMPDU_RXAMPDU),
+                   ampdu_density(&a2, &a3, AMPDU_RXMPDU, AMPDU_RXAMPDU), 0);
+    if (have_counters && c3.val[CNT_RESET] != c0.val[CNT_RESET])
+        fprintf(out_format == OUT_JSON ? stderr : stdout,
+                "WARNING: firmware reset during measurement\n");
+
+    free(old_vals);
+    return status;
+}
+
+/* -------------------------------------------------------------------------
+ * wme - Show or change per-access-category EDCA parameters
+ *
+ *   wme                               table of all four ACs
+ *   wme <be|bk|vi|vo> key=value ...   aifsn, cwmin, cwmax (CW values,
+ *                                     2^n - 1), txop (32 us units)
+ * ------------------------------------------------------------------------- */
+static int cw_to_ecw(uint32_t cw, uint32_t *ecw)
+{
+    uint32_t n;
+
+    for (n = 0; n <= 15; n++) {
+        if (cw == (1u << n) - 1) {
+            *ecw = n;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+static int cmd_wme(struct iovar_session *s, int argc, char **argv)
+{
+    struct edcf_acparam ac[WME_AC_COUNT];
+    int aci = -1;
+    int i, ret;
+
+    if (wme_read(s, ac) != 0)
+        return 1;
+
+    if (argc == 0 && out_format == OUT_JSON) {
+        for (i = 0; i < WME_AC_COUNT; i++) {
+            json_begin("wme");
+            json_str("ac", wme_ac_names[i]);
+            json_u32("aifsn", wme_field_get(&ac[i], WME_AIFSN));
+            json_u32("cwmin", (1u << wme_field_get(&ac[i], WME_ECWMIN)) - 1);
+            json_u32("cwmax", (1u << wme_field_get(&ac[i], WME_ECWMAX)) - 1);
+            json_u32("txop_us", wme_field_get(&ac[i], WME_TXOP) * 32);
+            json_u32("acm", (ac[i].aci >> 4) & 1);
+            json_end();
+        }
+        return 0;
+    }
+
+    if (argc == 0) {
+        printf("%-4s %6s %6s %6s %9s %4s\n", "ac", "aifsn", "cwmin",
+               "cwmax", "txop(us)", "acm");
+        for (i = 0; i < WME_AC_COUNT; i++) {
+            printf("%-4s %6u %6u %6u %9u %4u\n", wme_ac_names[i],
+                   wme_field_get(&ac[i], WME_AIFSN),
+                   (1u << wme_field_get(&ac[i], WME_ECWMIN)) - 1,
+                   (1u << wme_field_get(&ac[i], WME_ECWMAX)) - 1,
+                   wme_field_get(&ac[i], WME_TXOP) * 32,
+                   (ac[i].aci >> 4) & 1);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < WME_AC_COUNT; i++) {
+        if (strcmp(argv[0], wme_ac_names[i]) == 0)
+            aci = i;
+    }
+    if (aci < 0 || argc < 2) {
+        fprintf(stderr, "ERROR: wme <be|bk|vi|vo> aifsn=N cwmin=N "
+                "cwmax=N txop=N\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        uint32_t v, ecw;
+
+        if (!eq || parse_u32(eq + 1, &v) != 0) {
+            fprintf(stderr, "ERROR: Invalid parameter '%s'\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0';
+
+        if (strcmp(argv[i], "aifsn") == 0 && v >= 1 && v <= 15) {
+            wme_field_set(&ac[aci], WME_AIFSN, v);
+        } else if (strcmp(argv[i], "cwmin") == 0 && cw_to_ecw(v, &ecw) == 0) {
+            wme_field_set(&ac[aci], WME_ECWMIN, ecw);
+        } else if (strcmp(argv[i], "cwmax") == 0 && cw_to_ecw(v, &ecw) == 0) {
+            wme_field_set(&ac[aci], WME_ECWMAX, ecw);
+        } else if (strcmp(argv[i], "txop") == 0 && v <= 65535) {
+            wme_field_set(&ac[aci], WME_TXOP, v);
+        } else {
+            fprintf(stderr, "ERROR: Invalid %s value %u\n", argv[i], v);
+            return 1;
+        }
+    }
+
+    if (wme_field_get(&ac[aci], WME_ECWMIN) >
+        wme_field_get(&ac[aci], WME_ECWMAX)) {
+        fprintf(stderr, "ERROR: cwmin must not exceed cwmax\n");
+        return 1;
+    }
+
+    ret = wme_write(s, &ac[aci]);
+    if (out_format == OUT_JSON) {
+        json_begin("wme");
+        json_str("ac", wme_ac_names[aci]);
+        json_error(ret);
+        json_end();
+    } else if (ret == 0) {
+        printf("wme %s updated\n", wme_ac_names[aci]);
+    }
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * probe - Link probe: ICMP round-trip latency plus radio state
+ *
+ * Sends ICMP echo requests out of the interface and reports loss, RTT
+ * min/avg/max and jitter (mean difference between consecutive RTTs),
+ * together with RSSI, current TX rate and the firmware retry/error counter
+ * deltas over the same period. Running it before and after a change (EDCA
+ * profile, btc_mode, aggregation) gives a like-for-like comparison.
+ * ------------------------------------------------------------------------- */
+#define PROBE_TIMEOUT_MS    1000
+
+/* fwil_types.h: struct brcmf_scb_val_le */
+struct brcmf_scb_val_le {
+    int32_t val;
+    uint8_t ea[6];
+};
+
+static int link_state(struct iovar_session *s, int32_t *rssi, uint32_t *rate)
+{
+    struct brcmf_scb_val_le scb;
+    int ret;
+
+    memset(&scb, 0, sizeof(scb));
+    ret = get_dcmd_buf(s, BRCMF_C_GET_RSSI, "rssi", &scb, sizeof(scb));
+    if (ret != 0)
+        return ret;
+    *rssi = (int32_t)get_le32((const uint8_t *)&scb.val);
+
+    /* 500 kbps units */
+    return get_dcmd_int(s, BRCMF_C_GET_RATE, "rate", rate);
+}
+
+static uint16_t inet_cksum(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t sum = 0;
+
+    while (len > 1) {
+        sum += (uint32_t)(p[0] << 8 | p[1]);
+        p += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += (uint32_t)(p[0] << 8);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons((uint16_t)~sum);
+}
+
+/* Unprivileged ping socket if allowed, raw socket otherwise */
+static int icmp_open(const char *ifname, int *raw)
+{
+    int fd;
+
+    *raw = 0;
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (fd < 0) {
+        *raw = 1;
+        fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMP);
+    }
+    if (fd < 0)
+        return -errno;
+
+    /* Best effort: keep the probe on the wireless link */
+    setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname,
+               (socklen_t)strlen(ifname));
+    return fd;
+}
+
+/* Wait for the echo reply with sequence 'seq'; returns RTT in ms or < 0 */
+static double icmp_wait_reply(int fd, int raw, uint16_t id, uint16_t seq,
+                              const struct timespec *sent)
+{
+    uint8_t buf[1500];
+    struct timespec now;
+
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        const struct icmphdr *icmp;
+        double waited;
+        ssize_t n;
+        size_t off = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = timespec_diff(sent, &now) * 1000.0;
+        if (waited >= PROBE_TIMEOUT_MS ||
+            poll(&pfd, 1, PROBE_TIMEOUT_MS - (int)waited) <= 0)
+            return -1.0;
+
+        n = recv(fd, buf, sizeof(buf), 0);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (n <= 0)
+            continue;
+        if (raw)
+            off = (size_t)(buf[0] & 0x0f) * 4;     /* skip IP header */
+        if ((size_t)n < off + sizeof(*icmp))
+            continue;
+
+        icmp = (const struct icmphdr *)(buf + off);
+        if (icmp->type != ICMP_ECHOREPLY ||
+            ntohs(icmp->un.echo.sequence) != seq ||
+            (raw && ntohs(icmp->un.echo.id) != id))
+            continue;
+
+        return timespec_diff(sent, &now) * 1000.0;
+    }
+}
+
+/*
+ * Static builds (make static, -DSTATIC_BUILD) take IPv4 addresses only:
+ * glibc resolves host names through NSS modules that a static binary
+ * would dlopen from the target at run time, and those must match the
+ * glibc it was linked against.
+ */
+static int probe_resolve(const char *host, struct sockaddr_in *dst)
+{
+#ifdef STATIC_BUILD
+    memset(dst, 0, sizeof(*dst));
+    dst->sin_family = AF_INET;
+    return inet_pton(AF_INET, host, &dst->sin_addr) == 1 ? 0 : -EINVAL;
+#else
+    struct addrinfo hints, *ai = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(host, NULL, &hints, &ai) != 0 || !ai) {
+        if (ai)
+            freeaddrinfo(ai);
+        return -ENOENT;
+    }
+    memcpy(dst, ai->ai_addr, sizeof(*dst));
+    freeaddrinfo(ai);
+    return 0;
+#endif
+}
+
+static int cmd_probe(struct iovar_session *s, int argc, char **argv)
+{
+    struct sockaddr_in dst;
+    struct counter_snapshot c0, c1;
+    uint32_t count = 10, interval_ms = 200;
+    uint32_t rate = 0, sent = 0, received = 0;
+    int32_t rssi = 0;
+    double rtt_min = 0, rtt_max = 0, rtt_sum = 0, jitter_sum = 0, last = -1;
+    uint16_t id = (uint16_t)getpid();
+    int have_counters, have_link;
+    int fd, raw;
+    uint32_t i;
+
+    if ((argc > 1 && (parse_u32(argv[1], &count) != 0 || count == 0)) ||
+        (argc > 2 && parse_u32(argv[2], &interval_ms) != 0)) {
+        fprintf(stderr, "ERROR: probe <host> [count] [interval-ms]\n");
+        return 1;
+    }
+
+    if (probe_resolve(argv[0], &dst) != 0) {
+#ifdef STATIC_BUILD
+        fprintf(stderr, "ERROR: '%s' is not an IPv4 address (static "
+                "builds do not resolve names)\n", argv[0]);
+#else
+        fprintf(stderr, "ERROR: Cannot resolve '%s'\n", argv[0]);
+#endif
+        return 1;
+    }
+
+    fd = icmp_open(s->ifname, &raw);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Cannot open ICMP socket: %s\n",
+                strerror(-fd));
+        return 1;
+    }
+
+    have_counters = counters_read(s, &c0) == 0;
+
+    for (i = 0; i < count; i++) {
+        struct icmphdr req;
+        struct timespec t0, gap;
+        double rtt;
+
+        memset(&req, 0, sizeof(req));
+        req.type = ICMP_ECHO;
+        req.un.echo.id = htons(id);
+        req.un.echo.sequence = htons((uint16_t)i);
+        req.checksum = inet_cksum(&req, sizeof(req));
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (sendto(fd, &req, sizeof(req), 0, (struct sockaddr *)&dst,
+                   sizeof(dst)) < 0) {
+            fprintf(stderr, "ERROR: sendto: %s\n", strerror(errno));
+            break;
+        }
+        sent++;
+
+        rtt = icmp_wait_reply(fd, raw, id, (uint16_t)i, &t0);
+        if (rtt >= 0) {
+            if (received == 0 || rtt < rtt_min)
+                rtt_min = rtt;
+            if (rtt > rtt_max)
+                rtt_max = rtt;
+            if (last >= 0)
+                jitter_sum += rtt > last ? rtt - last : last - rtt;
+            rtt_sum += rtt;
+            last = rtt;
+            received++;
+        }
+
+        if (i + 1 < count && rtt < interval_ms) {
+            double rest = interval_ms - (rtt >= 0 ? rtt : PROBE_TIMEOUT_MS);
+            if (rest > 0) {
+                gap.tv_sec = (time_t)(rest / 1000);
+                gap.tv_nsec = (long)((rest - gap.tv_sec * 1000.0) * 1e6);
+                nanosleep(&gap, NULL);
+            }
+        }
+    }
+
+    if (have_counters)
+        have_counters = counters_read(s, &c1) == 0;
+    have_link = link_state(s, &rssi, &rate) == 0;
+
+    close(fd);
+
+    if (out_format == OUT_JSON) {
+        json_begin("probe");
+        json_str("host", argv[0]);
+        json_u32("sent", sent);
+        json_u32("received", received);
+        if (received) {
+            json_double("rtt_min_ms", rtt_min);
+            json_double("rtt_avg_ms", rtt_sum / received);
+            json_double("rtt_max_ms", rtt_max);
+            json_double("jitter_ms",
+                        received > 1 ? jitter_sum / (received - 1) : 0.0);
+        } else {
+            json_null("rtt_avg_ms");
+        }
+        if (have_link) {
+            json_i32("rssi", rssi);
+            json_double("rate_mbps", rate / 2.0);
+        }
+        if (have_counters) {
+            json_u32("txretrans",
+                     c1.val[CNT_TXRETRANS] - c0.val[CNT_TXRETRANS]);
+            json_u32("txerror", c1.val[CNT_TXERROR] - c0.val[CNT_TXERROR]);
+            json_u32("rxerror", c1.val[CNT_RXERROR] - c0.val[CNT_RXERROR]);
+        }
+        json_error(received ? 0 : -ETIMEDOUT);
+        json_end();
+        return received == 0;
+    }
+
+    printf("probe %s via %s: %u sent, %u received, %.1f%% loss\n",
+           argv[0], s->ifname, sent, received,
+           sent ? 100.0 * (sent - received) / sent : 0.0);
+    if (received)
+        printf("  rtt min/avg/max/jitter = %.2f/%.2f/%.2f/%.2f ms\n",
+               rtt_min, rtt_sum / received, rtt_max,
+               received > 1 ? jitter_sum / (received - 1) : 0.0);
+    if (have_link)
+        printf("  rssi %d dBm, rate %.1f Mbps\n", rssi, rate / 2.0);
+    if (have_counters)
+        printf("  txretrans %u txerror %u rxerror %u (over %.1f s)\n",
+               c1.val[CNT_TXRETRANS] - c0.val[CNT_TXRETRANS],
+               c1.val[CNT_TXERROR] - c0.val[CNT_TXERROR],
+               c1.val[CNT_RXERROR] - c0.val[CNT_RXERROR],
+               timespec_diff(&c0.ts, &c1.ts));
+
+    return received == 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Host wakeup reduction: ARP/ND offload and firmware packet filters
+ *
+ * Every frame the firmware forwards crosses the bus and costs the host an
+ * interrupt plus a trip through the network stack. On a Pi Zero, broadcast
+ * chatter (ARP, NDP, SSDP, gratuitous traffic from other hosts) competes
+ * with audio decoding for the single core. The firmware can:
+ *
+ *   - answer ARP requests for our IPv4 addresses itself (arp_ol/arpoe)
+ *   - answer IPv6 neighbour solicitations itself (ndoe)
+ *   - drop frames that match/don't match byte patterns (pkt_filter_*)
+ *
+ * brcmfmac also touches arpoe/arp_ol when power management is toggled
+ * (brcmf_configure_arp_nd_offload), so reapply after changing PM.
+ * ------------------------------------------------------------------------- */
+#define ARP_OL_AGENT            0x1     /* answer ARP for host IPs */
+#define ARP_OL_PEER_AUTO_REPLY  0x8     /* reply to peer ARP from cache */
+#define PKT_FILTER_MAX_BYTES    64
+
+/* fwil_types.h: struct brcmf_pkt_filter_le with a pattern filter */
+struct pkt_filter_hdr {
+    uint32_t id;
+    uint32_t type;              /* 0 = pattern match */
+    uint32_t negate_match;
+    uint32_t offset;            /* from start of the Ethernet header */
+    uint32_t size_bytes;        /* followed by mask[size], pattern[size] */
+};
+
+struct pkt_filter_enable {
+    uint32_t id;
+    uint32_t enable;
+};
+
+static int hex_parse(const char *hex, uint8_t *out, size_t max)
+{
+    size_t len, i;
+
+    if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
+        hex += 2;
+    len = strlen(hex);
+    if (len == 0 || len % 2 || len / 2 > max)
+        return -EINVAL;
+
+    for (i = 0; i < len / 2; i++) {
+        unsigned v;
+        if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+            return -EINVAL;
+        out[i] = (uint8_t)v;
+    }
+    return (int)(len / 2);
+}
+
+static int pkt_filter_add(struct iovar_session *s, uint32_t id,
+                          uint32_t offset, const char *mask_hex,
+                          const char *pattern_hex, uint32_t negate)
+{
+    uint8_t buf[sizeof(struct pkt_filter_hdr) + 2 * PKT_FILTER_MAX_BYTES];
+    uint8_t mask[PKT_FILTER_MAX_BYTES], pattern[PKT_FILTER_MAX_BYTES];
+    struct pkt_filter_hdr hdr;
+    int mlen, plen;
+
+    mlen = hex_parse(mask_hex, mask, sizeof(mask));
+    plen = hex_parse(pattern_hex, pattern, sizeof(pattern));
+    if (mlen < 0 || plen < 0 || mlen != plen) {
+        fprintf(stderr, "ERROR: Mask and pattern must be hex strings of "
+                "equal length (max %d bytes)\n", PKT_FILTER_MAX_BYTES);
+        return -EINVAL;
+    }
+
+    hdr.id = id;
+    hdr.type = 0;
+    hdr.negate_match = negate;
+    hdr.offset = offset;
+    hdr.size_bytes = (uint32_t)mlen;
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), mask, (size_t)mlen);
+    memcpy(buf + sizeof(hdr) + mlen, pattern, (size_t)plen);
+
+    return set_iovar_buf(s, "pkt_filter_add", buf,
+                         sizeof(hdr) + 2 * (size_t)mlen);
+}
+
+static int pkt_filter_enable(struct iovar_session *s, uint32_t id,
+                             uint32_t enable)
+{
+    struct pkt_filter_enable en = { id, enable };
+
+    return set_iovar_buf(s, "pkt_filter_enable", &en, sizeof(en));
+}
+
+static int pkt_filter_delete(struct iovar_session *s, uint32_t id)
+{
+    return set_iovar_buf(s, "pkt_filter_delete", &id, sizeof(id));
+}
+
+/* Program one host address family; NULL list means "all on interface" */
+static int offload_hostips(struct iovar_session *s, int family,
+                           char **addrs, int n_addrs)
+{
+    const char *add = family == AF_INET ? "arp_hostip" : "nd_hostip";
+    const char *clear = family == AF_INET ? "arp_hostip_clear" :
+                                            "nd_hostip_clear";
+    struct ifaddrs *ifa_list = NULL, *ifa;
+    uint8_t addr[16];
+    size_t alen = family == AF_INET ? 4 : 16;
+    int added = 0;
+    int ret, i;
+
+    ret = set_iovar_buf(s, clear, NULL, 0);
+    if (ret != 0)
+        return ret;
+
+    for (i = 0; i < n_addrs; i++) {
+        if (inet_pton(family, addrs[i], addr) != 1) {
+            fprintf(stderr, "ERROR: Invalid address '%s'\n", addrs[i]);
+            return -EINVAL;
+        }
+        ret = set_iovar_buf(s, add, addr, alen);
+        if (ret != 0)
+            return ret;
+        added++;
+    }
+    if (n_addrs)
+        return added;
+
+    if (getifaddrs(&ifa_list) != 0)
+        return -errno;
+
+    for (ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != family ||
+            strcmp(ifa->ifa_name, s->ifname) != 0)
+            continue;
+        if (family == AF_INET)
+            memcpy(addr, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, 4);
+        else
+            memcpy(addr, &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr,
+                   16);
+        ret = set_iovar_buf(s, add, addr, alen);
+        if (ret != 0)
+            break;
+        added++;
+    }
+
+    freeifaddrs(ifa_list);
+    return ret != 0 ? ret : added;
+}
+
+static int arp_offload(struct iovar_session *s, int on, char **addrs, int n)
+{
+    int ret;
+
+    if (!on)
+        return set_iovar_int(s, "arpoe", 0);
+
+    ret = set_iovar_int(s, "arp_ol", ARP_OL_AGENT | ARP_OL_PEER_AUTO_REPLY);
+    if (ret == 0)
+        ret = set_iovar_int(s, "arpoe", 1);
+    if (ret == 0)
+        ret = offload_hostips(s, AF_INET, addrs, n);
+    return ret < 0 ? ret : 0;
+}
+
+static int nd_offload(struct iovar_session *s, int on, char **addrs, int n)
+{
+    int ret;
+
+    if (!on)
+        return set_iovar_int(s, "ndoe", 0);
+
+    ret = set_iovar_int(s, "ndoe", 1);
+    if (ret == 0)
+        ret = offload_hostips(s, AF_INET6, addrs, n);
+    return ret < 0 ? ret : 0;
+}
+
+static int parse_on_off(const char *arg, int *on)
+{
+    if (strcmp(arg, "on") == 0)
+        *on = 1;
+    else if (strcmp(arg, "off") == 0)
+        *on = 0;
+    else
+        return -EINVAL;
+    return 0;
+}
+
+static int cmd_arp_offload(struct iovar_session *s, int argc, char **argv)
+{
+    int on, ret;
+
+    if (parse_on_off(argv[0], &on) != 0) {
+        fprintf(stderr, "ERROR: arp-offload <on|off> [ipv4...]\n");
+        return 1;
+    }
+    ret = arp_offload(s, on, argv + 1, argc - 1);
+    if (out_format == OUT_JSON) {
+        json_begin("arp-offload");
+        json_bool("enabled", on);
+        json_error(ret);
+        json_end();
+    } else if (ret == 0) {
+        printf("arp offload %s\n", on ? "enabled" : "disabled");
+    }
+    return ret != 0;
+}
+
+static int cmd_nd_offload(struct iovar_session *s, int argc, char **argv)
+{
+    int on, ret;
+
+    if (parse_on_off(argv[0], &on) != 0) {
+        fprintf(stderr, "ERROR: nd-offload <on|off> [ipv6...]\n");
+        return 1;
+    }
+    ret = nd_offload(s, on, argv + 1, argc - 1);
+    if (out_format == OUT_JSON) {
+        json_begin("nd-offload");
+        json_bool("enabled", on);
+        json_error(ret);
+        json_end();
+    } else if (ret == 0) {
+        printf("nd offload %s\n", on ? "enabled" : "disabled");
+    }
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * pkt-filter - Manage firmware packet filters
+ *
+ *   pkt-filter add <id> <offset> <mask-hex> <pattern-hex> [negate]
+ *   pkt-filter enable|disable|delete <id>
+ *   pkt-filter mode <0|1>     1 = forward frames matching an enabled
+ *                             filter, drop the rest; 0 = drop on match
+ * ------------------------------------------------------------------------- */
+static int cmd_pkt_filter(struct iovar_session *s, int argc, char **argv)
+{
+    uint32_t id, offset, negate = 0;
+    int ret;
+
+    if (argc >= 2 && strcmp(argv[0], "mode") == 0 &&
+        parse_u32(argv[1], &id) == 0 && id <= 1) {
+        ret = set_iovar_int(s, "pkt_filter_mode", id);
+    } else if (argc >= 5 && strcmp(argv[0], "add") == 0 &&
+               parse_u32(argv[1], &id) == 0 &&
+               parse_u32(argv[2], &offset) == 0 &&
+               (argc < 6 || parse_u32(argv[5], &negate) == 0)) {
+        ret = pkt_filter_add(s, id, offset, argv[3], argv[4], negate);
+    } else if (argc >= 2 && parse_u32(argv[1], &id) == 0 &&
+               strcmp(argv[0], "enable") == 0) {
+        ret = pkt_filter_enable(s, id, 1);
+    } else if (argc >= 2 && parse_u32(argv[1], &id) == 0 &&
+               strcmp(argv[0], "disable") == 0) {
+        ret = pkt_filter_enable(s, id, 0);
+    } else if (argc >= 2 && parse_u32(argv[1], &id) == 0 &&
+               strcmp(argv[0], "delete") == 0) {
+        ret = pkt_filter_delete(s, id);
+    } else {
+        fprintf(stderr, "ERROR: pkt-filter add <id> <offset> <mask> "
+                "<pattern> [negate] | enable|disable|delete <id> | "
+                "mode <0|1>\n");
+        return 1;
+    }
+
+    if (out_format == OUT_JSON) {
+        json_begin("pkt-filter");
+        json_str("action", argv[0]);
+        json_u32(strcmp(argv[0], "mode") == 0 ? "mode" : "id", id);
+        json_error(ret);
+        json_end();
+    } else if (ret == 0) {
+        printf("pkt-filter %s done\n", argv[0]);
+    }
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Wakeup accounting
+ *
+ * Compares what the firmware received (counters rxframe) with what was
+ * delivered to the host (interface rx_packets) and how many bus/host
+ * interrupts fired (/proc/interrupts lines naming brcmf, i.e. the brcmfmac
+ * OOB/PCIe interrupt, or the SDIO host controller the interface sits on;
+ * other mmc hosts such as the SD card slot are not counted).
+ * ------------------------------------------------------------------------- */
+struct wake_sample {
+    struct counter_snapshot fw;
+    uint64_t                host_rx;
+    uint64_t                irqs;
+};
+
+static int read_sysfs_u64(const char *path, uint64_t *out)
+{
+    unsigned long long v;
+    FILE *f = fopen(path, "r");
+    int ok;
+
+    if (!f)
+        return -errno;
+    ok = fscanf(f, "%llu", &v) == 1;
+    fclose(f);
+    if (!ok)
+        return -EINVAL;
+    *out = v;
+    return 0;
+}
+
+/*
+ * Name of the SDIO host ("mmc1") an interface's device hangs off, from
+ * .../mmc_host/mmc1/mmc1:0001/mmc1:0001:1; empty for PCIe and USB.
+ */
+static void wlan_mmc_host(const char *ifname, char *host, size_t len)
+{
+    char path[128], real[PATH_MAX];
+    const char *p;
+
+    host[0] = '\0';
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device", ifname);
+    if (!realpath(path, real))
+        return;
+    p = strstr(real, "/mmc_host/");
+    if (!p)
+        return;
+    p += strlen("/mmc_host/");
+    snprintf(host, len, "%.*s", (int)strcspn(p, "/"), p);
+}
+
+/* 'name' appears in 'text' as a whole word ("mmc1" but not "mmc10") */
+static int has_word(const char *text, const char *name)
+{
+    size_t n = strlen(name);
+    const char *p;
+
+    for (p = strstr(text, name); p; p = strstr(p + 1, name)) {
+        if ((p == text || !isalnum((unsigned char)p[-1])) &&
+            !isalnum((unsigned char)p[n]))
+            return 1;
+    }
+    return 0;
+}
+
+static uint64_t read_wlan_irqs(const char *ifname)
+{
+    char line[512], host[32];
+    uint64_t total = 0;
+    FILE *f = fopen("/proc/interrupts", "r");
+
+    if (!f)
+        return 0;
+
+    wlan_mmc_host(ifname, host, sizeof(host));
+    while (fgets(line, sizeof(line), f)) {
+        char *p = strchr(line, ':');
+
+        if (!p || (!strstr(p, "brcmf") && (!host[0] || !has_word(p, host))))
+            continue;
+        /* per-CPU counts follow the "NN:" label */
+        for (p++;;) {
+            char *end;
+            unsigned long long v = strtoull(p, &end, 10);
+            if (end == p)
+                break;
+            total += v;
+            p = end;
+        }
+    }
+
+    fclose(f);
+    return total;
+}
+
+static int wake_read(struct iovar_session *s, struct wake_sample *w)
+{
+    char path[128];
+    int ret;
+
+    ret = counters_read(s, &w->fw);
+    if (ret != 0)
+        return ret;
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets",
+             s->ifname);
+    if (read_sysfs_u64(path, &w->host_rx) != 0)
+        w->host_rx = 0;
+    w->irqs = read_wlan_irqs(s->ifname);
+    return 0;
+}
+
+struct wake_rates {
+    double fw_rx;       /* frames/s seen by firmware */
+    double host_rx;     /* packets/s delivered to host */
+    double irqs;        /* interrupts/s */
+};
+
+static int wake_measure(struct iovar_session *s, unsigned secs,
+                        struct wake_rates *r)
+{
+    struct wake_sample a, b;
+    double t;
+
+    if (wake_read(s, &a) != 0)
+        return -EIO;
+    sleep_seconds(secs);
+    if (wake_read(s, &b) != 0)
+        return -EIO;
+
+    t = timespec_diff(&a.fw.ts, &b.fw.ts);
+    if (t <= 0)
+        t = secs;
+    r->fw_rx = (uint32_t)(b.fw.val[CNT_RXFRAME] - a.fw.val[CNT_RXFRAME]) / t;
+    r->host_rx = (double)(b.host_rx - a.host_rx) / t;
+    r->irqs = (double)(b.irqs - a.irqs) / t;
+    return 0;
+}
+
+static void wake_print(const char *command, const char *label,
+                       const struct wake_rates *r)
+{
+    if (out_format == OUT_JSON) {
+        json_begin(command);
+        json_str("window", label);
+        json_double("fw_rx_per_s", r->fw_rx);
+        json_double("host_rx_per_s", r->host_rx);
+        json_double("irqs_per_s", r->irqs);
+        json_end();
+        return;
+    }
+    printf("  %-10s fw rx %9.1f/s  host rx %9.1f/s  irqs %9.1f/s\n",
+           label, r->fw_rx, r->host_rx, r->irqs);
+}
+
+static int cmd_wake_stats(struct iovar_session *s, int argc, char **argv)
+{
+    struct wake_rates r;
+    uint32_t secs = 10;
+
+    if (argc > 0 && (parse_u32(argv[0], &secs) != 0 || secs == 0)) {
+        fprintf(stderr, "ERROR: wake-stats [seconds]\n");
+        return 1;
+    }
+    if (wake_measure(s, secs, &r) != 0)
+        return 1;
+    if (out_format == OUT_TEXT)
+        printf("wakeups on %s over %u s:\n", s->ifname, secs);
+    wake_print("wake-stats", "current", &r);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * quiet-host - ARP + ND offload and a forward-on-match filter set
+ *
+ * Only frames the host actually needs cross the bus: unicast to us, mDNS
+ * (Volumio discovery), DHCPv4 replies and ICMPv6 (RA/ND the offload does
+ * not cover). ARP requests and neighbour solicitations for our addresses
+ * are answered by the firmware; other broadcast/multicast is dropped.
+ * With a measurement window, wakeups are sampled before and after.
+ *
+ * "on" records the previous pkt_filter_mode in LEASE_DIR and "off" puts
+ * it back, so a host that ran drop-on-match filters keeps them working.
+ * ------------------------------------------------------------------------- */
+
+/* Per-interface state that outlives one invocation (quiet-host, leases) */
+#define LEASE_DIR   "/run/brcm-iovar"
+
+static const struct {
+    uint32_t    id;
+    uint32_t    offset;
+    const char *mask;
+    const char *pattern;
+} quiet_filters[] = {
+    /* unicast destination: I/G bit of the first address byte clear */
+    { 200, 0,  "01", "00" },
+    /* mDNS: 01:00:5e:00:00:fb and 33:33:00:00:00:fb */
+    { 201, 0,  "ffffffffffff", "01005e0000fb" },
+    { 202, 0,  "ffffffffffff", "3333000000fb" },
+    /* IPv4 UDP to port 68 (DHCP client), assuming no IP options */
+    { 203, 12, "ffff000000000000000000ff000000000000000000000000ffff",
+               "0800000000000000000000110000000000000000000000000044" },
+    /* IPv6 next header ICMPv6 */
+    { 204, 12, "ffff000000000000ff", "86dd0000000000003a" },
+};
+
+static void quiet_mode_path(const struct iovar_session *s, char *buf,
+                            size_t len)
+{
+    snprintf(buf, len, LEASE_DIR "/%s.quiet", s->ifname);
+}
+
+/* Record pkt_filter_mode unless an earlier "on" already did */
+static int quiet_mode_save(struct iovar_session *s)
+{
+    char path[128];
+    uint32_t mode;
+    FILE *f;
+    int ret;
+
+    quiet_mode_path(s, path, sizeof(path));
+    if (access(path, F_OK) == 0)
+        return 0;
+
+    ret = get_iovar_int(s, "pkt_filter_mode", &mode);
+    if (ret != 0)
+        return ret;
+
+    if (mkdir(LEASE_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", LEASE_DIR,
+                strerror(errno));
+        return -errno;
+    }
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "ERROR: Cannot write %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    fprintf(f, "pkt_filter_mode %u\n", mode);
+    if (fclose(f) != 0) {
+        unlink(path);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Put back the recorded pkt_filter_mode; nothing to do without a record */
+static int quiet_mode_restore(struct iovar_session *s)
+{
+    char path[128];
+    uint32_t mode;
+    FILE *f;
+    int ok, ret;
+
+    quiet_mode_path(s, path, sizeof(path));
+    f = fopen(path, "r");
+    if (!f)
+        return errno == ENOENT ? 0 : -errno;
+    ok = fscanf(f, "pkt_filter_mode %u", &mode) == 1;
+    fclose(f);
+    if (!ok) {
+        unlink(path);
+        return 0;
+    }
+
+    ret = set_iovar_int(s, "pkt_filter_mode", mode);
+    if (ret == 0)
+        unlink(path);
+    return ret;
+}
+
+static int quiet_host(struct iovar_session *s, int on)
+{
+    int first_err = 0;
+    size_t i;
+
+    if (on) {
+        first_err = quiet_mode_save(s);
+        if (first_err != 0)
+            return first_err;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(quiet_filters); i++) {
+        int ret;
+
+        if (on) {
+            ret = pkt_filter_add(s, quiet_filters[i].id,
+                                 quiet_filters[i].offset,
+                                 quiet_filters[i].mask,
+                                 quiet_filters[i].pattern, 0);
+            if (ret == 0)
+                ret = pkt_filter_enable(s, quiet_filters[i].id, 1);
+        } else {
+            pkt_filter_enable(s, quiet_filters[i].id, 0);
+            ret = pkt_filter_delete(s, quiet_filters[i].id);
+        }
+        if (ret != 0 && first_err == 0)
+            first_err = ret;
+    }
+
+    if (on) {
+        if (first_err == 0)
+            first_err = set_iovar_int(s, "pkt_filter_mode", 1);
+    } else {
+        int ret = quiet_mode_restore(s);
+        if (ret != 0 && first_err == 0)
+            first_err = ret;
+    }
+
+    if (first_err == 0)
+        first_err = arp_offload(s, on, NULL, 0);
+    if (first_err == 0)
+        first_err = nd_offload(s, on, NULL, 0);
+    return first_err;
+}
+
+static int cmd_quiet_host(struct iovar_session *s, int argc, char **argv)
+{
+    struct wake_rates before, after;
+    uint32_t secs = 0;
+    int on, ret;
+
+    if (parse_on_off(argv[0], &on) != 0 ||
+        (argc > 1 && parse_u32(argv[1], &secs) != 0)) {
+        fprintf(stderr, "ERROR: quiet-host <on|off> [seconds]\n");
+        return 1;
+    }
+
+    if (secs && wake_measure(s, secs, &before) != 0)
+        return 1;
+
+    ret = quiet_host(s, on);
+    /* Never leave a half-built filter set dropping traffic */
+    if (ret != 0 && on)
+        quiet_host(s, 0);
+    if (out_format == OUT_JSON) {
+        json_begin("quiet-host");
+        json_bool("enabled", on);
+        json_error(ret);
+        json_end();
+    } else if (ret == 0) {
+        printf("quiet-host %s on %s\n", on ? "enabled" : "disabled",
+               s->ifname);
+    }
+    if (ret != 0)
+        return 1;
+
+    if (secs) {
+        if (wake_measure(s, secs, &after) != 0)
+            return 1;
+        wake_print("quiet-host", "before", &before);
+        wake_print("quiet-host", "after", &after);
+        if (out_format == OUT_JSON)
+            return 0;
+        if (before.host_rx > 0)
+            printf("  host rx %+.1f%%", 100.0 *
+                   (after.host_rx - before.host_rx) / before.host_rx);
+        if (before.irqs > 0)
+            printf("  irqs %+.1f%%", 100.0 *
+                   (after.irqs - before.irqs) / before.irqs);
+        printf("\n");
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * SDIO bus glomming
+ *
+ * On SDIO boards (Pi 3B+/4/Zero 2 W/CM4) the firmware can aggregate
+ * several frames into one bus transfer ("glom"). Fewer, larger CMD53
+ * transfers mean fewer interrupts and less per-packet host CPU, at the
+ * cost of alignment padding. The bus:* iovars are implemented by the
+ * firmware's SDIO bus layer only; PCIe (Pi 5) and USB firmware rejects
+ * them, which brcmfmac reports as -EBADE.
+ *
+ * The host side of glomming is the brcmfmac module parameter txglomsz,
+ * shown alongside for reference.
+ * ------------------------------------------------------------------------- */
+static const char *const bus_glom_iovars[] = {
+    "bus:txglom", "bus:txglomalign", "bus:rxglom",
+};
+
+static int cmd_bus(struct iovar_session *s, int argc, char **argv)
+{
+    uint64_t txglomsz;
+    size_t i;
+    (void)argc; (void)argv;
+
+    for (i = 0; i < ARRAY_SIZE(bus_glom_iovars); i++) {
+        uint32_t v;
+        int ret = iovar_probe_int(s, bus_glom_iovars[i], &v);
+
+        if (out_format == OUT_JSON) {
+            json_begin("bus");
+            json_str("iovar", bus_glom_iovars[i]);
+            if (ret == 0)
+                json_u32("value", v);
+            else
+                json_null("value");
+            json_error(ret);
+            json_end();
+        } else if (ret == 0) {
+            printf("%-16s = %u\n", bus_glom_iovars[i], v);
+        } else {
+            printf("%-16s   unsupported (%s)\n", bus_glom_iovars[i],
+                   strerror(-ret));
+        }
+    }
+
+    if (read_sysfs_u64("/sys/module/brcmfmac/parameters/txglomsz",
+                       &txglomsz) != 0)
+        return 0;
+    if (out_format == OUT_JSON) {
+        json_begin("bus");
+        json_str("param", "txglomsz");
+        json_num("value", "%llu", (unsigned long long)txglomsz);
+        json_end();
+    } else {
+        printf("%-16s = %llu (host, module parameter)\n", "txglomsz",
+               (unsigned long long)txglomsz);
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * bus-bench - Throughput and host CPU cost of the current bus settings
+ *
+ *   bus-bench tx <host[:port]> [seconds]   UDP blast out of the interface
+ *   bus-bench rx <port> [seconds]          count UDP arriving on a port
+ *                                          (run a sender on another host)
+ *   bus-bench sweep <host[:port]> [seconds]
+ *                                          tx, labelled with bus:rxglom
+ *
+ * bus:rxglom is the dongle accepting glommed host-to-dongle transfers,
+ * i.e. the path tx traffic takes; bus:txglom only affects received
+ * traffic. brcmfmac sets bus:rxglom once, in brcmf_sdio_bus_preinit(),
+ * and picks host txglom and the SDPCM_HWEXT header from the result, so
+ * switching it under the running driver can break the SDIO tx path.
+ * sweep therefore only reads it: runs to compare come from driver loads
+ * that settled on different values.
+ *
+ * Both benchmarks stop early on SIGINT/SIGTERM and report what they have.
+ *
+ * Throughput is taken from the interface statistics (what actually left
+ * or arrived, not what the socket accepted). CPU is system-wide from
+ * /proc/stat, since SDIO work runs in the brcmfmac kthread and softirq
+ * rather than in this process; "us/pkt" is busy CPU time per packet.
+ * ------------------------------------------------------------------------- */
+#define BENCH_PAYLOAD       1400
+#define BENCH_PORT          9       /* discard */
+
+struct cpu_sample {
+    unsigned long long busy;
+    unsigned long long softirq;
+    unsigned long long total;
+};
+
+struct bench_result {
+    double mbps;
+    double pps;
+    double cpu_pct;
+    double softirq_pct;
+    double us_per_pkt;
+};
+
+static int cpu_read(struct cpu_sample *c)
+{
+    unsigned long long v[8] = { 0 };
+    FILE *f = fopen("/proc/stat", "r");
+    int n;
+
+    if (!f)
+        return -errno;
+    n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    fclose(f);
+    if (n < 4)
+        return -EINVAL;
+
+    /* user nice system idle iowait irq softirq steal */
+    c->total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+    c->busy = c->total - v[3] - v[4];
+    c->softirq = v[6];
+    return 0;
+}
+
+static int if_stat(const char *ifname, const char *stat, uint64_t *out)
+{
+    char path[128];
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+             ifname, stat);
+    return read_sysfs_u64(path, out);
+}
+
+static void bench_finish(const struct cpu_sample *c0,
+                         const struct cpu_sample *c1,
+                         uint64_t bytes, uint64_t pkts, double secs,
+                         struct bench_result *r)
+{
+    double total = (double)(c1->total - c0->total);
+    double busy = (double)(c1->busy - c0->busy);
+    long hz = sysconf(_SC_CLK_TCK);
+
+    r->mbps = secs > 0 ? bytes * 8.0 / secs / 1e6 : 0;
+    r->pps = secs > 0 ? pkts / secs : 0;
+    r->cpu_pct = total > 0 ? 100.0 * busy / total : 0;
+    r->softirq_pct = total > 0 ?
+        100.0 * (double)(c1->softirq - c0->softirq) / total : 0;
+    r->us_per_pkt = pkts && hz > 0 ? busy / (double)hz * 1e6 / pkts : 0;
+}
+
+static int bench_tx(const char *ifname, const char *target, unsigned secs,
+                    struct bench_result *r)
+{
+    static uint8_t payload[BENCH_PAYLOAD];
+    struct sockaddr_in dst;
+    struct cpu_sample c0, c1;
+    struct timespec t0, now;
+    uint64_t b0, b1, p0, p1;
+    char host[64];
+    char *colon;
+    uint32_t port = BENCH_PORT;
+    unsigned long sent = 0;
+    int fd;
+
+    snprintf(host, sizeof(host), "%s", target);
+    colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        if (parse_u32(colon + 1, &port) != 0 || port == 0 || port > 65535)
+            return -EINVAL;
+    }
+
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &dst.sin_addr) != 1)
+        return -EINVAL;
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname,
+               (socklen_t)strlen(ifname));
+
+    if (if_stat(ifname, "tx_bytes", &b0) != 0 ||
+        if_stat(ifname, "tx_packets", &p0) != 0 || cpu_read(&c0) != 0) {
+        close(fd);
+        return -EIO;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        /* ENOBUFS is qdisc back-pressure: keep pushing */
+        if (sendto(fd, payload, sizeof(payload), 0,
+                   (struct sockaddr *)&dst, sizeof(dst)) < 0 &&
+            errno != ENOBUFS && errno != EAGAIN) {
+            int err = -errno;
+            close(fd);
+            return err;
+        }
+        if ((++sent & 63) == 0)
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        else
+            now = t0;
+    } while (!stop_requested &&
+             ((sent & 63) != 0 || timespec_diff(&t0, &now) < secs));
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    cpu_read(&c1);
+    if_stat(ifname, "tx_bytes", &b1);
+    if_stat(ifname, "tx_packets", &p1);
+    close(fd);
+
+    bench_finish(&c0, &c1, b1 - b0, p1 - p0, timespec_diff(&t0, &now), r);
+    return 0;
+}
+
+static int bench_rx(const char *ifname, uint32_t port, unsigned secs,
+                    struct bench_result *r)
+{
+    static uint8_t buf[65536];
+    struct sockaddr_in addr;
+    struct cpu_sample c0, c1;
+    struct timespec t0, now;
+    uint64_t b0, b1, p0, p1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname,
+               (socklen_t)strlen(ifname));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+
+    if (if_stat(ifname, "rx_bytes", &b0) != 0 ||
+        if_stat(ifname, "rx_packets", &p0) != 0 || cpu_read(&c0) != 0) {
+        close(fd);
+        return -EIO;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (now = t0; !stop_requested && timespec_diff(&t0, &now) < secs;
+         clock_gettime(CLOCK_MONOTONIC, &now)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 100) > 0)
+            while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ;
+    }
+
+    cpu_read(&c1);
+    if_stat(ifname, "rx_bytes", &b1);
+    if_stat(ifname, "rx_packets", &p1);
+    close(fd);
+
+    bench_finish(&c0, &c1, b1 - b0, p1 - p0, timespec_diff(&t0, &now), r);
+    return 0;
+}
+
+/* rxglom is the bus:rxglom read for a sweep, NULL for tx/rx */
+static void bench_print(const char *mode, const uint32_t *rxglom,
+                        const struct bench_result *r)
+{
+    char label[32];
+
+    if (out_format == OUT_JSON) {
+        json_begin("bus-bench");
+        json_str("mode", mode);
+        if (rxglom)
+            json_u32("rxglom", *rxglom);
+        json_double("mbps", r->mbps);
+        json_double("pps", r->pps);
+        json_double("cpu_pct", r->cpu_pct);
+        json_double("softirq_pct", r->softirq_pct);
+        json_double("us_per_pkt", r->us_per_pkt);
+        json_end();
+        return;
+    }
+    if (rxglom)
+        snprintf(label, sizeof(label), "rxglom=%u", *rxglom);
+    else
+        snprintf(label, sizeof(label), "%s", mode);
+    printf("  %-12s %8.2f Mbit/s %9.0f pkt/s  cpu %5.1f%% "
+           "(softirq %4.1f%%)  %6.1f us/pkt\n", label, r->mbps, r->pps,
+           r->cpu_pct, r->softirq_pct, r->us_per_pkt);
+}
+
+static int cmd_bus_bench(struct iovar_session *s, int argc, char **argv)
+{
+    struct bench_result r;
+    uint32_t secs = 10, port = 0, rxglom;
+    int ret;
+
+    if (argc < 2 || (argc > 2 && (parse_u32(argv[2], &secs) != 0 ||
+                                  secs == 0))) {
+        fprintf(stderr, "ERROR: bus-bench tx|sweep <host[:port]> "
+                "[seconds] | rx <port> [seconds]\n");
+        return 1;
+    }
+    install_stop_handlers();
+
+    if (strcmp(argv[0], "tx") == 0) {
+        ret = bench_tx(s->ifname, argv[1], secs, &r);
+        if (ret == 0)
+            bench_print("tx", NULL, &r);
+    } else if (strcmp(argv[0], "rx") == 0) {
+        if (parse_u32(argv[1], &port) != 0 || port == 0 || port > 65535)
+            ret = -EINVAL;
+        else
+            ret = bench_rx(s->ifname, port, secs, &r);
+        if (ret == 0)
+            bench_print("rx", NULL, &r);
+    } else if (strcmp(argv[0], "sweep") == 0) {
+        /* Read only: see above */
+        ret = iovar_probe_int(s, "bus:rxglom", &rxglom);
+        if (ret != 0) {
+            fprintf(stderr, "ERROR: bus:rxglom not supported by this "
+                    "firmware (%s)\n", strerror(-ret));
+            return 1;
+        }
+        ret = bench_tx(s->ifname, argv[1], secs, &r);
+        if (ret == 0) {
+            bench_print("sweep", &rxglom, &r);
+            if (out_format != OUT_JSON)
+                printf("  (bus:rxglom is set by brcmfmac at bus init and "
+                       "not switched here)\n");
+        }
+    } else {
+        ret = -EINVAL;
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: bus-bench failed: %s\n", strerror(-ret));
+        return 1;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * ack-bench - Reply bytes of failing large writes, with and without
+ *             NETLINK_CAP_ACK
+ *
+ * The kernel echoes a request in full inside its netlink error unless
+ * NETLINK_CAP_ACK is set; successful ACKs only ever carry the header.
+ * Writes 'bytes' of zeroes to an iovar name no firmware knows, so every
+ * request fails and nothing changes on the device, 'count' times with
+ * the option off and again with it on. Requests are pipelined
+ * ACK_BENCH_DEPTH at a time.
+ * ------------------------------------------------------------------------- */
+#define ACK_BENCH_IOVAR     "brcm_iovar_ack_bench"
+/* BRCMF_DCMD_MAXLEN bounds the whole request: name, NUL and payload */
+#define ACK_BENCH_MAX       (8192 - (int)sizeof(ACK_BENCH_IOVAR))
+#define ACK_BENCH_DEPTH     8
+
+struct ack_result {
+    uint64_t    bytes;      /* error/ACK bytes received */
+    unsigned    ok;         /* writes that unexpectedly succeeded */
+    unsigned    failed;
+    long        us;
+};
+
+static int ack_bench_run(struct iovar_session *s, const uint8_t *payload,
+                         size_t len, uint32_t count, int cap,
+                         struct ack_result *res)
+{
+    struct vendor_req reqs[ACK_BENCH_DEPTH];
+    struct timespec t0;
+    uint32_t done = 0;
+    size_t i, n;
+    int ret;
+
+    /* The receive buffers are sized for the echoes from s->cap_ack */
+    ret = netlink_option(s->sk, NETLINK_CAP_ACK, cap);
+    if (ret != 0)
+        return ret;
+    s->cap_ack = cap;
+
+    memset(res, 0, sizeof(*res));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (done < count) {
+        n = count - done < ACK_BENCH_DEPTH ? count - done : ACK_BENCH_DEPTH;
+        memset(reqs, 0, sizeof(reqs));
+        for (i = 0; i < n; i++) {
+            reqs[i].cmd = BRCMF_C_SET_VAR;
+            reqs[i].is_set = 1;
+            reqs[i].payload = payload;
+            reqs[i].payload_len = len;
+            reqs[i].ret_len = (int32_t)len;
+        }
+        send_vendor_batch(s, reqs, n);
+        for (i = 0; i < n; i++) {
+            res->bytes += reqs[i].ack_len;
+            if (reqs[i].resp.error == 0)
+                res->ok++;
+            else
+                res->failed++;
+            free(reqs[i].resp.data);
+        }
+        done += (uint32_t)n;
+    }
+    res->us = elapsed_us(&t0);
+    return 0;
+}
+
+static void ack_bench_print(const char *label, uint32_t count,
+                            const struct ack_result *r)
+{
+    if (out_format == OUT_JSON) {
+        json_begin("ack-bench");
+        json_str("cap_ack", label);
+        json_u32("writes", count);
+        json_num("reply_bytes", "%llu", (unsigned long long)r->bytes);
+        json_u32("failed", r->failed);
+        json_num("elapsed_us", "%ld", r->us);
+        json_end();
+        return;
+    }
+    printf("  NETLINK_CAP_ACK %-3s  %10llu reply bytes (%llu per write), "
+           "%.1f ms\n", label, (unsigned long long)r->bytes,
+           (unsigned long long)(r->bytes / count), r->us / 1000.0);
+}
+
+static int cmd_ack_bench(struct iovar_session *s, int argc, char **argv)
+{
+    struct ack_result off, on;
+    uint32_t bytes = 1024, count = 100;
+    size_t name_len = sizeof(ACK_BENCH_IOVAR);
+    uint8_t *payload;
+    int cap_ack = s->cap_ack;
+    int ret;
+
+    if ((argc > 0 && (parse_u32(argv[0], &bytes) != 0 ||
+                      bytes > (uint32_t)ACK_BENCH_MAX)) ||
+        (argc > 1 && (parse_u32(argv[1], &count) != 0 || !count))) {
+        fprintf(stderr, "ERROR: ack-bench [bytes (max %d)] [count]\n",
+                ACK_BENCH_MAX);
+        return 1;
+    }
+    if (s->emulated) {
+        fprintf(stderr, "ERROR: ack-bench measures the kernel's replies, "
+                "it cannot run with --emulate\n");
+        return 1;
+    }
+
+    payload = calloc(1, name_len + bytes);
+    if (!payload)
+        return 1;
+    memcpy(payload, ACK_BENCH_IOVAR, name_len);
+
+    ret = ack_bench_run(s, payload, name_len + bytes, count, 0, &off);
+    if (ret == 0)
+        ret = ack_bench_run(s, payload, name_len + bytes, count, 1, &on);
+    netlink_option(s->sk, NETLINK_CAP_ACK, cap_ack);
+    s->cap_ack = cap_ack;
+    free(payload);
+
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: Cannot toggle NETLINK_CAP_ACK: %s\n",
+                strerror(-ret));
+        return 1;
+    }
+    if (off.ok || on.ok)
+        fprintf(stderr, "WARNING: %u writes to %s succeeded\n",
+                off.ok + on.ok, ACK_BENCH_IOVAR);
+
+    if (out_format == OUT_TEXT)
+        printf("ack-bench: %u failing writes of %u bytes\n", count, bytes);
+    ack_bench_print("off", count, &off);
+    ack_bench_print("on", count, &on);
+    if (out_format == OUT_TEXT && off.bytes > on.bytes)
+        printf("  saved %llu bytes (%.1f%%)\n",
+               (unsigned long long)(off.bytes - on.bytes),
+               100.0 * (double)(off.bytes - on.bytes) / (double)off.bytes);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Sampling engine
+ *
+ * A sampler reads a fixed set of firmware sources on every tick over one
+ * session. Sources are optional: firmware builds differ in which iovars
+ * they implement, so the first "not supported" answer (-EBADE from the
+ * firmware, or a short reply) marks the source unsupported for the rest
+ * of the run and a single note is printed. Transient errors only
+ * invalidate the current tick.
+ *
+ * Thermal sources:
+ *   phy_tempsense    chip temperature, degrees C (signed)
+ *   phy_tempthresh   temperature at which the firmware starts mitigation
+ *   qtxpower         current TX power limit in quarter dBm; bit 31 flags
+ *                    a user override and is masked off
+ *   pwrthrottle      nonzero while the firmware's power throttle is on
+ *
+ * Thermal mitigation works by cutting TX power and duty cycle, which
+ * looks exactly like a coex or interference problem in throughput
+ * numbers. A tick is flagged as throttled when the firmware says so,
+ * when the temperature is at or above the limit, or when the TX power
+ * limit has dropped below the highest value seen during the run.
+ *
+ * Counters and BT coex statistics are sampled as snapshots; consumers
+ * turn consecutive snapshots into per-interval deltas.
+ * ------------------------------------------------------------------------- */
+#define SAMPLE_TEMP_LIMIT_DEFAULT   85
+#define QTXPOWER_OVERRIDE           0x80000000u
+#define SAMPLE_MAX_PERIODS          32
+
+enum sample_src {
+    SRC_TEMP,
+    SRC_TEMPTHRESH,
+    SRC_TXPOWER,
+    SRC_PWRTHROTTLE,
+    SRC_COUNT
+};
+
+static const char *const sample_src_iovars[SRC_COUNT] = {
+    [SRC_TEMP]        = "phy_tempsense",
+    [SRC_TEMPTHRESH]  = "phy_tempthresh",
+    [SRC_TXPOWER]     = "qtxpower",
+    [SRC_PWRTHROTTLE] = "pwrthrottle",
+};
+
+/* Reasons a tick counts as throttled */
+#define THROTTLE_FW     0x1     /* pwrthrottle reports active */
+#define THROTTLE_TEMP   0x2     /* temperature at or above the limit */
+#define THROTTLE_TXPWR  0x4     /* TX power limit below the run maximum */
+
+struct sample {
+    struct timespec         ts;
+    unsigned                valid;          /* bit per enum sample_src */
+    int32_t                 val[SRC_COUNT];
+    int                     have_counters;
+    struct counter_snapshot cnt;
+    int                     have_coex;
+    struct coex_snapshot    coex;
+    unsigned                throttle;       /* THROTTLE_* */
+};
+
+struct throttle_period {
+    double   start;                 /* seconds since sampler start */
+    double   end;
+    unsigned reasons;
+};
+
+struct sampler {
+    struct iovar_session   *s;
+    unsigned                unsupported;    /* bit per enum sample_src */
+    int                     counters_ok;
+    int                     coex_ok;
+    int32_t                 temp_limit;     /* <= 0: use firmware's */
+    int32_t                 txpower_max;
+    struct timespec         start;
+
+    /* Run metrics */
+    unsigned                n_samples;
+    unsigned                n_temp;
+    int32_t                 temp_min;
+    int32_t                 temp_max;
+    long long               temp_sum;
+    int32_t                 txpower_min;
+    int                     have_coex_first;
+    struct coex_snapshot    coex_first;
+    struct coex_snapshot    coex_last;
+    unsigned                n_throttled;
+    struct throttle_period  periods[SAMPLE_MAX_PERIODS];
+    unsigned                n_periods;
+    unsigned                periods_dropped;
+    int                     in_period;
+};
+
+static void sampler_init(struct sampler *sp, struct iovar_session *s,
+                         int32_t temp_limit)
+{
+    memset(sp, 0, sizeof(*sp));
+    sp->s = s;
+    sp->counters_ok = 1;
+    sp->coex_ok = 1;
+    sp->temp_limit = temp_limit;
+    clock_gettime(CLOCK_MONOTONIC, &sp->start);
+}
+
+/* Permanent errors: the firmware lacks the source or its layout is unknown.
+ * Anything else (a timeout, a busy bus) only costs the one sample. */
+static int sampler_unsupported(int err)
+{
+    return err == -EBADE || err == -EOPNOTSUPP || err == -ENODATA ||
+           err == -EPROTONOSUPPORT;
+}
+
+static void sampler_mark(struct sampler *sp, unsigned src, int err)
+{
+    sp->unsupported |= 1u << src;
+    fprintf(stderr, "note: %s not available on this firmware (%s), "
+            "not sampled\n", sample_src_iovars[src], strerror(-err));
+}
+
+static unsigned sample_classify(struct sampler *sp, const struct sample *smp)
+{
+    unsigned reasons = 0;
+    int32_t limit = sp->temp_limit;
+
+    if (limit <= 0)
+        limit = smp->valid & (1u << SRC_TEMPTHRESH) ?
+                smp->val[SRC_TEMPTHRESH] : SAMPLE_TEMP_LIMIT_DEFAULT;
+
+    if ((smp->valid & (1u << SRC_PWRTHROTTLE)) && smp->val[SRC_PWRTHROTTLE])
+        reasons |= THROTTLE_FW;
+    if ((smp->valid & (1u << SRC_TEMP)) && limit > 0 &&
+        smp->val[SRC_TEMP] >= limit)
+        reasons |= THROTTLE_TEMP;
+    if (smp->valid & (1u << SRC_TXPOWER)) {
+        if (smp->val[SRC_TXPOWER] > sp->txpower_max)
+            sp->txpower_max = smp->val[SRC_TXPOWER];
+        else if (smp->val[SRC_TXPOWER] < sp->txpower_max)
+            reasons |= THROTTLE_TXPWR;
+    }
+    return reasons;
+}
+
+static void sampler_account(struct sampler *sp, const struct sample *smp)
+{
+    double t = timespec_diff(&sp->start, &smp->ts);
+
+    sp->n_samples++;
+
+    if (smp->valid & (1u << SRC_TEMP)) {
+        int32_t temp = smp->val[SRC_TEMP];
+
+        if (sp->n_temp == 0 || temp < sp->temp_min)
+            sp->temp_min = temp;
+        if (sp->n_temp == 0 || temp > sp->temp_max)
+            sp->temp_max = temp;
+        sp->temp_sum += temp;
+        sp->n_temp++;
+    }
+    if ((smp->valid & (1u << SRC_TXPOWER)) &&
+        (sp->txpower_min == 0 || smp->val[SRC_TXPOWER] < sp->txpower_min))
+        sp->txpower_min = smp->val[SRC_TXPOWER];
+
+    if (smp->have_coex) {
+        if (!sp->have_coex_first) {
+            sp->coex_first = smp->coex;
+            sp->have_coex_first = 1;
+        }
+        sp->coex_last = smp->coex;
+    }
+
+    if (smp->throttle) {
+        struct throttle_period *p;
+
+        sp->n_throttled++;
+        if (!sp->in_period) {
+            if (sp->n_periods == SAMPLE_MAX_PERIODS) {
+                sp->periods_dropped++;
+                return;
+            }
+            sp->in_period = 1;
+            p = &sp->periods[sp->n_periods++];
+            p->start = t;
+            p->reasons = 0;
+        }
+        p = &sp->periods[sp->n_periods - 1];
+        p->end = t;
+        p->reasons |= smp->throttle;
+    } else {
+        sp->in_period = 0;
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * sampler_read - Take one sample of every supported source
+ *
+ * Returns 0 if at least one source was read, -ENODATA if none were.
+ * ------------------------------------------------------------------------- */
+static int sampler_read(struct sampler *sp, struct sample *smp)
+{
+    unsigned i;
+
+    memset(smp, 0, sizeof(*smp));
+
+    for (i = 0; i < SRC_COUNT; i++) {
+        uint32_t v;
+        int ret;
+
+        if (sp->unsupported & (1u << i))
+            continue;
+        ret = iovar_probe_int(sp->s, sample_src_iovars[i], &v);
+        if (ret == 0) {
+            if (i == SRC_TXPOWER)
+                v &= ~QTXPOWER_OVERRIDE;
+            smp->val[i] = (int32_t)v;
+            smp->valid |= 1u << i;
+        } else if (sampler_unsupported(ret)) {
+            sampler_mark(sp, i, ret);
+        }
+    }
+
+    if (sp->counters_ok) {
+        int ret = counters_read(sp->s, &smp->cnt);
+
+        smp->have_counters = ret == 0;
+        if (sampler_unsupported(ret)) {
+            sp->counters_ok = 0;
+            fprintf(stderr, "note: counters unavailable (%s), rates not "
+                    "sampled\n", strerror(-ret));
+        }
+    }
+
+    if (sp->coex_ok) {
+        int ret = coex_read(sp->s, &smp->coex);
+
+        smp->have_coex = ret == 0;
+        if (sampler_unsupported(ret)) {
+            sp->coex_ok = 0;
+            fprintf(stderr, "note: btc_stats not available on this firmware "
+                    "(%s), coex not sampled\n", strerror(-ret));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &smp->ts);
+
+    if (!smp->valid && !smp->have_counters && !smp->have_coex)
+        return -ENODATA;
+
+    smp->throttle = sample_classify(sp, smp);
+    sampler_account(sp, smp);
+    return 0;
+}
+
+static void throttle_reasons(unsigned reasons, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s%s%s",
+             reasons & THROTTLE_FW ? "fw," : "",
+             reasons & THROTTLE_TEMP ? "temp," : "",
+             reasons & THROTTLE_TXPWR ? "txpwr," : "");
+    if (buf[0])
+        buf[strlen(buf) - 1] = '\0';
+}
+
+/* -------------------------------------------------------------------------
+ * watch - Periodic time series of thermal state and traffic
+ *
+ *   watch [interval-seconds] [count] [temp-limit]
+ *
+ * One line per tick until 'count' samples were taken (0 = until
+ * SIGINT/SIGTERM), then a summary with the temperature range, the TX
+ * power range and every throttled period with its cause. Rates are from
+ * the firmware counters between consecutive ticks; BT coex columns are
+ * the requests, grants and aborts within the interval.
+ * ------------------------------------------------------------------------- */
+static void watch_line(const struct sampler *sp, const struct sample *prev,
+                       const struct sample *cur)
+{
+    char reasons[32];
+
+    printf("%8.1f", timespec_diff(&sp->start, &cur->ts));
+
+    if (cur->valid & (1u << SRC_TEMP))
+        printf("  %4d", cur->val[SRC_TEMP]);
+    else
+        printf("  %4s", "-");
+
+    if (cur->valid & (1u << SRC_TXPOWER))
+        printf("  %6.2f", cur->val[SRC_TXPOWER] / 4.0);
+    else
+        printf("  %6s", "-");
+
+    if (prev && prev->have_counters && cur->have_counters) {
+        double rate[CNT_COUNT];
+
+        counters_rate(&prev->cnt, &cur->cnt, rate);
+        printf("  %8.0f  %8.0f  %6.1f", rate[CNT_TXFRAME], rate[CNT_RXFRAME],
+               rate[CNT_TXFRAME] > 0 ?
+               100.0 * rate[CNT_TXRETRANS] / rate[CNT_TXFRAME] : 0.0);
+    } else {
+        printf("  %8s  %8s  %6s", "-", "-", "-");
+    }
+
+    if (prev && prev->have_coex && cur->have_coex) {
+        uint32_t d[COEX_COUNT];
+
+        coex_delta(&prev->coex, &cur->coex, d);
+        printf("  %6u  %6u  %5u", d[COEX_REQ], d[COEX_GRANT], d[COEX_ABORT]);
+    } else {
+        printf("  %6s  %6s  %5s", "-", "-", "-");
+    }
+
+    throttle_reasons(cur->throttle, reasons, sizeof(reasons));
+    if (cur->throttle)
+        printf("  THROTTLED(%s)\n", reasons);
+    else
+        printf("  ok\n");
+    fflush(stdout);
+}
+
+static void watch_summary(const struct sampler *sp, const struct sample *last)
+{
+    unsigned i;
+
+    printf("\n%u samples over %.1f s\n", sp->n_samples,
+           sp->n_samples ? timespec_diff(&sp->start, &last->ts) : 0.0);
+
+    if (sp->n_temp)
+        printf("temperature   min %d  avg %.1f  max %d C\n", sp->temp_min,
+               (double)sp->temp_sum / sp->n_temp, sp->temp_max);
+    if (sp->txpower_max)
+        printf("tx power      min %.2f  max %.2f dBm\n",
+               sp->txpower_min / 4.0, sp->txpower_max / 4.0);
+
+    printf("throttled     %u of %u samples", sp->n_throttled, sp->n_samples);
+    if (sp->unsupported == (1u << SRC_COUNT) - 1)
+        printf(" (no thermal sources on this firmware)");
+    printf("\n");
+
+    if (sp->have_coex_first) {
+        uint32_t d[COEX_COUNT];
+
+        coex_delta(&sp->coex_first, &sp->coex_last, d);
+        printf("bt coex       %u requests  %u granted (duration %u)  "
+               "%u aborted  %u late\n", d[COEX_REQ], d[COEX_GRANT],
+               d[COEX_GRANT_DUR], d[COEX_ABORT], d[COEX_LATENCY]);
+    }
+
+    for (i = 0; i < sp->n_periods; i++) {
+        char reasons[32];
+
+        throttle_reasons(sp->periods[i].reasons, reasons, sizeof(reasons));
+        printf("  %8.1f - %8.1f s  (%s)\n", sp->periods[i].start,
+               sp->periods[i].end, reasons);
+    }
+    if (sp->periods_dropped)
+        printf("  ... %u more periods not listed\n", sp->periods_dropped);
+}
+
+static void watch_json(const struct sampler *sp, const struct sample *prev,
+                       const struct sample *cur)
+{
+    char reasons[32];
+
+    json_begin("watch");
+    json_double("time", timespec_diff(&sp->start, &cur->ts));
+    if (cur->valid & (1u << SRC_TEMP))
+        json_i32("temp_c", cur->val[SRC_TEMP]);
+    else
+        json_null("temp_c");
+    if (cur->valid & (1u << SRC_TXPOWER))
+        json_double("txpower_dbm", cur->val[SRC_TXPOWER] / 4.0);
+    else
+        json_null("txpower_dbm");
+
+    if (prev && prev->have_counters && cur->have_counters) {
+        double rate[CNT_COUNT];
+
+        counters_rate(&prev->cnt, &cur->cnt, rate);
+        json_double("tx_pps", rate[CNT_TXFRAME]);
+        json_double("rx_pps", rate[CNT_RXFRAME]);
+        json_double("retry_pct", rate[CNT_TXFRAME] > 0 ?
+                    100.0 * rate[CNT_TXRETRANS] / rate[CNT_TXFRAME] : 0.0);
+    }
+    if (prev && prev->have_coex && cur->have_coex) {
+        uint32_t d[COEX_COUNT];
+
+        coex_delta(&prev->coex, &cur->coex, d);
+        json_u32("bt_req", d[COEX_REQ]);
+        json_u32("bt_grant", d[COEX_GRANT]);
+        json_u32("bt_abort", d[COEX_ABORT]);
+    }
+
+    throttle_reasons(cur->throttle, reasons, sizeof(reasons));
+    json_bool("throttled", cur->throttle != 0);
+    json_str("throttle", reasons);
+    json_end();
+}
+
+static void watch_summary_json(const struct sampler *sp,
+                               const struct sample *last)
+{
+    unsigned i;
+
+    json_begin("watch-summary");
+    json_u32("samples", sp->n_samples);
+    json_double("duration", sp->n_samples ?
+                timespec_diff(&sp->start, &last->ts) : 0.0);
+    if (sp->n_temp) {
+        json_i32("temp_min", sp->temp_min);
+        json_double("temp_avg", (double)sp->temp_sum / sp->n_temp);
+        json_i32("temp_max", sp->temp_max);
+    }
+    if (sp->txpower_max) {
+        json_double("txpower_min_dbm", sp->txpower_min / 4.0);
+        json_double("txpower_max_dbm", sp->txpower_max / 4.0);
+    }
+    json_u32("throttled", sp->n_throttled);
+    if (sp->have_coex_first) {
+        uint32_t d[COEX_COUNT];
+
+        coex_delta(&sp->coex_first, &sp->coex_last, d);
+        json_u32("bt_req", d[COEX_REQ]);
+        json_u32("bt_grant", d[COEX_GRANT]);
+        json_u32("bt_grant_dur", d[COEX_GRANT_DUR]);
+        json_u32("bt_abort", d[COEX_ABORT]);
+        json_u32("bt_latency", d[COEX_LATENCY]);
+    }
+    json_u32("periods_dropped", sp->periods_dropped);
+    json_end();
+
+    for (i = 0; i < sp->n_periods; i++) {
+        char reasons[32];
+
+        throttle_reasons(sp->periods[i].reasons, reasons, sizeof(reasons));
+        json_begin("watch-throttle");
+        json_double("start", sp->periods[i].start);
+        json_double("end", sp->periods[i].end);
+        json_str("throttle", reasons);
+        json_end();
+    }
+}
+
+static void watch_binary(const struct sample *prev, const struct sample *cur,
+                         uint32_t seq)
+{
+    bin_start();
+    if (cur->valid & (1u << SRC_TEMP))
+        bin_sample(BS_TEMP, cur->val[SRC_TEMP], seq);
+    if (cur->valid & (1u << SRC_TXPOWER))
+        bin_sample(BS_TXPOWER, cur->val[SRC_TXPOWER], seq);
+    if (prev && prev->have_counters && cur->have_counters) {
+        bin_sample(BS_TXFRAME, (int32_t)(cur->cnt.val[CNT_TXFRAME] -
+                                         prev->cnt.val[CNT_TXFRAME]), seq);
+        bin_sample(BS_RXFRAME, (int32_t)(cur->cnt.val[CNT_RXFRAME] -
+                                         prev->cnt.val[CNT_RXFRAME]), seq);
+        bin_sample(BS_TXRETRANS, (int32_t)(cur->cnt.val[CNT_TXRETRANS] -
+                                           prev->cnt.val[CNT_TXRETRANS]),
+                   seq);
+    }
+    if (prev && prev->have_coex && cur->have_coex) {
+        uint32_t d[COEX_COUNT];
+
+        coex_delta(&prev->coex, &cur->coex, d);
+        bin_sample(BS_BT_REQ, (int32_t)d[COEX_REQ], seq);
+        bin_sample(BS_BT_GRANT, (int32_t)d[COEX_GRANT], seq);
+        bin_sample(BS_BT_ABORT, (int32_t)d[COEX_ABORT], seq);
+    }
+    bin_sample(BS_THROTTLE, (int32_t)cur->throttle, seq);
+    fflush(stdout);
+}
+
+static int cmd_watch(struct iovar_session *s, int argc, char **argv)
+{
+    struct sampler sp;
+    struct sample smp[2];
+    uint32_t interval = 1, count = 0, limit = 0;
+    unsigned n = 0;
+    int have_prev = 0;
+
+    if ((argc > 0 && (parse_u32(argv[0], &interval) != 0 || !interval)) ||
+        (argc > 1 && parse_u32(argv[1], &count) != 0) ||
+        (argc > 2 && parse_u32(argv[2], &limit) != 0)) {
+        fprintf(stderr, "ERROR: watch [interval-seconds] [count] "
+                "[temp-limit]\n");
+        return 1;
+    }
+
+    install_stop_handlers();
+    sampler_init(&sp, s, (int32_t)limit);
+
+    if (out_format == OUT_TEXT)
+        printf("%8s  %4s  %6s  %8s  %8s  %6s  %6s  %6s  %5s  %s\n", "time",
+               "temp", "txpwr", "tx/s", "rx/s", "retry%", "bt-req",
+               "bt-gnt", "abort", "state");
+
+    while (!stop_requested && (count == 0 || n < count)) {
+        struct sample *cur = &smp[n & 1];
+        struct sample *prev = &smp[(n + 1) & 1];
+
+        if (sampler_read(&sp, cur) != 0) {
+            fprintf(stderr, "ERROR: Nothing could be sampled on %s\n",
+                    s->ifname);
+            return 1;
+        }
+        if (out_format == OUT_BINARY)
+            watch_binary(have_prev ? prev : NULL, cur, n);
+        else if (out_format == OUT_JSON)
+            watch_json(&sp, have_prev ? prev : NULL, cur);
+        else
+            watch_line(&sp, have_prev ? prev : NULL, cur);
+        have_prev = 1;
+
+        if (++n != count)
+            sleep_seconds(interval);
+    }
+
+    if (n && out_format == OUT_JSON)
+        watch_summary_json(&sp, &smp[(n - 1) & 1]);
+    else if (n && out_format == OUT_TEXT)
+        watch_summary(&sp, &smp[(n - 1) & 1]);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * coex - Decoded BT coex statistics
+ *
+ *   coex              current btc_stats values
+ *   coex <seconds>    counter deltas over a window
+ * ------------------------------------------------------------------------- */
+static int cmd_coex(struct iovar_session *s, int argc, char **argv)
+{
+    struct coex_snapshot a, b;
+    uint32_t secs = 0;
+    uint32_t d[COEX_COUNT];
+    unsigned i;
+    int ret;
+
+    if (argc > 0 && (parse_u32(argv[0], &secs) != 0 || secs == 0)) {
+        fprintf(stderr, "ERROR: Invalid window '%s'\n", argv[0]);
+        return 1;
+    }
+
+    ret = coex_read(s, &a);
+    if (ret == 0 && secs) {
+        sleep_seconds(secs);
+        ret = coex_read(s, &b);
+    }
+    if (ret == -EAGAIN) {
+        fprintf(stderr, "ERROR: btc_stats not collected yet on %s\n",
+                s->ifname);
+        return 1;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: btc_stats not available on %s: %s\n",
+                s->ifname, strerror(-ret));
+        return 1;
+    }
+
+    if (secs)
+        coex_delta(&a, &b, d);
+    else
+        memcpy(d, a.val, sizeof(d));
+
+    if (out_format == OUT_JSON) {
+        json_begin("coex");
+        json_u32("window", secs);
+        for (i = 0; i < COEX_COUNT; i++)
+            json_u32(coex_field_names[i], d[i]);
+        json_end();
+        return 0;
+    }
+
+    for (i = 0; i < COEX_COUNT; i++) {
+        if (i < COEX_FIRST_COUNTER)
+            printf("%-16s 0x%08x\n", coex_field_names[i], d[i]);
+        else
+            printf("%-16s %10u\n", coex_field_names[i], d[i]);
+    }
+    if (d[COEX_REQ] >= d[COEX_GRANT])
+        printf("%-16s %10u\n", "bt_denied", d[COEX_REQ] - d[COEX_GRANT]);
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * antenna / antenna-compare - Runtime antenna selection
+ *
+ *   antenna                         show txant and antdiv
+ *   antenna <0|1|auto>              set both (auto = diversity)
+ *   antenna-compare [seconds] [rounds]
+ *
+ * txant selects the TX antenna port and antdiv the RX port or diversity.
+ * Which physical antenna sits behind each port depends on the board;
+ * on CM4/CM5 the PCB/U.FL switch configured in config.txt is in front of
+ * the chip, so the ports choose among what that switch connects.
+ *
+ * antenna-compare applies each candidate in turn (0, 1, auto), lets the
+ * link settle, then samples RSSI every 500 ms and the firmware counters
+ * over the window. Candidates alternate across rounds so slow changes
+ * in the environment hit all of them equally. The best mean RSSI wins,
+ * with the TX retry ratio breaking ties within 2 dB, and is applied.
+ * ------------------------------------------------------------------------- */
+#define ANT_AUTO            3
+#define ANT_SETTLE_MS       1000
+#define ANT_SAMPLE_MS       500
+#define ANT_RSSI_TIE_DB     2.0
+
+static const struct {
+    const char *name;
+    uint32_t    value;
+} ant_candidates[] = {
+    { "0",    0 },
+    { "1",    1 },
+    { "auto", ANT_AUTO },
+};
+
+struct ant_result {
+    int      usable;
+    unsigned n_rssi;
+    double   rssi_sum;
+    double   retry_sum;     /* txretrans / txframe per window */
+    unsigned n_windows;
+};
+
+static int antenna_set(struct iovar_session *s, uint32_t value)
+{
+    int ret = iovar_write(s, iovar_lookup("txant"), value);
+
+    if (ret == 0)
+        ret = iovar_write(s, iovar_lookup("antdiv"), value);
+    return ret;
+}
+
+static void antenna_sample(struct iovar_session *s, uint32_t secs,
+                           struct ant_result *r)
+{
+    struct counter_snapshot c0, c1;
+    int have_counters;
+    unsigned i, n = secs * 1000 / ANT_SAMPLE_MS;
+
+    have_counters = counters_read(s, &c0) == 0;
+    for (i = 0; i < n && !stop_requested; i++) {
+        int32_t rssi;
+        uint32_t rate;
+
+        sleep_ms(ANT_SAMPLE_MS);
+        if (link_state(s, &rssi, &rate) == 0 && rssi < 0) {
+            r->rssi_sum += rssi;
+            r->n_rssi++;
+        }
+    }
+
+    if (have_counters && counters_read(s, &c1) == 0) {
+        uint32_t tx = c1.val[CNT_TXFRAME] - c0.val[CNT_TXFRAME];
+        uint32_t re = c1.val[CNT_TXRETRANS] - c0.val[CNT_TXRETRANS];
+
+        r->retry_sum += tx ? (double)re / tx : 0.0;
+        r->n_windows++;
+    }
+}
+
+static int cmd_antenna(struct iovar_session *s, int argc, char **argv)
+{
+    uint32_t txant, antdiv;
+    size_t i;
+    int ret;
+
+    if (argc > 0) {
+        for (i = 0; i < ARRAY_SIZE(ant_candidates); i++) {
+            if (strcmp(argv[0], ant_candidates[i].name) == 0)
+                break;
+        }
+        if (i == ARRAY_SIZE(ant_candidates)) {
+            fprintf(stderr, "ERROR: antenna <0|1|auto>\n");
+            return 1;
+        }
+
+        ret = antenna_set(s, ant_candidates[i].value);
+        if (out_format == OUT_JSON) {
+            json_begin("antenna");
+            json_str("antenna", ant_candidates[i].name);
+            json_error(ret);
+            json_end();
+        } else if (ret == 0) {
+            printf("antenna set to %s\n", ant_candidates[i].name);
+        }
+        return ret != 0;
+    }
+
+    if (iovar_read(s, iovar_lookup("txant"), &txant) != 0 ||
+        iovar_read(s, iovar_lookup("antdiv"), &antdiv) != 0)
+        return 1;
+    if (out_format == OUT_JSON) {
+        json_begin("antenna");
+        json_u32("txant", txant);
+        json_u32("antdiv", antdiv);
+        json_end();
+        return 0;
+    }
+    printf("txant  = %u%s\n", txant, txant == ANT_AUTO ? " (auto)" : "");
+    printf("antdiv = %u%s\n", antdiv, antdiv == ANT_AUTO ? " (auto)" : "");
+    return 0;
+}
+
+static int cmd_antenna_compare(struct iovar_session *s, int argc, char **argv)
+{
+    struct ant_result res[ARRAY_SIZE(ant_candidates)];
+    uint32_t secs = 5, rounds = 2, r;
+    uint32_t orig_txant, orig_antdiv;
+    int best = -1;
+    int ret;
+    size_t i;
+
+    if ((argc > 0 && (parse_u32(argv[0], &secs) != 0 || secs == 0)) ||
+        (argc > 1 && (parse_u32(argv[1], &rounds) != 0 || rounds == 0))) {
+        fprintf(stderr, "ERROR: antenna-compare [seconds] [rounds]\n");
+        return 1;
+    }
+
+    if (iovar_read(s, iovar_lookup("txant"), &orig_txant) != 0 ||
+        iovar_read(s, iovar_lookup("antdiv"), &orig_antdiv) != 0)
+        return 1;
+
+    install_stop_handlers();
+    memset(res, 0, sizeof(res));
+    for (i = 0; i < ARRAY_SIZE(ant_candidates); i++)
+        res[i].usable = 1;
+
+    for (r = 0; r < rounds && !stop_requested; r++) {
+        for (i = 0; i < ARRAY_SIZE(ant_candidates) && !stop_requested; i++) {
+            /* Reverse the order on odd rounds */
+            size_t c = r & 1 ? ARRAY_SIZE(ant_candidates) - 1 - i : i;
+
+            if (!res[c].usable)
+                continue;
+            if (antenna_set(s, ant_candidates[c].value) != 0) {
+                res[c].usable = 0;
+                continue;
+            }
+            sleep_ms(ANT_SETTLE_MS);
+            antenna_sample(s, secs, &res[c]);
+        }
+    }
+
+    if (out_format != OUT_JSON)
+        printf("%-6s %10s %9s\n", "ant", "rssi dBm", "retry%");
+    for (i = 0; i < ARRAY_SIZE(ant_candidates); i++) {
+        double rssi, retry;
+
+        if (!res[i].usable || res[i].n_rssi == 0) {
+            if (out_format == OUT_JSON) {
+                json_begin("antenna-compare");
+                json_str("antenna", ant_candidates[i].name);
+                json_null("rssi");
+                json_null("retry_pct");
+                json_end();
+            } else {
+                printf("%-6s %10s %9s\n", ant_candidates[i].name, "-", "-");
+            }
+            continue;
+        }
+        rssi = res[i].rssi_sum / res[i].n_rssi;
+        retry = res[i].n_windows ? 100.0 * res[i].retry_sum /
+                                   res[i].n_windows : 0.0;
+        if (out_format == OUT_JSON) {
+            json_begin("antenna-compare");
+            json_str("antenna", ant_candidates[i].name);
+            json_double("rssi", rssi);
+            json_double("retry_pct", retry);
+            json_end();
+        } else {
+            printf("%-6s %10.1f %9.1f\n", ant_candidates[i].name, rssi,
+                   retry);
+        }
+
+        if (best < 0) {
+            best = (int)i;
+        } else {
+            double brssi = res[best].rssi_sum / res[best].n_rssi;
+            double bretry = res[best].n_windows ? 100.0 *
+                            res[best].retry_sum / res[best].n_windows : 0.0;
+
+            if (rssi > brssi + ANT_RSSI_TIE_DB ||
+                (rssi > brssi - ANT_RSSI_TIE_DB && retry < bretry))
+                best = (int)i;
+        }
+    }
+
+    if (best < 0 || stop_requested) {
+        fprintf(stderr, "ERROR: %s, original antenna settings restored\n",
+                best < 0 ? "No RSSI samples (not associated?)" :
+                           "Interrupted");
+        iovar_write(s, iovar_lookup("txant"), orig_txant);
+        iovar_write(s, iovar_lookup("antdiv"), orig_antdiv);
+        if (out_format == OUT_JSON) {
+            json_begin("antenna-compare");
+            json_null("selected");
+            json_bool("restored", 1);
+            json_error(best < 0 ? -ENODATA : -EINTR);
+            json_end();
+        }
+        return 1;
+    }
+
+    ret = antenna_set(s, ant_candidates[best].value);
+    if (out_format == OUT_JSON) {
+        json_begin("antenna-compare");
+        json_str("selected", ant_candidates[best].name);
+        json_error(ret);
+        json_end();
+    } else if (ret == 0) {
+        printf("selected antenna %s\n", ant_candidates[best].name);
+    }
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * band - Band preference and lock
+ *
+ *   band                          preference and current channel
+ *   band <auto|5g|2g> [wait]      set it and wait for the link to follow
+ *
+ * On dual-band boards moving WiFi to 5 GHz takes it off the 2.4 GHz
+ * spectrum BT uses, which removes the coex conflict altogether. The
+ * firmware band setting (WLC_SET_BAND) limits which band the station may
+ * associate on; the supplicant then reconnects on an allowed band.
+ *
+ * Locking a band with no network on it would drop WiFi, so after a change
+ * the link is watched for up to 'wait' seconds (default 10). If it does
+ * not come up on the requested band the previous setting is restored.
+ * The band of the link is taken from the chanspec channel number
+ * (1-14 is 2.4 GHz), which reads the same in both chanspec encodings.
+ * ------------------------------------------------------------------------- */
+#define WLC_BAND_AUTO       0
+#define WLC_BAND_5G         1
+#define WLC_BAND_2G         2
+#define BAND_WAIT_DEFAULT   10
+#define BAND_POLL_MS        500
+#define CHANSPEC_CHAN_MASK  0x00ff
+
+static const char *const band_names[] = {
+    [WLC_BAND_AUTO] = "auto",
+    [WLC_BAND_5G]   = "5g",
+    [WLC_BAND_2G]   = "2g",
+};
+
+/* Associated band (WLC_BAND_5G/2G) and channel, -ENOTCONN if not linked */
+static int band_link(struct iovar_session *s, uint32_t *band,
+                     uint32_t *channel)
+{
+    struct iovar_response resp;
+    uint8_t bssid[6] = { 0 };
+    uint32_t chanspec;
+    int ret;
+
+    /* WLC_GET_BSSID fails or returns zeros while not associated */
+    ret = send_vendor_cmd(s, BRCMF_C_GET_BSSID, 0, bssid, sizeof(bssid),
+                          (int32_t)sizeof(bssid), &resp);
+    if (ret == 0 && (!resp.data || resp.len < sizeof(bssid) ||
+                     memcmp(resp.data, bssid, sizeof(bssid)) == 0))
+        ret = -ENOTCONN;
+    free(resp.data);
+    if (ret != 0)
+        return -ENOTCONN;
+
+    ret = iovar_probe_int(s, "chanspec", &chanspec);
+    if (ret != 0)
+        return ret;
+
+    *channel = chanspec & CHANSPEC_CHAN_MASK;
+    *band = *channel <= 14 ? WLC_BAND_2G : WLC_BAND_5G;
+    return 0;
+}
+
+static void band_print_link(const char *label, int ret, uint32_t band,
+                            uint32_t channel)
+{
+    if (out_format == OUT_JSON)
+        return;     /* cmd_band reports the outcome as one object */
+    if (ret == 0)
+        printf("%s%s GHz, channel %u\n", label,
+               band == WLC_BAND_5G ? "5" : "2.4", channel);
+    else
+        printf("%snot associated\n", label);
+}
+
+/* -------------------------------------------------------------------------
+ * band_move - Set the band and wait for the link to land on it
+ *
+ * Returns 0 once associated on the requested band (immediately for auto),
+ * -ETIMEDOUT after restoring the previous setting if it did not.
+ * ------------------------------------------------------------------------- */
+static int band_move(struct iovar_session *s, uint32_t band, uint32_t wait)
+{
+    const struct iovar_def *def = iovar_lookup("band");
+    struct timespec t0, now;
+    uint32_t old, cur_band = 0, channel = 0;
+    int ret;
+
+    if (iovar_read(s, def, &old) != 0)
+        return -EIO;
+    ret = band_link(s, &cur_band, &channel);
+    band_print_link("before: ", ret, cur_band, channel);
+
+    if (iovar_write(s, def, band) != 0)
+        return -EIO;
+    if (band == WLC_BAND_AUTO)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        ret = band_link(s, &cur_band, &channel);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (ret == 0 && cur_band == band) {
+            if (out_format == OUT_TEXT)
+                printf("after %.1f s: ", timespec_diff(&t0, &now));
+            band_print_link("", ret, cur_band, channel);
+            return 0;
+        }
+        sleep_ms(BAND_POLL_MS);
+    } while (!stop_requested && timespec_diff(&t0, &now) < wait);
+
+    band_print_link("after: ", ret, cur_band, channel);
+    fprintf(stderr, "ERROR: No %s link within %u s, band restored to %s\n",
+            band == WLC_BAND_5G ? "5 GHz" : "2.4 GHz", wait,
+            old < ARRAY_SIZE(band_names) ? band_names[old] : "?");
+    iovar_write(s, def, old);
+    return -ETIMEDOUT;
+}
+
+static int cmd_band(struct iovar_session *s, int argc, char **argv)
+{
+    uint32_t band, link_band = 0, channel = 0, wait = BAND_WAIT_DEFAULT;
+    int ret;
+
+    if (argc == 0) {
+        if (iovar_read(s, iovar_lookup("band"), &band) != 0)
+            return 1;
+        ret = band_link(s, &link_band, &channel);
+        if (out_format == OUT_JSON) {
+            json_begin("band");
+            json_str("band", band < ARRAY_SIZE(band_names) ?
+                             band_names[band] : NULL);
+            json_str("link_band", ret == 0 ? band_names[link_band] : NULL);
+            if (ret == 0)
+                json_u32("channel", channel);
+            json_end();
+            return 0;
+        }
+        printf("band = %s\n",
+               band < ARRAY_SIZE(band_names) ? band_names[band] : "?");
+        band_print_link("link: ", ret, link_band, channel);
+        return 0;
+    }
+
+    for (band = 0; band < ARRAY_SIZE(band_names); band++) {
+        if (strcmp(argv[0], band_names[band]) == 0)
+            break;
+    }
+    if (band == ARRAY_SIZE(band_names) ||
+        (argc > 1 && parse_u32(argv[1], &wait) != 0)) {
+        fprintf(stderr, "ERROR: band <auto|5g|2g> [wait-seconds]\n");
+        return 1;
+    }
+
+    install_stop_handlers();
+    ret = band_move(s, band, wait);
+    if (out_format == OUT_JSON) {
+        int lret = band_link(s, &link_band, &channel);
+
+        json_begin("band");
+        json_str("band", band_names[band]);
+        json_str("link_band", lret == 0 ? band_names[link_band] : NULL);
+        if (lret == 0)
+            json_u32("channel", channel);
+        json_error(ret);
+        json_end();
+    }
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * stream-guard - Suppress roaming and scanning while a stream is active
+ *
+ * Every roam attempt or background scan takes the radio off-channel for
+ * tens to hundreds of milliseconds, long enough to underrun an A2DP or
+ * network audio buffer. The guard turns both off for the duration of a
+ * lease and always puts the previous values back:
+ *
+ *   - normal end (lease expiry, SIGINT/SIGTERM/SIGHUP): restored in-process
+ *   - SIGUSR1 renews the lease for another full duration
+ *   - if the guard dies without restoring (SIGKILL, crash) or overstays
+ *     its lease, its watchdog process restores from the lease file in
+ *     LEASE_DIR (see lease_watchdog). Should that fail too, the next
+ *     stream-guard on that interface, or `stream-guard release`,
+ *     restores first. A lease whose PID now belongs to another process
+ *     (start time differs) or whose expiry has passed is stale.
+ *
+ * With "5g" the guard first tries to move the link to 5 GHz (band_move),
+ * while scanning is still allowed, and keeps the band locked for the
+ * lease. If no 5 GHz link comes up it guards on the current band.
+ *
+ * Scan and roam probes are the only management frames a station sends at
+ * a steady rate, so the firmware txctl counter is used as the measure of
+ * off-channel activity. With a baseline window the guard reports how many
+ * such frames (and so excursions) were avoided compared to the
+ * unguarded rate.
+ * ------------------------------------------------------------------------- */
+/* The plain guard uses all but the last entry, "5g" adds the band lock.
+ * Both share the prefix so one orig[] array serves either. */
+static const struct profile_entry stream_guard_entries[] = {
+    { "roam_off",     1 },
+    { "scansuppress", 1 },
+    { "band",         WLC_BAND_5G },   /* must stay last */
+};
+
+static const struct profile stream_guard_profile =
+    { "stream-guard", "no roaming or scanning", stream_guard_entries,
+      ARRAY_SIZE(stream_guard_entries) - 1 };
+
+static const struct profile stream_guard_5g_profile =
+    PROFILE("stream-guard-5g", "5 GHz only, no roaming or scanning",
+            stream_guard_entries);
+
+static volatile sig_atomic_t guard_renew;
+
+static void guard_signal(int sig)
+{
+    if (sig == SIGUSR1)
+        guard_renew = 1;
+    else
+        stop_requested = 1;
+}
+
+static void lease_path(const struct iovar_session *s, char *buf, size_t len)
+{
+    snprintf(buf, len, LEASE_DIR "/%s.lease", s->ifname);
+}
+
+/*
+ * Start time of a process in clock ticks since boot (/proc/<pid>/stat
+ * field 22), or 0 if it does not exist or has exited. Together with the PID it
+ * identifies the guard that wrote a lease, even after PID reuse.
+ */
+static unsigned long long proc_start_time(long pid)
+{
+    unsigned long long start = 0;
+    char path[64], buf[512];
+    char state;
+    const char *p;
+    size_t n;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* comm may contain spaces and ')': fields resume after the last ')'.
+     * A zombie has exited and only waits to be reaped: not running. */
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                     "%*u %*u %*d %*d %*d %*d %*d %*d %llu", &state,
+                     &start) != 2 || state == 'Z')
+        return 0;
+    return start;
+}
+
+static int lease_write(const char *path, time_t expires,
+                       const struct profile *p, const uint32_t *orig)
+{
+    char tmp[128];
+    FILE *f;
+    size_t i;
+
+    if (mkdir(LEASE_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", LEASE_DIR,
+                strerror(errno));
+        return -errno;
+    }
+
+    /* Write-then-rename so a crash never leaves a half-written lease */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "ERROR: Cannot write %s: %s\n", tmp, strerror(errno));
+        return -errno;
+    }
+
+    fprintf(f, "pid %ld\nstart %llu\nexpires %lld\n", (long)getpid(),
+            proc_start_time((long)getpid()), (long long)expires);
+    for (i = 0; i < p->n_entries; i++)
+        fprintf(f, "%s %u\n", p->entries[i].name, orig[i]);
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "ERROR: Cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * lease_restore - Put back the values recorded in a lease file
+ *
+ * The lease is owned by a live guard only if its PID still runs with the
+ * recorded start time (so a reused PID is not signalled) and the lease
+ * has not expired. Such an owner is asked to end (SIGTERM) and restores
+ * by itself; -EBUSY is returned when 'signal_owner' is 0. Any other
+ * lease is stale and restored here.
+ * Returns 0 if no lease exists or it was restored.
+ * ------------------------------------------------------------------------- */
+static int lease_restore(struct iovar_session *s, const char *path,
+                         int signal_owner)
+{
+    char name[64];
+    unsigned long long v, start = 0;
+    long long expires = 0;
+    long pid = 0;
+    int first_err = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return errno == ENOENT ? 0 : -errno;
+
+    if (fscanf(f, "pid %ld\nstart %llu\nexpires %lld\n",
+               &pid, &start, &expires) == 3 &&
+        pid > 0 && pid != getpid() && start != 0 &&
+        proc_start_time(pid) == start &&
+        (expires == 0 || expires > (long long)time(NULL))) {
+        fclose(f);
+        if (!signal_owner)
+            return -EBUSY;
+        return kill((pid_t)pid, SIGTERM) == 0 ? 0 : -errno;
+    }
+
+    while (fscanf(f, "%63s %llu\n", name, &v) == 2) {
+        const struct iovar_def *def = iovar_lookup(name);
+        int ret;
+
+        if (!def || strcmp(name, "start") == 0 ||
+            strcmp(name, "expires") == 0)
+            continue;
+        ret = iovar_write(s, def, (uint32_t)v);
+        if (ret == 0 && out_format == OUT_JSON) {
+            json_begin("stream-guard");
+            json_str("state", "restored");
+            json_str("iovar", def->name);
+            json_u32("value", (uint32_t)v);
+            json_num("pid", "%ld", pid);
+            json_end();
+        } else if (ret == 0) {
+            printf("restored %s = %llu (stale lease of pid %ld)\n",
+                   name, v, pid);
+        } else if (first_err == 0)
+            first_err = ret;
+    }
+
+    fclose(f);
+    if (first_err == 0)
+        unlink(path);
+    return first_err;
+}
+
+/* -------------------------------------------------------------------------
+ * Lease watchdog
+ *
+ * A guard that is SIGKILLed (OOM killer, service stop timeout) cannot
+ * restore, and its lease would only be noticed by the next stream-guard.
+ * So the guard forks a watchdog into its own session (a Ctrl-C or hangup
+ * of the guard's terminal does not reach it) holding the read end of a
+ * pipe whose write end only the guard has:
+ *
+ *   - EOF on the pipe: the guard has ended, however it ended. A lease
+ *     still on disk is restored.
+ *   - the lease expired more than LEASE_GRACE_S ago and the guard still
+ *     runs (stopped, or stuck in the driver): restored as stale.
+ *
+ * The expiry is re-read from the lease on every wakeup, so renewals
+ * (SIGUSR1) move it. The restore runs over a session of its own.
+ * ------------------------------------------------------------------------- */
+#define LEASE_GRACE_S   2
+
+/* Expiry recorded in a lease (0: until signalled); -ENOENT once removed */
+static int lease_expiry(const char *path, long long *expires)
+{
+    unsigned long long start;
+    long pid;
+    FILE *f;
+    int n;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -errno;
+    n = fscanf(f, "pid %ld\nstart %llu\nexpires %lld\n", &pid, &start,
+               expires);
+    fclose(f);
+    return n == 3 ? 0 : -EINVAL;
+}
+
+static void lease_watchdog(const struct iovar_session *s, const char *path,
+                           int fd)
+{
+    struct iovar_session w;
+    long long expires;
+    int ret;
+
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        long long left;
+        int timeout = -1;
+        char c;
+
+        ret = lease_expiry(path, &expires);
+        if (ret == -ENOENT)
+            return;
+        if (ret == 0 && expires) {
+            left = expires + LEASE_GRACE_S - (long long)time(NULL);
+            if (left <= 0)
+                break;
+            timeout = left > INT_MAX / 1000 ? INT_MAX : (int)left * 1000;
+        }
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+            return;
+        if (pfd.revents && read(fd, &c, 1) <= 0)
+            break;      /* the guard has exited */
+    }
+
+    if (lease_expiry(path, &expires) == -ENOENT)
+        return;
+    if (s->emulated)
+        session_open_emulated(&w, s->ifname);
+    else if (session_open(&w, s->ifindex) != 0)
+        return;
+    ret = lease_restore(&w, path, 0);
+    if (ret != 0)
+        fprintf(stderr, "ERROR: stream-guard watchdog: cannot restore %s: "
+                "%s\n", path, strerror(-ret));
+    session_close(&w);
+}
+
+/* Returns the watchdog's PID and the pipe's write end in *fd, or -1 */
+static pid_t guard_watchdog_start(const struct iovar_session *s,
+                                  const char *path, int *fd)
+{
+    int p[2];
+    pid_t pid;
+
+    if (pipe2(p, O_CLOEXEC) != 0)
+        return -1;
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(p[1]);
+        setsid();
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        lease_watchdog(s, path, p[0]);
+        fflush(stdout);
+        _exit(0);
+    }
+    close(p[0]);
+    *fd = p[1];
+    return pid;
+}
+
+/* Ends the watchdog: it sees EOF and finds the lease gone (or retries a
+ * restore that failed here) */
+static void guard_watchdog_stop(pid_t pid, int fd)
+{
+    if (pid <= 0)
+        return;
+    close(fd);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
+
+/* Restore originals of entries [0, n) and drop the lease */
+static int guard_restore(struct iovar_session *s, const struct profile *p,
+                         const uint32_t *orig, size_t n, const char *path)
+{
+    int first_err = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const struct iovar_def *def = iovar_lookup(p->entries[i].name);
+        int ret = def ? iovar_write(s, def, orig[i]) : -EINVAL;
+
+        if (ret != 0 && first_err == 0)
+            first_err = ret;
+    }
+
+    /* Keep the lease on failure so a later release can retry */
+    if (first_err == 0)
+        unlink(path);
+    return first_err;
+}
+
+static int cmd_stream_guard(struct iovar_session *s, int argc, char **argv)
+{
+    const struct profile *p = &stream_guard_profile;
+    struct counter_snapshot b0, b1, c0, c1;
+    uint32_t orig[ARRAY_SIZE(stream_guard_entries)];
+    uint32_t secs, baseline = 0;
+    int want_5g = 0, bad;
+    struct sigaction sa;
+    char path[128];
+    struct timespec now;
+    time_t deadline = 0;
+    pid_t watchdog;
+    int watchdog_fd = -1;
+    int have_counters;
+    int ret;
+    size_t i;
+
+    lease_path(s, path, sizeof(path));
+
+    if (strcmp(argv[0], "release") == 0) {
+        ret = lease_restore(s, path, 1);
+        if (ret != 0) {
+            fprintf(stderr, "ERROR: Lease release failed: %s\n",
+                    strerror(-ret));
+            return 1;
+        }
+        if (out_format == OUT_JSON) {
+            json_begin("stream-guard");
+            json_str("state", "release");
+            json_error(0);
+            json_end();
+        }
+        return 0;
+    }
+
+    bad = parse_u32(argv[0], &secs) != 0;
+    for (i = 1; i < (size_t)argc && !bad; i++) {
+        if (strcmp(argv[i], "5g") == 0)
+            want_5g = 1;
+        else
+            bad = parse_u32(argv[i], &baseline) != 0;
+    }
+    if (bad) {
+        fprintf(stderr, "ERROR: stream-guard <seconds|release> "
+                "[baseline-seconds] [5g]\n");
+        return 1;
+    }
+
+    ret = lease_restore(s, path, 0);
+    if (ret == -EBUSY) {
+        fprintf(stderr, "ERROR: A stream guard is already active on %s "
+                "(send SIGUSR1 to renew it)\n", s->ifname);
+        return 1;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: Cannot restore stale lease %s\n", path);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = guard_signal;   /* no SA_RESTART: wake the sleep */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (baseline > 0 && counters_read(s, &b0) == 0) {
+        sleep_seconds(baseline);
+        if (counters_read(s, &b1) != 0)
+            baseline = 0;
+    } else {
+        baseline = 0;
+    }
+
+    if (want_5g)
+        p = &stream_guard_5g_profile;
+
+    for (i = 0; i < p->n_entries; i++) {
+        const struct iovar_def *def = iovar_lookup(p->entries[i].name);
+        if (iovar_read(s, def, &orig[i]) != 0)
+            return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (lease_write(path, secs ? time(NULL) + secs : 0, p, orig) != 0)
+        return 1;
+    watchdog = guard_watchdog_start(s, path, &watchdog_fd);
+    if (watchdog < 0)
+        fprintf(stderr, "WARNING: No lease watchdog (%s); a killed guard "
+                "is only restored by the next stream-guard\n",
+                strerror(errno));
+
+    /* band_move restores the band itself when no 5 GHz link comes up */
+    if (want_5g && band_move(s, WLC_BAND_5G, BAND_WAIT_DEFAULT) != 0)
+        p = &stream_guard_profile;
+
+    for (i = 0; i < p->n_entries; i++) {
+        const struct iovar_def *def = iovar_lookup(p->entries[i].name);
+        if (iovar_write(s, def, p->entries[i].value) != 0) {
+            guard_restore(s, p, orig, i, path);
+            guard_watchdog_stop(watchdog, watchdog_fd);
+            return 1;
+        }
+    }
+
+    have_counters = counters_read(s, &c0) == 0;
+    if (secs)
+        deadline = now.tv_sec + secs;
+    if (out_format == OUT_JSON) {
+        json_begin("stream-guard");
+        json_str("state", "active");
+        json_u32("lease_s", secs);
+        json_bool("band_5g", p == &stream_guard_5g_profile);
+        json_end();
+    } else {
+        printf("stream guard active on %s (%s)\n", s->ifname,
+               secs ? "lease running" : "until signalled");
+    }
+    fflush(stdout);
+
+    while (!stop_requested) {
+        struct timespec tick = { .tv_sec = 1, .tv_nsec = 0 };
+
+        if (guard_renew) {
+            guard_renew = 0;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (secs) {
+                deadline = now.tv_sec + secs;
+                lease_write(path, time(NULL) + secs, p, orig);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (deadline && now.tv_sec >= deadline)
+            break;
+        nanosleep(&tick, NULL);
+    }
+
+    if (have_counters)
+        have_counters = counters_read(s, &c1) == 0;
+
+    ret = guard_restore(s, p, orig, p->n_entries, path);
+    if (ret != 0)
+        fprintf(stderr, "ERROR: Restore failed, lease kept in %s for "
+                "'stream-guard release'\n", path);
+    guard_watchdog_stop(watchdog, watchdog_fd);
+
+    if (out_format == OUT_JSON) {
+        json_begin("stream-guard");
+        json_str("state", "released");
+        if (have_counters) {
+            double held = timespec_diff(&c0.ts, &c1.ts);
+            uint32_t mgmt = c1.val[CNT_TXCTL] - c0.val[CNT_TXCTL];
+
+            json_double("held_s", held);
+            json_u32("mgmt_frames", mgmt);
+            if (baseline > 0) {
+                double rate[CNT_COUNT];
+
+                counters_rate(&b0, &b1, rate);
+                json_double("expected_unguarded", rate[CNT_TXCTL] * held);
+            }
+        }
+        json_error(ret);
+        json_end();
+    } else if (have_counters) {
+        double held = timespec_diff(&c0.ts, &c1.ts);
+        uint32_t mgmt = c1.val[CNT_TXCTL] - c0.val[CNT_TXCTL];
+
+        printf("stream guard released after %.0f s: %u mgmt frames sent",
+               held, mgmt);
+        if (baseline > 0) {
+            double rate[CNT_COUNT];
+            double expected;
+
+            counters_rate(&b0, &b1, rate);
+            expected = rate[CNT_TXCTL] * held;
+            printf(", %.0f expected unguarded, ~%.0f off-channel frames "
+                   "avoided", expected,
+                   expected > mgmt ? expected - mgmt : 0.0);
+        }
+        printf("\n");
+    } else {
+        printf("stream guard released\n");
+    }
+
+    return ret != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Usage and main
+ * ------------------------------------------------------------------------- */
+struct command {
+    const char *name;
+    int         min_args;   /* arguments required after the command */
+    int       (*fn)(struct iovar_session *s, int argc, char **argv);
+    int         offline;    /* runs without a session (s is NULL) */
+    int         binary;     /* has --binary output */
+    int         json;       /* has --json output */
+    int         serve;      /* serve runs it: 0 no (it runs for a time
+                             * window), 1 yes, 2 with one argument at most
+                             * (the next one is a time) */
+};
+
+/* Set while serve runs commands for its clients */
+static int serving;
+
+static int cmd_batch(struct iovar_session *s, int argc, char **argv);
+static int cmd_shell(struct iovar_session *s, int argc, char **argv);
+static int cmd_hotplug(struct iovar_session *s, int argc, char **argv);
+static int cmd_serve(struct iovar_session *s, int argc, char **argv);
+
+static const struct command commands[] = {
+    { "get_int",        1, cmd_get_int, 0, 1, 1, 1 },
+    { "set_int",        1, cmd_set_int, 0, 1, 1, 1 },
+    { "get",            1, cmd_get, 0, 1, 1, 1 },
+    { "set",            1, cmd_set, 0, 1, 1, 1 },
+    { "list",           0, cmd_list, 1, 0, 1, 1 },
+    { "profile",        0, cmd_profile, 0, 0, 1, 1 },
+    { "profile-verify", 1, cmd_profile_verify, 0, 0, 1, 0 },
+    { "stream-guard",   1, cmd_stream_guard, 0, 0, 1, 0 },
+    { "wme",            0, cmd_wme, 0, 0, 1, 1 },
+    { "probe",          1, cmd_probe, 0, 0, 1, 0 },
+    { "arp-offload",    1, cmd_arp_offload, 0, 0, 1, 1 },
+    { "nd-offload",     1, cmd_nd_offload, 0, 0, 1, 1 },
+    { "pkt-filter",     1, cmd_pkt_filter, 0, 0, 1, 1 },
+    { "quiet-host",     1, cmd_quiet_host, 0, 0, 1, 2 },
+    { "wake-stats",     0, cmd_wake_stats, 0, 0, 1, 0 },
+    { "bus",            0, cmd_bus, 0, 0, 1, 1 },
+    { "bus-bench",      2, cmd_bus_bench, 0, 0, 1, 0 },
+    { "ack-bench",      0, cmd_ack_bench, 0, 0, 1, 1 },
+    { "watch",          0, cmd_watch, 0, 1, 1, 0 },
+    { "coex",           0, cmd_coex, 0, 0, 1, 0 },
+    { "antenna",        0, cmd_antenna, 0, 0, 1, 1 },
+    { "antenna-compare", 0, cmd_antenna_compare, 0, 0, 1, 0 },
+    { "band",           0, cmd_band, 0, 0, 1, 2 },
+    { "batch",          1, cmd_batch, 0, 1, 1, 1 },
+    { "shell",          0, cmd_shell, 0, 0, 1, 1 },
+    { "hotplug",        1, cmd_hotplug, 1, 0, 1, 1 },
+    { "serve",          0, cmd_serve, 0, 0, 1, 1 },
+    { "decode",         1, cmd_decode, 1, 0, 1, 1 },
+};
+
+static const struct command *command_lookup(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(commands); i++) {
+        if (strcmp(name, commands[i].name) == 0)
+            return &commands[i];
+    }
+    return NULL;
+}
+
+static int command_check_args(const struct command *cmd, int argc)
+{
+    if (argc < cmd->min_args) {
+        fprintf(stderr, "ERROR: %s requires %d argument%s\n", cmd->name,
+                cmd->min_args, cmd->min_args == 1 ? "" : "s");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * batch - Run commands from a file (or stdin) over one session
+ *
+ * One command per line, arguments separated by whitespace, '#' starts a
+ * comment line. Every line runs even if an earlier one failed; the exit
+ * status is 1 if any did. With --json the results of all lines form one
+ * NDJSON stream, followed by a "batch" summary object.
+ * ------------------------------------------------------------------------- */
+#define BATCH_LINE_MAX      1024
+#define BATCH_MAX_ARGS      32
+
+/* fgets() for command files: 1 for a line, 0 at end of file, -EMSGSIZE
+ * for a line of BATCH_LINE_MAX bytes or more, whose rest is skipped */
+static int line_read(char *buf, size_t len, FILE *f)
+{
+    size_t n;
+    int c;
+
+    if (!fgets(buf, (int)len, f))
+        return 0;
+    n = strlen(buf);
+    if (n < len - 1 || buf[n - 1] == '\n')
+        return 1;
+    c = getc(f);
+    if (c == EOF || c == '\n')
+        return 1;
+    while ((c = getc(f)) != EOF && c != '\n')
+        ;
+    return -EMSGSIZE;
+}
+
+/* Split a line in place into whitespace-separated words; returns the
+ * word count, 0 for blank and comment lines, -E2BIG for more than
+ * BATCH_MAX_ARGS words */
+static int command_split(char *line, char **args)
+{
+    char *tok, *save = NULL;
+    int n = 0;
+
+    for (tok = strtok_r(line, " \t\r\n", &save); tok;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (n == BATCH_MAX_ARGS)
+            return args[0][0] == '#' ? 0 : -E2BIG;
+        args[n++] = tok;
+    }
+    return n > 0 && args[0][0] == '#' ? 0 : n;
+}
+
+/* Why line_read() or command_split() rejected a line */
+static void command_line_reason(int err, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s (at most %d bytes and %d words per line)",
+             err == -EMSGSIZE ? "Line too long" : "Too many words",
+             BATCH_LINE_MAX - 1, BATCH_MAX_ARGS);
+}
+
+/* Report a rejected line; under --json it is a result too, one without a
+ * command */
+static void command_line_error(const char *where, int err)
+{
+    char reason[96];
+
+    command_line_reason(err, reason, sizeof(reason));
+    fprintf(stderr, "ERROR: %s%s\n", where, reason);
+    if (out_format == OUT_JSON)
+        json_failure(NULL, err);
+}
+
+/* Run a command. Under --json a failure that wrote no object of its own
+ * still gets one, so every result is an object. */
+static int command_call(const struct command *cmd, struct iovar_session *s,
+                        int argc, char **argv)
+{
+    unsigned long objects = json_line.objects;
+    int ret = cmd->fn(s, argc, argv);
+
+    if (ret != 0 && out_format == OUT_JSON && json_line.objects == objects)
+        json_failure(cmd->name, -EIO);
+    return ret;
+}
+
+/* Report held writes whose errors have come in, against the line that
+ * sent them (see vendor_hold()); returns how many */
+static unsigned deferred_report(struct iovar_session *s)
+{
+    unsigned reported = 0;
+    size_t i, keep = 0;
+
+    for (i = 0; i < s->n_deferred; i++) {
+        struct vendor_deferred *d = &s->deferred[i];
+        size_t len = strlen(d->where);
+
+        if (d->err == 0) {
+            s->deferred[keep++] = *d;
+            continue;
+        }
+        reported++;
+        log_error(d->label, d->err, "ERROR: %s%s %s failed: %d (%s%s%s)\n",
+                  d->where, d->command, d->label, d->err, strerror(-d->err),
+                  d->msg[0] ? ": " : "", d->msg);
+        if (out_format != OUT_JSON)
+            continue;
+
+        /* "file:12: " is "file:12" here */
+        while (len > 0 && strchr(": ", d->where[len - 1]))
+            d->where[--len] = '\0';
+        json_begin(d->command);
+        json_str("iovar", d->label);
+        json_str("where", len ? d->where : NULL);
+        json_error(d->err);
+        if (d->msg[0])
+            json_str("error_msg", d->msg);
+        json_bool("deferred", 1);
+        json_end();
+    }
+    s->n_deferred = keep;
+    return reported;
+}
+
+/* Run one split command line over the open session. 'where' prefixes
+ * error messages ("file:12: " in a batch). Returns 0, or 1 on failure. */
+static int command_run(struct iovar_session *s, const char *where,
+                       char **args, int n)
+{
+    const struct command *cmd = command_lookup(args[0]);
+
+    if (!cmd || cmd->fn == cmd_batch || cmd->fn == cmd_shell ||
+        cmd->fn == cmd_hotplug || cmd->fn == cmd_serve) {
+        fprintf(stderr, "ERROR: %sUnknown command '%s'\n", where, args[0]);
+        if (out_format == OUT_JSON)
+            json_failure(args[0], -EINVAL);
+        return 1;
+    }
+    if (out_format == OUT_BINARY && !cmd->binary) {
+        fprintf(stderr, "ERROR: %s%s has no --binary output\n", where,
+                args[0]);
+        return 1;
+    }
+    if (out_format == OUT_JSON && !cmd->json) {
+        fprintf(stderr, "ERROR: %s%s has no --json output\n", where,
+                args[0]);
+        json_failure(args[0], -EOPNOTSUPP);
+        return 1;
+    }
+    /* One client's command holds every other one */
+    if (serving && (cmd->serve == 0 || (cmd->serve == 2 && n > 2))) {
+        fprintf(stderr, "ERROR: %s%s%s runs for a while; serve does not "
+                "take it\n", where, args[0], cmd->serve ? " with a time" :
+                "");
+        if (out_format == OUT_JSON)
+            json_failure(args[0], -EOPNOTSUPP);
+        return 1;
+    }
+    if (command_check_args(cmd, n - 1) != 0) {
+        if (out_format == OUT_JSON)
+            json_failure(args[0], -EINVAL);
+        return 1;
+    }
+
+    snprintf(s->where, sizeof(s->where), "%s", where);
+    snprintf(s->command, sizeof(s->command), "%s", cmd->name);
+    return command_call(cmd, s, n - 1, args + 1) != 0;
+}
+
+static int cmd_batch(struct iovar_session *s, int argc, char **argv)
+{
+    char line[BATCH_LINE_MAX];
+    unsigned lineno = 0, lines = 0, failed = 0;
+    FILE *f;
+    int ret;
+    (void)argc;
+
+    f = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Cannot open %s: %s\n", argv[0],
+                strerror(errno));
+        return 1;
+    }
+
+    /* --no-ack: one barrier for the whole input */
+    vendor_hold(s, sets_unacked);
+
+    while ((ret = line_read(line, sizeof(line), f)) != 0) {
+        char *args[BATCH_MAX_ARGS];
+        char where[256];
+        int n;
+
+        lineno++;
+        n = ret < 0 ? ret : command_split(line, args);
+        if (n == 0)
+            continue;
+        lines++;
+
+        snprintf(where, sizeof(where), "%s:%u: ", argv[0], lineno);
+        if (n < 0) {
+            command_line_error(where, n);
+            failed++;
+            continue;
+        }
+        failed += command_run(s, where, args, n);
+        failed += deferred_report(s);
+    }
+
+    if (f != stdin)
+        fclose(f);
+    vendor_hold(s, 0);
+    vendor_release(s);
+    failed += deferred_report(s);
+
+    if (out_format == OUT_BINARY) {
+        fflush(stdout);
+    } else if (out_format == OUT_JSON) {
+        json_begin("batch");
+        json_u32("lines", lines);
+        json_u32("failed", failed);
+        json_end();
+    } else if (failed) {
+        fprintf(stderr, "ERROR: %u of %u batch lines failed\n", failed,
+                lines);
+    }
+    return failed != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * shell - Interactive prompt over one persistent session
+ *
+ * The netlink socket and the resolved nl80211 family are set up once and
+ * reused by every command typed, so each line costs only its own round
+ * trips. The wall time of every command is shown after it in text mode;
+ * --json output already carries latency_us.
+ *
+ * On a terminal the line is edited in raw mode: left/right, Home/End,
+ * Ctrl-A/E/K/U/W, up/down history and Tab completion of command names
+ * (first word) or iovar and profile names (other words). Commands run
+ * with the terminal restored, so Ctrl-C stops watch, coex etc. without
+ * leaving the shell. Ctrl-C at the prompt clears the line; Ctrl-D on an
+ * empty line, 'quit' or 'exit' ends the shell. Without a terminal lines
+ * are read as in batch, with no prompt. The prompt, editing escapes,
+ * completion lists and help go to stderr, so stdout carries only command
+ * output (one NDJSON stream under --json).
+ * ------------------------------------------------------------------------- */
+#define SHELL_HISTORY       32
+#define SHELL_CANDIDATES    128
+#define SHELL_WIDTH         80
+
+static const char *const shell_builtins[] = { "help", "quit", "exit" };
+
+struct line_editor {
+    int             tty;        /* stdin is a terminal */
+    struct termios  saved;
+    const char     *prompt;
+    char            buf[BATCH_LINE_MAX];
+    size_t          len;
+    size_t          pos;        /* cursor, 0..len */
+    char            hist[SHELL_HISTORY][BATCH_LINE_MAX];
+    unsigned        n_hist;     /* lines ever added; ring of SHELL_HISTORY */
+    unsigned        at;         /* history entry shown, n_hist = new line */
+    char            pending[BATCH_LINE_MAX];    /* new line while browsing */
+};
+
+static void le_refresh(const struct line_editor *le)
+{
+    size_t col = strlen(le->prompt) + le->pos;
+
+    fprintf(stderr, "\r%s%.*s\x1b[K\r", le->prompt, (int)le->len, le->buf);
+    if (col > 0)
+        fprintf(stderr, "\x1b[%zuC", col);
+    fflush(stderr);
+}
+
+static void le_insert(struct line_editor *le, const char *str, size_t n)
+{
+    if (n > sizeof(le->buf) - 1 - le->len)
+        n = sizeof(le->buf) - 1 - le->len;
+    memmove(le->buf + le->pos + n, le->buf + le->pos, le->len - le->pos);
+    memcpy(le->buf + le->pos, str, n);
+    le->len += n;
+    le->pos += n;
+}
+
+/* Remove n bytes before the cursor */
+static void le_erase(struct line_editor *le, size_t n)
+{
+    if (n > le->pos)
+        n = le->pos;
+    memmove(le->buf + le->pos - n, le->buf + le->pos, le->len - le->pos);
+    le->len -= n;
+    le->pos -= n;
+}
+
+static void le_history_add(struct line_editor *le, const char *line)
+{
+    const char *last = le->hist[(le->n_hist - 1) % SHELL_HISTORY];
+
+    if (line[0] == '\0' || (le->n_hist > 0 && strcmp(line, last) == 0))
+        return;
+    snprintf(le->hist[le->n_hist % SHELL_HISTORY], BATCH_LINE_MAX, "%s",
+             line);
+    le->n_hist++;
+}
+
+/* Step through history: dir -1 older, +1 newer */
+static void le_history_move(struct line_editor *le, int dir)
+{
+    unsigned oldest = le->n_hist > SHELL_HISTORY ?
+                      le->n_hist - SHELL_HISTORY : 0;
+    const char *src;
+
+    if ((dir < 0 && le->at == oldest) || (dir > 0 && le->at == le->n_hist))
+        return;
+
+    if (le->at == le->n_hist)
+        snprintf(le->pending, sizeof(le->pending), "%.*s", (int)le->len,
+                 le->buf);
+    le->at += dir;
+    src = le->at == le->n_hist ? le->pending :
+          le->hist[le->at % SHELL_HISTORY];
+    le->len = le->pos = strlen(src);
+    memcpy(le->buf, src, le->len);
+}
+
+static size_t shell_candidates(const char *word, size_t wlen, int first,
+                               const char **out)
+{
+    size_t i, n = 0;
+
+#define SHELL_OFFER(name) do { \
+        if (strncmp((name), word, wlen) == 0 && n < SHELL_CANDIDATES) \
+            out[n++] = (name); \
+    } while (0)
+
+    if (first) {
+        for (i = 0; i < ARRAY_SIZE(commands); i++) {
+            if (commands[i].fn != cmd_batch && commands[i].fn != cmd_shell)
+                SHELL_OFFER(commands[i].name);
+        }
+        for (i = 0; i < ARRAY_SIZE(shell_builtins); i++)
+            SHELL_OFFER(shell_builtins[i]);
+    } else {
+        const struct config *cf = atomic_load(&config_current);
+
+        for (i = 0; i < ARRAY_SIZE(iovar_registry); i++)
+            SHELL_OFFER(iovar_registry[i].name);
+        for (i = 0; i < ARRAY_SIZE(profiles); i++)
+            SHELL_OFFER(profiles[i].name);
+        for (i = 0; cf && i < cf->n_profiles; i++)
+            SHELL_OFFER(cf->profiles[i].name);
+    }
+
+#undef SHELL_OFFER
+    return n;
+}
+
+static void le_complete(struct line_editor *le)
+{
+    const char *cand[SHELL_CANDIDATES];
+    size_t start = le->pos, wlen, common, col, i, n;
+    int first = 1;
+
+    while (start > 0 && le->buf[start - 1] != ' ')
+        start--;
+    for (i = 0; i < start; i++) {
+        if (le->buf[i] != ' ')
+            first = 0;
+    }
+    wlen = le->pos - start;
+
+    n = shell_candidates(le->buf + start, wlen, first, cand);
+    if (n == 0) {
+        fputc('\a', stderr);
+        return;
+    }
+    if (n == 1) {
+        le_insert(le, cand[0] + wlen, strlen(cand[0] + wlen));
+        le_insert(le, " ", 1);
+        return;
+    }
+
+    /* Extend to the longest common prefix, list the choices otherwise */
+    common = strlen(cand[0]);
+    for (i = 1; i < n; i++) {
+        size_t k = 0;
+
+        while (k < common && cand[i][k] == cand[0][k])
+            k++;
+        common = k;
+    }
+    if (common > wlen) {
+        le_insert(le, cand[0] + wlen, common - wlen);
+        return;
+    }
+
+    fputc('\n', stderr);
+    for (i = 0, col = 0; i < n; i++) {
+        size_t w = strlen(cand[i]) + 2;
+
+        if (col > 0 && col + w > SHELL_WIDTH) {
+            fputc('\n', stderr);
+            col = 0;
+        }
+        fprintf(stderr, "%s  ", cand[i]);
+        col += w;
+    }
+    fputc('\n', stderr);
+}
+
+#define LE_KEY_DELETE   0x100
+
+/* Read one key; escape sequences for arrows, Home, End and Delete are
+ * folded into the Ctrl key with the same meaning. Returns -1 on EOF. */
+static int le_key(void)
+{
+    unsigned char c, seq[3];
+
+    if (read(STDIN_FILENO, &c, 1) != 1)
+        return -1;
+    if (c != 0x1b)
+        return c;
+
+    if (read(STDIN_FILENO, &seq[0], 1) != 1 ||
+        read(STDIN_FILENO, &seq[1], 1) != 1)
+        return 0;
+    if (seq[0] != '[' && seq[0] != 'O')
+        return 0;
+    switch (seq[1]) {
+    case 'A':   return 0x10;    /* Ctrl-P */
+    case 'B':   return 0x0e;    /* Ctrl-N */
+    case 'C':   return 0x06;    /* Ctrl-F */
+    case 'D':   return 0x02;    /* Ctrl-B */
+    case 'H':   return 0x01;    /* Ctrl-A */
+    case 'F':   return 0x05;    /* Ctrl-E */
+    }
+    if (seq[1] >= '0' && seq[1] <= '9' &&
+        read(STDIN_FILENO, &seq[2], 1) == 1 && seq[2] == '~') {
+        switch (seq[1]) {
+        case '1': case '7': return 0x01;
+        case '4': case '8': return 0x05;
+        case '3':           return LE_KEY_DELETE;
+        }
+    }
+    return 0;
+}
+
+/* Edit one line on the terminal; returns 0 with le->buf terminated, or
+ * -1 on Ctrl-D / end of input */
+static int le_edit(struct line_editor *le)
+{
+    struct termios raw = le->saved;
+    int ret = -1;
+
+    raw.c_iflag &= ~(tcflag_t)(ICRNL | IXON);
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0)
+        return -1;
+
+    le->len = le->pos = 0;
+    le->at = le->n_hist;
+    le_refresh(le);
+
+    for (;;) {
+        int key = le_key();
+
+        if (key < 0 || stop_requested)
+            break;
+
+        switch (key) {
+        case '\r':
+        case '\n':
+            ret = 0;
+            break;
+        case 0x03:                              /* Ctrl-C */
+            fprintf(stderr, "^C\n");
+            le->len = le->pos = 0;
+            le->at = le->n_hist;
+            break;
+        case 0x04:                              /* Ctrl-D */
+            if (le->len == 0) {
+                fputc('\n', stderr);
+                goto out;
+            }
+            /* fall through */
+        case LE_KEY_DELETE:
+            if (le->pos < le->len) {
+                le->pos++;
+                le_erase(le, 1);
+            }
+            break;
+        case 0x7f:                              /* Backspace */
+        case 0x08:
+            le_erase(le, 1);
+            break;
+        case 0x01:
+            le->pos = 0;
+            break;
+        case 0x05:
+            le->pos = le->len;
+            break;
+        case 0x02:
+            if (le->pos > 0)
+                le->pos--;
+            break;
+        case 0x06:
+            if (le->pos < le->len)
+                le->pos++;
+            break;
+        case 0x0b:                              /* Ctrl-K */
+            le->len = le->pos;
+            break;
+        case 0x15:                              /* Ctrl-U */
+            le_erase(le, le->pos);
+            break;
+        case 0x17: {                            /* Ctrl-W */
+            size_t p = le->pos;
+
+            while (p > 0 && le->buf[p - 1] == ' ')
+                p--;
+            while (p > 0 && le->buf[p - 1] != ' ')
+                p--;
+            le_erase(le, le->pos - p);
+            break;
+        }
+        case 0x10:
+            le_history_move(le, -1);
+            break;
+        case 0x0e:
+            le_history_move(le, 1);
+            break;
+        case '\t':
+            le_complete(le);
+            break;
+        default:
+            if (key >= 0x20 && key < 0x7f) {
+                char ch = (char)key;
+                le_insert(le, &ch, 1);
+            }
+            break;
+        }
+
+        if (ret == 0) {
+            fputc('\n', stderr);
+            break;
+        }
+        le_refresh(le);
+    }
+
+out:
+    le->buf[le->len] = '\0';
+    fflush(stderr);
+    tcsetattr(STDIN_FILENO, TCSANOW, &le->saved);
+    return ret;
+}
+
+/* Next line into le->buf: 0, -1 on end of input or a termination signal,
+ * -EMSGSIZE for an over-long piped line. A Ctrl-C that ended the previous
+ * command must not end the shell, so the stop flag is cleared here (and
+ * only here: serve and batch must see theirs). */
+static int le_read(struct line_editor *le)
+{
+    int ret;
+
+    stop_requested = 0;
+    if (le->tty) {
+        if (le_edit(le) != 0)
+            return -1;
+        le_history_add(le, le->buf);
+        return 0;
+    }
+    ret = line_read(le->buf, sizeof(le->buf), stdin);
+    if (ret == 0 || stop_requested)
+        return -1;
+    return ret < 0 ? ret : 0;
+}
+
+static void shell_help(void)
+{
+    size_t i, col = 0;
+
+    fprintf(stderr, "Commands (arguments as on the command line):\n ");
+    for (i = 0; i < ARRAY_SIZE(commands); i++) {
+        size_t w = strlen(commands[i].name) + 1;
+
+        if (commands[i].fn == cmd_batch || commands[i].fn == cmd_shell)
+            continue;
+        if (col + w > SHELL_WIDTH - 2) {
+            fprintf(stderr, "\n ");
+            col = 0;
+        }
+        fprintf(stderr, " %s", commands[i].name);
+        col += w;
+    }
+    fprintf(stderr, "\nShell: help, quit, exit. Tab completes, up/down "
+            "recall.\n");
+}
+
+static int cmd_shell(struct iovar_session *s, int argc, char **argv)
+{
+    static struct line_editor le;   /* history is ~32 KiB, keep off stack */
+    char prompt[IF_NAMESIZE + 3];
+    unsigned failed = 0;
+    int ret;
+    (void)argc;
+    (void)argv;
+
+    snprintf(prompt, sizeof(prompt), "%s> ", s->ifname);
+    le.prompt = prompt;
+    le.tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &le.saved) == 0;
+
+    /* Ctrl-C ends the running command, not the shell */
+    install_stop_handlers();
+
+    /* --no-ack: one barrier per group of lines, see below */
+    vendor_hold(s, sets_unacked);
+
+    while ((ret = le_read(&le)) != -1) {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        char *args[BATCH_MAX_ARGS];
+        struct timespec t0;
+        unsigned late;
+        int n;
+
+        n = ret < 0 ? ret : command_split(le.buf, args);
+        if (n == 0)
+            continue;
+        if (n < 0) {
+            command_line_error("", n);
+            failed++;
+            continue;
+        }
+        if (strcmp(args[0], "quit") == 0 || strcmp(args[0], "exit") == 0)
+            break;
+        if (strcmp(args[0], "help") == 0) {
+            shell_help();
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ret = command_run(s, "", args, n);
+        /* A typed line is a group of its own; lines pasted in one go, or
+         * piped in, share one barrier */
+        if (le.tty && poll(&pfd, 1, 0) != 1)
+            vendor_release(s);
+        late = deferred_report(s);
+        failed += (unsigned)ret + late;
+        if (out_format == OUT_TEXT)
+            printf("(%s, %.2f ms)\n", ret || late ? "failed" : "ok",
+                   elapsed_us(&t0) / 1000.0);
+        fflush(stdout);
+    }
+
+    vendor_hold(s, 0);
+    vendor_release(s);
+    failed += deferred_report(s);
+    return failed != 0;
+}
+
+/* -------------------------------------------------------------------------
+ * config_profiles_load - Read a --profiles file
+ *
+ * One profile per line, '#' starts a comment:
+ *
+ *   <name> <setting>=<value>...
+ *
+ * Settings are the typed ones (see list), range-checked here so that a
+ * bad file is rejected as a whole and never half-applied later. Names of
+ * built-in profiles cannot be reused. Errors go to 'err'.
+ * ------------------------------------------------------------------------- */
+static int config_profiles_load(struct config *cf, const char *path,
+                                char *err, size_t err_len)
+{
+    char line[BATCH_LINE_MAX];
+    unsigned lineno = 0;
+    FILE *f;
+    int ret;
+
+    f = fopen(path, "r");
+    if (!f) {
+        snprintf(err, err_len, "Cannot open %s: %s", path, strerror(errno));
+        return -ENOENT;
+    }
+
+    while ((ret = line_read(line, sizeof(line), f)) != 0) {
+        char *args[BATCH_MAX_ARGS];
+        struct config_profile *cp = &cf->profiles[cf->n_profiles];
+        int i, n;
+
+        lineno++;
+        n = ret < 0 ? ret : command_split(line, args);
+        if (n == 0)
+            continue;
+        if (n < 0) {
+            char reason[96];
+
+            command_line_reason(n, reason, sizeof(reason));
+            snprintf(err, err_len, "%s:%u: %s", path, lineno, reason);
+            goto fail;
+        }
+        if (cf->n_profiles == CONFIG_PROFILES_MAX ||
+            n - 1 > CONFIG_ENTRIES_MAX || n < 2) {
+            snprintf(err, err_len, "%s:%u: Expected <name> <setting>="
+                     "<value>... (at most %d profiles of %d settings)",
+                     path, lineno, CONFIG_PROFILES_MAX, CONFIG_ENTRIES_MAX);
+            goto fail;
+        }
+        if (profile_find(cf, args[0]) || strlen(args[0]) >= sizeof(cp->name)) {
+            snprintf(err, err_len, "%s:%u: Profile name '%s' is taken or "
+                     "too long", path, lineno, args[0]);
+            goto fail;
+        }
+
+        for (i = 1; i < n; i++) {
+            char *val = strchr(args[i], '=');
+            const struct iovar_def *def;
+            uint32_t v;
+
+            if (val)
+                *val++ = '\0';
+            def = iovar_lookup(args[i]);
+            if (!val || !def || parse_u32(val, &v) != 0 ||
+                v < def->min || v > def->max) {
+                snprintf(err, err_len, "%s:%u: Invalid setting '%s' (see "
+                         "list for names and ranges)", path, lineno,
+                         args[i]);
+                goto fail;
+            }
+            cp->entries[i - 1].name = def->name;
+            cp->entries[i - 1].value = v;
+        }
+
+        snprintf(cp->name, sizeof(cp->name), "%s", args[0]);
+        snprintf(cp->desc, sizeof(cp->desc), "from %.60s:%u", path, lineno);
+        cp->p.name = cp->name;
+        cp->p.desc = cp->desc;
+        cp->p.entries = cp->entries;
+        cp->p.n_entries = (size_t)(n - 1);
+        cf->n_profiles++;
+    }
+
+    fclose(f);
+    return 0;
+
+fail:
+    fclose(f);
+    return -EINVAL;
+}
+
+static int hotplug_rules_load(const char *path, const struct config *cf,
+                              struct hotplug_rule **rules, size_t *n_rules,
+                              char *err, size_t err_len);
+
+/* A complete new config with one reference, or NULL with 'err' set */
+static struct config *config_build(const char *profiles_path,
+                                   const char *rules_path,
+                                   char *err, size_t err_len)
+{
+    struct config *cf = calloc(1, sizeof(*cf));
+
+    if (!cf) {
+        snprintf(err, err_len, "%s", strerror(ENOMEM));
+        return NULL;
+    }
+    atomic_init(&cf->refs, 1);
+    if ((profiles_path &&
+         config_profiles_load(cf, profiles_path, err, err_len) != 0) ||
+        (rules_path && hotplug_rules_load(rules_path, cf, &cf->rules,
+                                          &cf->n_rules, err, err_len) != 0)) {
+        config_put(cf);
+        return NULL;
+    }
+    return cf;
+}
+
+/* -------------------------------------------------------------------------
+ * Reload - SIGHUP (or a serve client's 'reload') in long-running modes
+ *
+ * config_reload_init() makes SIGHUP request a reload instead of stopping
+ * and returns an eventfd for the main loop to poll. It becomes readable
+ * when a reload is requested and again when the loader thread has built
+ * the new config; config_reload_poll() then starts the loader or adopts
+ * its result. A config that fails to load is reported and the running
+ * one stays in effect. A request while a load is running is served by
+ * that load.
+ * ------------------------------------------------------------------------- */
+enum config_load_state {
+    CONFIG_IDLE,
+    CONFIG_LOADING,
+    CONFIG_LOADED,
+};
+
+struct config_loader {
+    pthread_t      thread;
+    int            started;             /* thread needs a join */
+    _Atomic int    state;               /* enum config_load_state */
+    const char    *rules_path;
+    struct config *result;
+    char           err[256];
+};
+
+static struct config_loader config_loader;
+static volatile sig_atomic_t reload_requested;
+static int config_wake = -1;
+
+static void config_wake_up(void)
+{
+    uint64_t one = 1;
+    ssize_t n = write(config_wake, &one, sizeof(one));
+
+    (void)n;
+}
+
+static void reload_signal(int sig)
+{
+    int saved = errno;
+
+    (void)sig;
+    reload_requested = 1;
+    config_wake_up();
+    errno = saved;
+}
+
+static int config_reload_init(const char *rules_path)
+{
+    struct sigaction sa;
+
+    config_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (config_wake < 0)
+        return -errno;
+    config_loader.rules_path = rules_path;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reload_signal;
+    sigaction(SIGHUP, &sa, NULL);
+    return config_wake;
+}
+
+static void *config_load_thread(void *arg)
+{
+    struct config_loader *ld = arg;
+
+    ld->result = config_build(config_profiles_path, ld->rules_path,
+                              ld->err, sizeof(ld->err));
+    atomic_store(&ld->state, CONFIG_LOADED);
+    config_wake_up();
+    return NULL;
+}
+
+static int config_reload_start(void)
+{
+    int idle = CONFIG_IDLE;
+    sigset_t all, old;
+    int ret;
+
+    if (!atomic_compare_exchange_strong(&config_loader.state, &idle,
+                                        CONFIG_LOADING))
+        return 0;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&config_loader.thread, NULL, config_load_thread,
+                         &config_loader);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    config_loader.started = ret == 0;
+    if (ret != 0) {
+        snprintf(config_loader.err, sizeof(config_loader.err),
+                 "Cannot start loader: %s", strerror(ret));
+        config_loader.result = NULL;
+        atomic_store(&config_loader.state, CONFIG_LOADED);
+        config_wake_up();
+    }
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * config_reload_poll - Handle a readable config_wake
+ *
+ * Returns 1 if a new config was adopted, -1 if a load failed (reason in
+ * config_loader.err, the old config stays), 0 if no load has finished.
+ * ------------------------------------------------------------------------- */
+static int config_reload_poll(void)
+{
+    struct config *cf, *old;
+    uint64_t v;
+
+    if (read(config_wake, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        return 0;
+    if (reload_requested) {
+        reload_requested = 0;
+        config_reload_start();
+    }
+    if (atomic_load(&config_loader.state) != CONFIG_LOADED)
+        return 0;
+
+    if (config_loader.started)
+        pthread_join(config_loader.thread, NULL);
+    cf = config_loader.result;
+    config_loader.result = NULL;
+    atomic_store(&config_loader.state, CONFIG_IDLE);
+    if (!cf) {
+        log_error(NULL, 0, "ERROR: Reload failed, keeping the running "
+                  "configuration: %s\n", config_loader.err);
+        return -1;
+    }
+
+    old = atomic_load(&config_current);
+    cf->gen = old ? old->gen + 1 : 1;
+    old = atomic_exchange(&config_current, cf);
+    config_put(old);
+    log_error(NULL, 0, "reload: configuration %u, %zu profiles%s\n",
+              cf->gen, cf->n_profiles, cf->rules ? " and rules" : "");
+    return 1;
+}
+
+/* -------------------------------------------------------------------------
+ * serve - Answer command lines from a Unix socket over one warm session
+ *
+ *   serve [idle-seconds] [socket-path]
+ *
+ * Clients send the same lines as batch, one command per line, and may keep
+ * the connection open for more. The output of each command (stdout and
+ * stderr) goes back on the connection, followed by a NUL byte and the
+ * command's exit status as a decimal line. Commands run one at a time,
+ * so those that run for a time window (watch, coex, wake-stats, ...) are
+ * refused, see command_run(); so are the time arguments of quiet-host
+ * and band.
+ *
+ * Under socket activation (LISTEN_PID/LISTEN_FDS, as set by systemd) the
+ * inherited listening socket is used and socket-path is ignored. With
+ * idle-seconds > 0 the daemon exits once no client has been connected for
+ * that long; the activating socket stays open and starts it again on the
+ * next connection. A connected subscriber counts, so the daemon stays up
+ * for as long as one listens. A client that stops reading its output is dropped
+ * after SERVE_SEND_TIMEOUT_S rather than stalling the daemon. Clients can
+ * also subscribe to changes, see below.
+ *
+ * With --profiles, SIGHUP or a client's 'reload' line reloads the file.
+ * The reply to 'reload' (new generation, or why the file was rejected)
+ * comes once the loader is done; that client's next lines wait for it,
+ * other clients are served meanwhile.
+ * ------------------------------------------------------------------------- */
+#define SERVE_DIR               LEASE_DIR
+#define SERVE_CLIENTS_MAX       16
+#define SERVE_SEND_TIMEOUT_S    2
+#define SD_LISTEN_FDS_START     3
+
+/* -------------------------------------------------------------------------
+ * Change notifications for serve clients
+ *
+ *   subscribe <topic>...
+ *   unsubscribe [<topic>...]
+ *
+ * A topic is a typed setting (see list), profile:<name> (1 while every
+ * entry of the profile is in effect, else 0) or reset (the firmware's
+ * reset count). Subscribed values are read again after every command a
+ * client runs and every SUB_SAMPLE_MS. When the firmware resets, the last
+ * profile applied through the daemon is applied again first. Each change
+ * takes the next generation number and is pushed to its subscribers as
+ *
+ *   @<generation> <topic> <value|error:<errno>> <source>
+ *
+ * where source is the command that caused it, "sample" or "reset". The
+ * current values are pushed right after subscribing. Pushes are whole
+ * lines and never appear inside a command's reply.
+ *
+ * Pushes are queued per client (SUB_QUEUE_MAX bytes) and written without
+ * blocking. While a queue is full, changed topics are only marked, and
+ * their latest values go out once there is room: a slow reader gets
+ * fewer updates (generations skip) instead of stalling the daemon. The
+ * client's next command waits until its queue has drained, so its reply
+ * never lands inside a push; other clients are served meanwhile. A
+ * client whose queue has not moved for SUB_STALL_S is dropped.
+ *
+ * Up to SUB_TOPICS_MAX topics can be subscribed at once, over all
+ * clients. A topic is freed when its last subscriber unsubscribes or
+ * disconnects.
+ * ------------------------------------------------------------------------- */
+#define SUB_TOPICS_MAX      64          /* bits in a uint64_t mask */
+#define SUB_SAMPLE_MS       2000
+#define SUB_QUEUE_MAX       4096
+#define SUB_REPLY_ROOM      320         /* of the queue, kept for 'reload' */
+#define SUB_STALL_S         10
+
+enum sub_kind {
+    SUB_SETTING,
+    SUB_PROFILE,
+    SUB_RESET,
+};
+
+struct sub_topic {
+    char                    name[48];   /* "" = free */
+    enum sub_kind           kind;
+    const struct iovar_def *def;        /* SUB_SETTING */
+    const struct profile   *profile;    /* SUB_PROFILE */
+    uint32_t                value;
+    int                     err;
+    uint64_t                gen;        /* 0 = not read yet */
+    char                    source[24];
+};
+
+struct serve_client {
+    int             fd;                 /* -1 = free slot */
+    size_t          len;
+    char            buf[BATCH_LINE_MAX];
+    uint64_t        subs;               /* subscribed topics */
+    uint64_t        dirty;              /* changed, not queued yet */
+    uint64_t        fresh;              /* snapshot not taken yet */
+    size_t          out_len;
+    char            out[SUB_QUEUE_MAX];
+    struct timespec moved;              /* queue last drained a little */
+    int             memfd;              /* 'replies memfd' */
+    uint32_t        memfd_min;
+    int             reload_wait;        /* 'reload' not answered yet */
+};
+
+struct serve {
+    struct serve_client   clients[SERVE_CLIENTS_MAX];
+    int                   active;
+    struct sub_topic      topics[SUB_TOPICS_MAX];
+    size_t                n_topics;
+    uint64_t              gen;
+    const struct profile *restore;      /* last profile applied here */
+    struct config        *restore_cf;   /* holds 'restore' */
+    uint32_t              resets;
+    int                   have_resets;
+    int                   counters_err; /* reset tracking unavailable */
+    struct timespec       sampled;
+    struct timespec       idle_since;   /* last client left */
+};
+
+static uint64_t sub_wanted(const struct serve *sv)
+{
+    uint64_t want = 0;
+    size_t i;
+
+    for (i = 0; i < SERVE_CLIENTS_MAX; i++)
+        want |= sv->clients[i].subs;
+    return want;
+}
+
+/* Index of the topic 'name', added if new; negative errno if invalid */
+static int sub_topic(struct serve *sv, const char *name)
+{
+    struct sub_topic *t;
+    size_t i, slot = sv->n_topics;
+
+    for (i = 0; i < sv->n_topics; i++) {
+        if (sv->topics[i].name[0] == '\0' && slot == sv->n_topics)
+            slot = i;
+        else if (strcmp(sv->topics[i].name, name) == 0)
+            return (int)i;
+    }
+    if (slot == SUB_TOPICS_MAX)
+        return -ENOSPC;
+    if (strlen(name) >= sizeof(t->name))
+        return -ENOENT;
+
+    t = &sv->topics[slot];
+    memset(t, 0, sizeof(*t));
+    if (strncmp(name, "profile:", 8) == 0) {
+        t->kind = SUB_PROFILE;
+        t->profile = profile_lookup(name + 8);
+        if (!t->profile)
+            return -ENOENT;
+    } else if (strcmp(name, "reset") == 0) {
+        t->kind = SUB_RESET;
+    } else {
+        t->kind = SUB_SETTING;
+        t->def = iovar_lookup(name);
+        if (!t->def)
+            return -ENOENT;
+    }
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    if (slot == sv->n_topics)
+        sv->n_topics++;
+    return (int)slot;
+}
+
+/* Free the topics no client subscribes to any more */
+static void sub_release(struct serve *sv)
+{
+    uint64_t want = sub_wanted(sv);
+    size_t i;
+
+    for (i = 0; i < sv->n_topics; i++) {
+        if (!(want & (1ull << i)))
+            memset(&sv->topics[i], 0, sizeof(sv->topics[i]));
+    }
+    while (sv->n_topics > 0 && sv->topics[sv->n_topics - 1].name[0] == '\0')
+        sv->n_topics--;
+}
+
+/* Record a value; a change takes a new generation for its subscribers */
+static void sub_update(struct serve *sv, size_t i, uint32_t value, int err,
+                       const char *source)
+{
+    struct sub_topic *t = &sv->topics[i];
+    size_t c;
+
+    if (t->gen && t->value == value && t->err == err)
+        return;
+    t->value = value;
+    t->err = err;
+    t->gen = ++sv->gen;
+    snprintf(t->source, sizeof(t->source), "%s", source);
+    for (c = 0; c < SERVE_CLIENTS_MAX; c++) {
+        if (sv->clients[c].subs & (1ull << i))
+            sv->clients[c].dirty |= 1ull << i;
+    }
+}
+
+/* Firmware reset count; on a new reset, apply the remembered profile
+ * again. Returns 1 if the firmware has reset since the last call. */
+static int sub_check_reset(struct iovar_session *s, struct serve *sv,
+                           uint64_t want)
+{
+    struct counter_snapshot c;
+    int fired = 0;
+    size_t i;
+
+    if (sv->counters_err == 0) {
+        sv->counters_err = counters_read(s, &c);
+        if (sv->counters_err != 0)
+            log_error("counters", sv->counters_err, "WARNING: counters "
+                      "unreadable, firmware resets are not tracked\n");
+    }
+    if (sv->counters_err == 0) {
+        fired = sv->have_resets && c.val[CNT_RESET] != sv->resets;
+        sv->resets = c.val[CNT_RESET];
+        sv->have_resets = 1;
+    }
+    for (i = 0; i < sv->n_topics; i++) {
+        if ((want & (1ull << i)) && sv->topics[i].kind == SUB_RESET)
+            sub_update(sv, i, sv->resets, sv->counters_err, "reset");
+    }
+
+    if (fired && sv->restore) {
+        int ret = profile_apply(s, sv->restore);
+
+        log_error(NULL, ret, "firmware reset, profile %s %s\n",
+                  sv->restore->name, ret == 0 ? "applied again" :
+                                                "could not be applied");
+    }
+    return fired;
+}
+
+/* Reads a topic takes: a setting 1, a profile one per entry */
+static size_t sub_entries(const struct sub_topic *t)
+{
+    if (t->kind == SUB_SETTING)
+        return 1;
+    return t->kind == SUB_PROFILE && t->profile ? t->profile->n_entries : 0;
+}
+
+/* After a reload, point profile topics at the new definitions; a topic
+ * whose profile is gone reports -ENOENT */
+static void sub_resolve(struct serve *sv)
+{
+    size_t i;
+
+    for (i = 0; i < sv->n_topics; i++) {
+        if (sv->topics[i].kind == SUB_PROFILE)
+            sv->topics[i].profile = profile_lookup(sv->topics[i].name + 8);
+    }
+}
+
+/* Read every subscribed topic again, all settings in one batch */
+static void sub_sample(struct iovar_session *s, struct serve *sv,
+                       const char *source)
+{
+    uint64_t want = sub_wanted(sv);
+    struct iovar_op *ops;
+    size_t i, j, n = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &sv->sampled);
+    if (sub_check_reset(s, sv, want))
+        source = "reset";
+
+    for (i = 0; i < sv->n_topics; i++) {
+        if (!(want & (1ull << i)))
+            continue;
+        n += sub_entries(&sv->topics[i]);
+    }
+    if (n == 0)
+        return;
+
+    ops = calloc(n, sizeof(*ops));
+    if (!ops)
+        return;
+
+    for (i = 0, n = 0; i < sv->n_topics; i++) {
+        const struct sub_topic *t = &sv->topics[i];
+
+        if (!(want & (1ull << i)) || t->kind == SUB_RESET)
+            continue;
+        for (j = 0; j < sub_entries(t); j++, n++) {
+            ops[n].def = t->def ? t->def :
+                         iovar_lookup(t->profile->entries[j].name);
+            ops[n].name = t->def ? t->def->name :
+                          t->profile->entries[j].name;
+            ops[n].quiet = 1;
+        }
+    }
+    iovar_ops_run(s, ops, n);
+
+    for (i = 0, n = 0; i < sv->n_topics; i++) {
+        const struct sub_topic *t = &sv->topics[i];
+        uint32_t active = 1;
+        int err = 0;
+
+        if (!(want & (1ull << i)) || t->kind == SUB_RESET)
+            continue;
+        if (t->kind == SUB_SETTING) {
+            sub_update(sv, i, ops[n].value, ops[n].err, source);
+            n++;
+            continue;
+        }
+        if (!t->profile) {
+            sub_update(sv, i, 0, -ENOENT, source);
+            continue;
+        }
+        for (j = 0; j < t->profile->n_entries; j++, n++) {
+            if (ops[n].err && !err)
+                err = ops[n].err;
+            if (ops[n].value != t->profile->entries[j].value)
+                active = 0;
+        }
+        sub_update(sv, i, err ? 0 : active, err, source);
+    }
+    free(ops);
+}
+
+/* Queue the client's changed topics, as many as fit */
+static void sub_queue(struct serve *sv, struct serve_client *c)
+{
+    size_t i;
+
+    for (i = 0; i < sv->n_topics && c->dirty; i++) {
+        const struct sub_topic *t = &sv->topics[i];
+        char line[128];
+        int len;
+
+        if (!(c->dirty & (1ull << i)))
+            continue;
+        if (t->err)
+            len = snprintf(line, sizeof(line), "@%llu %s error:%d %s\n",
+                           (unsigned long long)t->gen, t->name, t->err,
+                           t->source);
+        else
+            len = snprintf(line, sizeof(line), "@%llu %s %u %s\n",
+                           (unsigned long long)t->gen, t->name, t->value,
+                           t->source);
+        if (c->out_len + (size_t)len > sizeof(c->out) - SUB_REPLY_ROOM)
+            break;              /* stays marked: coalesced */
+        if (c->out_len == 0)
+            clock_gettime(CLOCK_MONOTONIC, &c->moved);
+        memcpy(c->out + c->out_len, line, (size_t)len);
+        c->out_len += (size_t)len;
+        c->dirty &= ~(1ull << i);
+    }
+}
+
+/* Write what of the queue the socket takes now. Returns -1 if the client
+ * is gone or stalled. */
+static int serve_flush(struct serve_client *c)
+{
+    while (c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            return -1;
+        }
+        memmove(c->out, c->out + n, c->out_len - (size_t)n);
+        c->out_len -= (size_t)n;
+        clock_gettime(CLOCK_MONOTONIC, &c->moved);
+    }
+    if (c->out_len > 0 && elapsed_us(&c->moved) / 1000000 >= SUB_STALL_S)
+        return -1;
+    return 0;
+}
+
+static int sub_command(struct serve *sv, struct serve_client *c,
+                       char **args, int n)
+{
+    uint64_t bits = 0;
+    int i, t;
+
+    if (strcmp(args[0], "unsubscribe") == 0) {
+        for (i = 1; i < n; i++) {
+            for (t = 0; t < (int)sv->n_topics; t++) {
+                if (strcmp(sv->topics[t].name, args[i]) == 0)
+                    bits |= 1ull << t;
+            }
+        }
+        if (n == 1)
+            bits = ~0ull;
+        c->subs &= ~bits;
+        c->dirty &= ~bits;
+        c->fresh &= ~bits;
+        sub_release(sv);
+        return 0;
+    }
+
+    if (n < 2) {
+        fprintf(stderr, "ERROR: subscribe <setting|profile:<name>|reset>"
+                "...\n");
+        return 1;
+    }
+    for (i = 1; i < n; i++) {
+        t = sub_topic(sv, args[i]);
+        if (t < 0) {
+            fprintf(stderr, "ERROR: %s topic '%s'\n", t == -ENOSPC ?
+                    "No room for" : "Unknown", args[i]);
+            sub_release(sv);
+            return 1;
+        }
+        bits |= 1ull << t;
+    }
+
+    /* Read once the reply is out, see serve_run() */
+    c->subs |= bits;
+    c->fresh |= bits;
+    return 0;
+}
+
+/* Read the topics just subscribed to; all of them go out as a snapshot.
+ * Runs with the daemon's own stderr, so what the reads report goes to
+ * its log rather than into the client's reply. */
+static void sub_snapshot(struct iovar_session *s, struct serve *sv,
+                         struct serve_client *c)
+{
+    if (!c->fresh)
+        return;
+    sub_sample(s, sv, "subscribe");
+    c->dirty |= c->fresh;
+    c->fresh = 0;
+}
+
+/* The listening socket passed by the service manager, or -1 */
+static int serve_inherited(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    uint32_t p, n;
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+
+    if (!pid || !fds || parse_u32(pid, &p) != 0 ||
+        parse_u32(fds, &n) != 0 || (pid_t)p != getpid() || n == 0)
+        return -1;
+
+    /* Not for the children of commands run here */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    if (getsockopt(SD_LISTEN_FDS_START, SOL_SOCKET, SO_ACCEPTCONN,
+                   &listening, &len) != 0 || !listening) {
+        fprintf(stderr, "ERROR: Inherited fd %d is not a listening "
+                "socket\n", SD_LISTEN_FDS_START);
+        return -1;
+    }
+    if (n > 1)
+        fprintf(stderr, "WARNING: %u sockets passed, using the first\n", n);
+    fcntl(SD_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+    return SD_LISTEN_FDS_START;
+}
+
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "ERROR: Socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    memcpy(sa.sun_path, path, strlen(path) + 1);
+
+    if (strncmp(path, SERVE_DIR "/", sizeof(SERVE_DIR)) == 0 &&
+        mkdir(SERVE_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", SERVE_DIR,
+                strerror(errno));
+        return -errno;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    unlink(path);                   /* left over from an earlier run */
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        chmod(path, 0660) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "ERROR: Cannot listen on %s: %s\n", path,
+                strerror(errno));
+        close(fd);
+        return -errno;
+    }
+    return fd;
+}
+
+/* -------------------------------------------------------------------------
+ * Large replies through a sealed memfd
+ *
+ *   replies inline
+ *   replies memfd [min-bytes]
+ *
+ * By default a reply streams down the socket as the command writes it. A
+ * client that sends 'replies memfd' has its output captured in a memfd
+ * instead. Output shorter than min-bytes (default SERVE_MEMFD_MIN) is
+ * then sent inline as before. Longer output is sealed against any change
+ * of size or content and the descriptor is passed with SCM_RIGHTS, on a
+ * single 0x01 byte that takes the place of the output; the client maps it
+ * and reads the result where the command wrote it, without copying it
+ * through the socket buffers. The NUL and status line follow either way.
+ *
+ *   payload <bytes>
+ *
+ * writes a synthetic result of that many bytes, for measuring both paths
+ * (see reply-bench). Only a daemon started with --emulate takes it; a
+ * real one has no use for a line that makes it write 64 MiB.
+ * ------------------------------------------------------------------------- */
+#define SERVE_MEMFD_MIN     (16 * 1024)
+#define SERVE_MEMFD_SEALS   (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | \
+                             F_SEAL_SEAL)
+#define SERVE_FD_MARKER     '\001'
+#define PAYLOAD_MAX         (64u * 1024 * 1024)
+
+static int serve_replies(struct serve_client *c, char **args, int n)
+{
+    uint32_t min = SERVE_MEMFD_MIN;
+
+    if (n == 2 && strcmp(args[1], "inline") == 0) {
+        c->memfd = 0;
+        return 0;
+    }
+    if (n >= 2 && n <= 3 && strcmp(args[1], "memfd") == 0 &&
+        (n == 2 || parse_u32(args[2], &min) == 0)) {
+        c->memfd = 1;
+        c->memfd_min = min;
+        return 0;
+    }
+    fprintf(stderr, "ERROR: replies inline | memfd [min-bytes]\n");
+    return 1;
+}
+
+static int serve_payload(char **args, int n)
+{
+    static const char line[] =
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde\n";
+    uint32_t bytes;
+
+    if (n != 2 || parse_u32(args[1], &bytes) != 0 || bytes > PAYLOAD_MAX) {
+        fprintf(stderr, "ERROR: payload <bytes> (at most %u)\n",
+                PAYLOAD_MAX);
+        return 1;
+    }
+    for (; bytes >= sizeof(line) - 1; bytes -= sizeof(line) - 1)
+        fwrite(line, 1, sizeof(line) - 1, stdout);
+    fwrite(line + sizeof(line) - 1 - bytes, 1, bytes, stdout);
+    return 0;
+}
+
+/* Seal the captured output and pass it on a marker byte */
+static int serve_send_memfd(int sock, int fd)
+{
+    char marker = SERVE_FD_MARKER;
+    struct iovec iov = { .iov_base = &marker, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type  = SCM_RIGHTS;
+    cm->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* Small captured output goes inline, file to socket inside the kernel */
+static int serve_send_copy(int sock, int fd, off_t size)
+{
+    off_t off = 0;
+
+    while (off < size) {
+        ssize_t n = sendfile(sock, fd, &off, (size_t)(size - off));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Run one line with stdout and stderr sent to the client (streamed, or
+ * captured in a memfd for 'replies memfd'), then the NUL + status
+ * trailer, then re-read what the command may have changed.
+ * Returns -1 if the client is gone. */
+static int serve_run(struct iovar_session *s, struct serve *sv,
+                     struct serve_client *c, char *line)
+{
+    char *args[BATCH_MAX_ARGS];
+    char trailer[16];
+    int out, err, n, local = 1, status = 0, len, mfd = -1, ret = 0;
+    off_t size;
+
+    /* Answered once the loader is done; this client's lines wait */
+    n = command_split(line, args);
+    if (n == 1 && strcmp(args[0], "reload") == 0 && config_wake >= 0) {
+        config_reload_start();
+        c->reload_wait = 1;
+        return 0;
+    }
+
+    if (c->memfd)
+        mfd = memfd_create("brcm-iovar-reply",
+                           MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    fflush(stdout);
+    fflush(stderr);
+    out = dup(STDOUT_FILENO);
+    err = dup(STDERR_FILENO);
+    dup2(mfd >= 0 ? mfd : c->fd, STDOUT_FILENO);
+    dup2(mfd >= 0 ? mfd : c->fd, STDERR_FILENO);
+    log_pause(1);
+
+    if (n > 0 && (strcmp(args[0], "subscribe") == 0 ||
+                  strcmp(args[0], "unsubscribe") == 0)) {
+        status = sub_command(sv, c, args, n);
+    } else if (n > 0 && strcmp(args[0], "replies") == 0) {
+        status = serve_replies(c, args, n);
+    } else if (n > 0 && strcmp(args[0], "payload") == 0 && s->emulated) {
+        status = serve_payload(args, n);
+    } else if (n > 0 && strcmp(args[0], "reload") == 0) {
+        fprintf(stderr, "ERROR: Nothing to reload (serve runs without "
+                "--profiles)\n");
+        status = 1;
+    } else if (n < 0) {
+        command_line_error("", n);
+        status = 1;
+    } else if (n > 0) {
+        local = 0;
+        status = command_run(s, "", args, n);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    close(out);
+    close(err);
+    log_pause(0);
+    sub_snapshot(s, sv, c);
+
+    if (mfd >= 0) {
+        size = lseek(mfd, 0, SEEK_END);
+        if (size > 0 && (uint64_t)size >= c->memfd_min &&
+            fcntl(mfd, F_ADD_SEALS, SERVE_MEMFD_SEALS) == 0)
+            ret = serve_send_memfd(c->fd, mfd);
+        else if (size > 0)
+            ret = serve_send_copy(c->fd, mfd, size);
+        close(mfd);
+        if (ret != 0)
+            return -1;
+    }
+
+    if (n > 0 && !local) {
+        if (strcmp(args[0], "profile") == 0 && n == 2 && status == 0) {
+            config_put(sv->restore_cf);
+            sv->restore_cf = config_get();
+            sv->restore = profile_lookup(args[1]);
+        }
+        if (sub_wanted(sv))
+            sub_sample(s, sv, args[0]);
+    }
+
+    len = snprintf(trailer, sizeof(trailer), "%c%d\n", 0, status);
+    return send(c->fd, trailer, (size_t)len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+/* Run every complete line buffered, until one has to wait for a reload
+ * or for queued pushes to go out first */
+static int serve_client_lines(struct iovar_session *s, struct serve *sv,
+                              struct serve_client *c)
+{
+    char *nl;
+
+    if (serve_flush(c) != 0)
+        return -1;
+    while (!c->reload_wait && c->out_len == 0 && !stop_requested &&
+           (nl = memchr(c->buf, '\n', c->len)) != NULL) {
+        size_t used = (size_t)(nl - c->buf) + 1;
+
+        *nl = '\0';
+        if (serve_run(s, sv, c, c->buf) != 0)
+            return -1;
+        memmove(c->buf, c->buf + used, c->len - used);
+        c->len -= used;
+    }
+
+    if (c->len == sizeof(c->buf) - 1 && !memchr(c->buf, '\n', c->len)) {
+        static const char msg[] = "ERROR: Line too long\n\0" "1\n";
+
+        send(c->fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read what the client sent and run every complete line */
+static int serve_client_read(struct iovar_session *s, struct serve *sv,
+                             struct serve_client *c)
+{
+    ssize_t n;
+
+    n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len,
+             MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (n < 0)
+        return 0;
+    c->len += (size_t)n;
+    return serve_client_lines(s, sv, c);
+}
+
+static void serve_drop(struct serve *sv, struct serve_client *c)
+{
+    close(c->fd);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    sub_release(sv);
+    if (--sv->active == 0)
+        clock_gettime(CLOCK_MONOTONIC, &sv->idle_since);
+}
+
+/* A load finished (ret as config_reload_poll): re-read what depends on
+ * the profiles, queue the answer of the clients waiting on 'reload',
+ * then run what they sent meanwhile */
+static void serve_reload_done(struct iovar_session *s, struct serve *sv,
+                              int ret)
+{
+    const struct config *cf = atomic_load(&config_current);
+    size_t i;
+
+    if (ret > 0) {
+        sub_resolve(sv);
+        if (sub_wanted(sv))
+            sub_sample(s, sv, "reload");
+    }
+
+    for (i = 0; i < SERVE_CLIENTS_MAX; i++) {
+        struct serve_client *c = &sv->clients[i];
+        char reply[SUB_REPLY_ROOM];
+        int len;
+
+        if (c->fd < 0 || !c->reload_wait)
+            continue;
+        if (ret > 0)
+            len = snprintf(reply, sizeof(reply), "configuration %u, %zu "
+                           "profiles\n%c0\n", cf->gen, cf->n_profiles, 0);
+        else
+            len = snprintf(reply, sizeof(reply), "ERROR: %s\n%c1\n",
+                           config_loader.err, 0);
+        if (len >= (int)sizeof(reply))
+            len = (int)sizeof(reply) - 1;
+
+        /* Pushes leave the room, see sub_queue() */
+        memcpy(c->out + c->out_len, reply, (size_t)len);
+        c->out_len += (size_t)len;
+        c->reload_wait = 0;
+        if (serve_client_lines(s, sv, c) != 0)
+            serve_drop(sv, c);
+    }
+}
+
+/* ms until the loop must wake up, -1 for never; 0 = idle exit is due */
+static int serve_timeout(const struct serve *sv, uint32_t idle)
+{
+    long wait = -1;
+    size_t i;
+
+    if (sv->active == 0 && idle) {
+        wait = (long)idle * 1000 - elapsed_us(&sv->idle_since) / 1000;
+        if (wait <= 0)
+            return 0;
+    }
+    if (sub_wanted(sv) || sv->restore) {
+        long due = SUB_SAMPLE_MS - elapsed_us(&sv->sampled) / 1000;
+
+        if (due < 1)
+            due = 1;
+        if (wait < 0 || due < wait)
+            wait = due;
+    }
+    for (i = 0; i < SERVE_CLIENTS_MAX; i++) {
+        if (sv->clients[i].out_len && (wait < 0 || wait > 1000))
+            wait = 1000;        /* for the stall check */
+    }
+    return (int)wait;
+}
+
+static int cmd_serve(struct iovar_session *s, int argc, char **argv)
+{
+    struct serve *sv;
+    struct pollfd pfd[2 + SERVE_CLIENTS_MAX];
+    struct timeval send_timeout = { SERVE_SEND_TIMEOUT_S, 0 };
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    uint32_t idle = 0;
+    int lfd, inherited;
+    size_t i;
+
+    if (argc > 0 && parse_u32(argv[0], &idle) != 0) {
+        fprintf(stderr, "ERROR: serve [idle-seconds] [socket-path]\n");
+        return 1;
+    }
+    if (argc > 1)
+        snprintf(path, sizeof(path), "%s", argv[1]);
+    else
+        snprintf(path, sizeof(path), SERVE_DIR "/%s.sock", s->ifname);
+
+    lfd = serve_inherited();
+    inherited = lfd >= 0;
+    if (!inherited)
+        lfd = serve_listen(path);
+    if (lfd < 0)
+        return 1;
+
+    sv = calloc(1, sizeof(*sv));
+    if (!sv) {
+        close(lfd);
+        return 1;
+    }
+    for (i = 0; i < SERVE_CLIENTS_MAX; i++)
+        sv->clients[i].fd = -1;
+
+    install_stop_handlers();
+    if (config_profiles_path)
+        config_reload_init(NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "serving %s on %s%s\n", s->ifname,
+            inherited ? "inherited socket" : path,
+            idle ? "" : ", no idle exit");
+    log_start();
+    serving = 1;
+    clock_gettime(CLOCK_MONOTONIC, &sv->idle_since);
+    sv->sampled = sv->idle_since;
+
+    while (!stop_requested) {
+        int timeout = serve_timeout(sv, idle);
+
+        if (timeout == 0 && sv->active == 0 && idle)
+            break;
+
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        for (i = 0; i < SERVE_CLIENTS_MAX; i++) {
+            struct serve_client *c = &sv->clients[i];
+
+            /* A full buffer holds lines waiting for the queue */
+            pfd[1 + i].fd = c->fd;
+            pfd[1 + i].events = (c->len < sizeof(c->buf) - 1 ? POLLIN : 0) |
+                                (c->out_len ? POLLOUT : 0);
+            pfd[1 + i].revents = 0;
+        }
+        pfd[0].revents = 0;
+        pfd[1 + SERVE_CLIENTS_MAX].fd = config_wake;
+        pfd[1 + SERVE_CLIENTS_MAX].events = POLLIN;
+        pfd[1 + SERVE_CLIENTS_MAX].revents = 0;
+        poll(pfd, 2 + SERVE_CLIENTS_MAX, timeout);
+
+        if (pfd[1 + SERVE_CLIENTS_MAX].revents & POLLIN) {
+            int ret = config_reload_poll();
+
+            if (ret != 0)
+                serve_reload_done(s, sv, ret);
+        }
+
+        for (i = 0; i < SERVE_CLIENTS_MAX; i++) {
+            struct serve_client *c = &sv->clients[i];
+
+            if (c->fd >= 0 && (pfd[1 + i].revents & (POLLIN | POLLHUP |
+                                                      POLLERR)) &&
+                serve_client_read(s, sv, c) != 0)
+                serve_drop(sv, c);
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+            for (i = 0; fd >= 0 && i < SERVE_CLIENTS_MAX &&
+                        sv->clients[i].fd >= 0; i++)
+                ;
+            if (fd >= 0 && i == SERVE_CLIENTS_MAX) {
+                static const char msg[] = "ERROR: Too many clients\n\0"
+                                          "1\n";
+
+                send(fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL);
+                close(fd);
+            } else if (fd >= 0) {
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                           sizeof(send_timeout));
+                sv->clients[i].fd = fd;
+                sv->active++;
+            }
+        }
+
+        if ((sub_wanted(sv) || sv->restore) &&
+            elapsed_us(&sv->sampled) / 1000 >= SUB_SAMPLE_MS)
+            sub_sample(s, sv, "sample");
+
+        for (i = 0; i < SERVE_CLIENTS_MAX; i++) {
+            struct serve_client *c = &sv->clients[i];
+
+            if (c->fd < 0)
+                continue;
+            /* Lines that waited for the queue run first */
+            if (serve_client_lines(s, sv, c) != 0) {
+                serve_drop(sv, c);
+                continue;
+            }
+            sub_queue(sv, c);
+            if (serve_flush(c) != 0)
+                serve_drop(sv, c);
+        }
+    }
+
+    for (i = 0; i < SERVE_CLIENTS_MAX; i++) {
+        if (sv->clients[i].fd >= 0)
+            close(sv->clients[i].fd);
+    }
+    serving = 0;
+    log_stop();
+    config_put(sv->restore_cf);
+    free(sv);
+    close(lfd);
+    if (!inherited)
+        unlink(path);
+    fprintf(stderr, "serve: %s\n",
+            stop_requested ? "stopped" : "idle, exiting");
+    return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * --connect - Run the command in the interface's serve daemon
+ *
+ *   brcm-iovar --connect[=socket] <interface> <command> [args...]
+ *
+ * The command line is sent to SERVE_DIR/<interface>.sock (or the given
+ * socket) and its output and exit status come back as if it had run
+ * in-process, without the process and netlink setup. stdout and stderr
+ * of the command arrive merged on stdout. Replies are requested as
+ * memfds, so large results are mapped instead of read from the socket.
+ * A received memfd must carry the write and shrink seals: the daemon can
+ * then no longer truncate it under the mapping (SIGBUS) or change it.
+ *
+ *   brcm-iovar --connect <interface> reply-bench [max-bytes] [rounds]
+ *
+ * times 'payload' results of 64 bytes up to max-bytes through both reply
+ * paths, the client reading every byte either way, and reports from
+ * which size on the memfd is faster. The daemon must run under
+ * --emulate.
+ * ------------------------------------------------------------------------- */
+#define CLIENT_BUF          65536
+#define REPLY_BENCH_MIN     64
+#define REPLY_BENCH_MAX     (4u * 1024 * 1024)
+#define REPLY_BENCH_ROUNDS  200
+#define REPLY_BENCH_SIZES   32
+
+struct client {
+    int     fd;
+    int     pending;                    /* memfd that came with buf */
+    size_t  off;
+    size_t  len;
+    char    buf[CLIENT_BUF];
+};
+
+static int client_open(struct client *cl, const char *path)
+{
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+    cl->off = cl->len = 0;
+    cl->pending = -1;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+
+    cl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (cl->fd < 0 ||
+        connect(cl->fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        fprintf(stderr, "ERROR: Cannot connect to %s: %s (is serve "
+                "running?)\n", path, strerror(errno));
+        if (cl->fd >= 0)
+            close(cl->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void client_close(struct client *cl)
+{
+    if (cl->pending >= 0)
+        close(cl->pending);
+    close(cl->fd);
+}
+
+static int client_send(struct client *cl, const char *text, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(cl->fd, text, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        text += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Refill the empty buffer; a memfd can only arrive with its marker */
+static int client_fill(struct client *cl)
+{
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct iovec iov = { .iov_base = cl->buf, .iov_len = sizeof(cl->buf) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *cm;
+    ssize_t n;
+
+    do {
+        n = recvmsg(cl->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return n == 0 ? -ECONNRESET : -errno;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+            cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+            if (cl->pending >= 0)
+                close(cl->pending);
+            memcpy(&cl->pending, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+    cl->off = 0;
+    cl->len = (size_t)n;
+    return 0;
+}
+
+/* Hand reply bytes to the output fd and/or fold them into a checksum */
+static int client_consume(const char *p, size_t len, int out, uint32_t *sum)
+{
+    size_t i;
+
+    if (sum) {
+        for (i = 0; i < len; i++)
+            *sum = *sum * 31 + (unsigned char)p[i];
+    }
+    while (out >= 0 && len > 0) {
+        ssize_t n = write(out, p, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int client_map(int fd, int out, uint32_t *sum)
+{
+    const int need = F_SEAL_SHRINK | F_SEAL_WRITE;
+    struct stat st;
+    void *p;
+    int seals, ret;
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & need) != need) {
+        fprintf(stderr, "ERROR: Reply memfd is not sealed\n");
+        return -EPERM;
+    }
+    if (fstat(fd, &st) != 0)
+        return -errno;
+    if (st.st_size == 0)
+        return 0;
+
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+    ret = client_consume(p, (size_t)st.st_size, out, sum);
+    munmap(p, (size_t)st.st_size);
+    return ret;
+}
+
+/* Read one reply: output (inline or memfd), NUL, status line */
+static int client_reply(struct client *cl, int out, uint32_t *sum,
+                        int *status)
+{
+    char digits[16];
+    size_t nd = 0;
+    int in_status = 0;
+    int ret;
+
+    for (;;) {
+        char *p = cl->buf + cl->off;
+        size_t avail = cl->len - cl->off;
+        size_t i;
+
+        if (avail == 0) {
+            ret = client_fill(cl);
+            if (ret != 0)
+                return ret;
+            continue;
+        }
+
+        if (in_status) {
+            for (i = 0; i < avail && p[i] != '\n'; i++) {
+                if (nd < sizeof(digits) - 1)
+                    digits[nd++] = p[i];
+            }
+            cl->off += i;
+            if (i == avail)
+                continue;
+            cl->off++;
+            digits[nd] = '\0';
+            *status = atoi(digits);
+            return 0;
+        }
+
+        for (i = 0; i < avail && p[i] != '\0' &&
+                    !(p[i] == SERVE_FD_MARKER && cl->pending >= 0); i++)
+            ;
+        ret = client_consume(p, i, out, sum);
+        if (ret != 0)
+            return ret;
+        cl->off += i;
+        if (i == avail)
+            continue;
+        cl->off++;
+
+        if (p[i] == '\0') {
+            in_status = 1;
+        } else {
+            ret = client_map(cl->pending, out, sum);
+            close(cl->pending);
+            cl->pending = -1;
+            if (ret != 0)
+                return ret;
+        }
+    }
+}
+
+/* Mean microseconds per request, or -1 */
+static double client_bench_one(struct client *cl, const char *req,
+                               uint32_t rounds, uint32_t *sum)
+{
+    struct timespec t0;
+    uint32_t i;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < rounds; i++) {
+        if (client_send(cl, req, strlen(req)) != 0 ||
+            client_reply(cl, -1, sum, &status) != 0 || status != 0)
+            return -1;
+    }
+    return (double)elapsed_us(&t0) / rounds;
+}
+
+static int client_reply_bench(struct client *cl, int argc, char **argv)
+{
+    static const char *const modes[2] = {
+        "replies inline\n", "replies memfd 0\n",
+    };
+    uint32_t max = REPLY_BENCH_MAX, rounds = REPLY_BENCH_ROUNDS;
+    uint32_t sizes[REPLY_BENCH_SIZES], sum = 0, size;
+    double us[REPLY_BENCH_SIZES][2];
+    size_t n = 0, i, cross;
+    char req[32];
+    int m, status;
+
+    if ((argc > 0 && parse_u32(argv[0], &max) != 0) ||
+        (argc > 1 && (parse_u32(argv[1], &rounds) != 0 || rounds == 0)) ||
+        max < REPLY_BENCH_MIN || max > PAYLOAD_MAX) {
+        fprintf(stderr, "ERROR: reply-bench [max-bytes] [rounds]\n");
+        return 1;
+    }
+
+    for (size = REPLY_BENCH_MIN; size <= max && n < REPLY_BENCH_SIZES;
+         size *= 2)
+        sizes[n++] = size;
+
+    for (m = 0; m < 2; m++) {
+        if (client_send(cl, modes[m], strlen(modes[m])) != 0 ||
+            client_reply(cl, -1, NULL, &status) != 0 || status != 0) {
+            fprintf(stderr, "ERROR: Daemon does not support '%.*s'\n",
+                    (int)strlen(modes[m]) - 1, modes[m]);
+            return 1;
+        }
+        for (i = 0; i < n; i++) {
+            snprintf(req, sizeof(req), "payload %u\n", sizes[i]);
+            /* One warm-up request sizes buffers and faults pages in */
+            if (client_bench_one(cl, req, 1, &sum) < 0 ||
+                (us[i][m] = client_bench_one(cl, req, rounds, &sum)) < 0) {
+                fprintf(stderr, "ERROR: payload %u failed\n", sizes[i]);
+                return 1;
+            }
+        }
+    }
+
+    printf("reply-bench: %u round trips per size, client reads every "
+           "byte (sum %08x)\n", rounds, sum);
+    printf("%10s %12s %12s\n", "bytes", "inline us", "memfd us");
+    for (i = 0; i < n; i++)
+        printf("%10u %12.1f %12.1f%s\n", sizes[i], us[i][0], us[i][1],
+               us[i][1] < us[i][0] ? "  memfd" : "");
+
+    /* Smallest size from which the memfd wins at every larger size */
+    for (cross = n; cross > 0 && us[cross - 1][1] < us[cross - 1][0];
+         cross--)
+        ;
+    if (cross == n)
+        printf("crossover: none up to %u bytes, inline was faster\n",
+               sizes[n - 1]);
+    else
+        printf("crossover: memfd faster from %u bytes (daemon default "
+               "min-bytes %u)\n", sizes[cross], SERVE_MEMFD_MIN);
+    return 0;
+}
+
+static int client_run(const char *socket_path, const char *ifname,
+                      int argc, char **argv)
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char line[BATCH_LINE_MAX];
+    struct client *cl;
+    size_t len;
+    int status = 1, i;
+
+    if (socket_path)
+        snprintf(path, sizeof(path), "%s", socket_path);
+    else
+        snprintf(path, sizeof(path), SERVE_DIR "/%s.sock", ifname);
+
+    len = (size_t)snprintf(line, sizeof(line), "replies memfd\n");
+    for (i = 0; i < argc; i++) {
+        len += (size_t)snprintf(line + len, len < sizeof(line) ?
+                                sizeof(line) - len : 0, "%s%s",
+                                argv[i], i + 1 < argc ? " " : "\n");
+        if (len >= sizeof(line) || strchr(argv[i], '\n')) {
+            fprintf(stderr, "ERROR: Command line too long or has a "
+                    "newline\n");
+            return 1;
+        }
+    }
+
+    cl = malloc(sizeof(*cl));
+    if (!cl || client_open(cl, path) != 0) {
+        free(cl);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "reply-bench") == 0) {
+        status = client_reply_bench(cl, argc - 1, argv + 1);
+    } else if (client_send(cl, line, len) != 0 ||
+               client_reply(cl, -1, NULL, &status) != 0 ||
+               client_reply(cl, STDOUT_FILENO, NULL, &status) != 0) {
+        fprintf(stderr, "ERROR: Lost the connection to %s\n", path);
+        status = 1;
+    }
+
+    client_close(cl);
+    free(cl);
+    return status;
+}
+
+/* -------------------------------------------------------------------------
+ * --wait-for-iface - Run the command as soon as the interface is usable
+ *
+ * Link events are subscribed to before the name is looked up, so an
+ * interface that appears in between is not missed. Once it exists, the
+ * firmware is asked for its version until it answers: brcmfmac may
+ * register the netdev before the bus takes commands. Any firmware reply,
+ * even an error, means it is up. Retries back off from WAIT_RETRY_MIN_MS
+ * and restart at once on a new event for the interface.
+ * ------------------------------------------------------------------------- */
+#define WAIT_RETRY_MIN_MS   5
+#define WAIT_RETRY_MAX_MS   200
+
+static int link_events_open(void)
+{
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK,
+                              .nl_groups = RTMGRP_LINK };
+    int fd, err;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_ROUTE);
+    if (fd < 0)
+        return -errno;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+/* Hand each queued link event to fn(arg, RTM_NEWLINK or RTM_DELLINK,
+ * index, name); after events were dropped (ENOBUFS), fn gets type 0 and
+ * should look again at what it tracks */
+static void link_events_read(int fd, void (*fn)(void *, int, int,
+                                                const char *), void *arg)
+{
+    uint32_t buf[2048];
+    ssize_t len;
+
+    while ((len = recv(fd, buf, sizeof(buf), 0)) != 0) {
+        struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+
+        if (len < 0) {
+            if (errno != ENOBUFS)
+                break;
+            fn(arg, 0, 0, NULL);
+            continue;
+        }
+
+        for (; NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len)) {
+            struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+            struct rtattr *rta = IFLA_RTA(ifi);
+            int alen = IFLA_PAYLOAD(nlh);
+            const char *name = NULL;
+
+            if (nlh->nlmsg_type != RTM_NEWLINK &&
+                nlh->nlmsg_type != RTM_DELLINK)
+                continue;
+            for (; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if (rta->rta_type == IFLA_IFNAME && RTA_PAYLOAD(rta) > 0 &&
+                    ((char *)RTA_DATA(rta))[RTA_PAYLOAD(rta) - 1] == '\0')
+                    name = RTA_DATA(rta);
+            }
+            fn(arg, nlh->nlmsg_type, ifi->ifi_index, name);
+        }
+    }
+}
+
+/* 0 once the firmware answers, -EAGAIN while it may still come up, or
+ * the error of an interface that never takes vendor commands */
+static int firmware_probe(struct iovar_session *s)
+{
+    char ver[256];
+    size_t len;
+    int ret;
+
+    ret = iovar_probe_buf(s, "ver", ver, sizeof(ver), &len);
+    if (ret == 0 || ret == -EBADE)
+        return 0;
+    if (ret == -EOPNOTSUPP || ret == -EPERM || ret == -EACCES)
+        return ret;
+    return -EAGAIN;
+}
+
+/* cfg80211 links every netdev it manages to its phy while registering
+ * it, before the link event goes out; without the link the interface
+ * will never take vendor commands */
+static int iface_is_wireless(const char *ifname)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/phy80211", ifname);
+    return access(path, F_OK) == 0;
+}
+
+struct iface_wait_state {
+    const char *ifname;
+    int         ifindex;    /* 0 while the interface is missing */
+    int         seen;       /* an event concerned it */
+};
+
+static void iface_wait_event(void *arg, int type, int ifindex,
+                             const char *name)
+{
+    struct iface_wait_state *w = arg;
+
+    if (type == 0) {
+        w->ifindex = (int)if_nametoindex(w->ifname);
+        w->seen = 1;
+    } else if (name && strcmp(name, w->ifname) == 0) {
+        w->ifindex = type == RTM_NEWLINK ? ifindex : 0;
+        w->seen = 1;
+    } else if (ifindex == w->ifindex) {
+        w->ifindex = 0;             /* renamed away */
+        w->seen = 1;
+    }
+}
+
+static int iface_wait(struct iovar_session *s, const char *ifname,
+                      uint32_t timeout_s)
+{
+    struct iface_wait_state w = { ifname, 0, 0 };
+    struct timespec t0;
+    unsigned retry = WAIT_RETRY_MIN_MS;
+    int fd, ret = 0, not_wireless = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(s, 0, sizeof(*s));
+
+    fd = link_events_open();
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Cannot subscribe to link events: %s\n",
+                strerror(-fd));
+        return fd;
+    }
+    w.ifindex = (int)if_nametoindex(ifname);
+
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        long left = timeout_s ? (long)timeout_s * 1000 -
+                                elapsed_us(&t0) / 1000 : -1;
+        int wait = -1;
+
+        if (w.ifindex > 0 && !iface_is_wireless(ifname)) {
+            /* Found mid-registration, the link may still follow */
+            if (not_wireless++ > 0) {
+                fprintf(stderr, "ERROR: %s is not a wireless interface\n",
+                        ifname);
+                ret = -ENODEV;
+                break;
+            }
+            wait = (int)retry;
+        } else if (w.ifindex > 0) {
+            if (!s->sk) {
+                ret = session_open(s, w.ifindex);
+                if (ret != 0)
+                    break;
+            }
+            s->ifindex = w.ifindex;
+
+            ret = firmware_probe(s);
+            if (ret == 0)
+                break;
+            if (ret != -EAGAIN) {
+                fprintf(stderr, "ERROR: %s does not take brcmfmac vendor "
+                        "commands: %s\n", ifname, strerror(-ret));
+                break;
+            }
+            wait = (int)retry;
+        }
+
+        if (timeout_s && left <= 0) {
+            fprintf(stderr, "ERROR: Timed out after %u s waiting for %s "
+                    "(%s)\n", timeout_s, ifname,
+                    w.ifindex > 0 ? "firmware not answering" :
+                                    "interface missing");
+            ret = -ETIMEDOUT;
+            break;
+        }
+        if (left >= 0 && (wait < 0 || wait > left))
+            wait = (int)left;
+
+        w.seen = 0;
+        if (poll(&pfd, 1, wait) > 0)
+            link_events_read(fd, iface_wait_event, &w);
+        if (w.seen)
+            retry = WAIT_RETRY_MIN_MS;
+        else if (retry < WAIT_RETRY_MAX_MS)
+            retry *= 2;
+    }
+
+    close(fd);
+    if (ret != 0)
+        session_close(s);
+    return ret;
+}
+
+/* -------------------------------------------------------------------------
+ * hotplug - Apply a profile to each brcmfmac interface as it appears
+ *
+ *   hotplug <rules>
+ *
+ * Runs until SIGINT/SIGTERM. Interfaces are found from rtnetlink link
+ * events (and a scan at start) and kept if their sysfs device is bound to
+ * a brcmfmac driver. Each one gets its own session; once its firmware
+ * answers, the profile of the first matching rule is applied. The session
+ * is closed when the interface goes away, e.g. when a USB dongle is
+ * unplugged.
+ *
+ * SIGHUP reloads the rules and the --profiles file. Interfaces that
+ * appear afterwards use the new rules; those attached before keep the
+ * rule (and profile) they matched until they go away.
+ *
+ * Rule file, one rule per line, '#' starts a comment:
+ *
+ *   [driver=<name>] [chip=<hex id>] [mac=<pattern>] <profile>
+ *
+ * chip is the SDIO/PCI device ID or the USB product ID; mac takes shell
+ * wildcards. A rule matches if all its keys do; a rule with none matches
+ * any brcmfmac interface.
+ * ------------------------------------------------------------------------- */
+#define HOTPLUG_RULES_MAX   32
+#define HOTPLUG_IFACES_MAX  8
+#define HOTPLUG_FW_WAIT_S   30          /* give up on silent firmware */
+#define HOTPLUG_DRIVER      "brcmfmac"
+
+struct hotplug_rule {
+    char                  driver[32];   /* "" = any */
+    char                  mac[32];      /* "" = any */
+    uint32_t              chip;
+    int                   has_chip;
+    const struct profile *profile;
+    unsigned              line;
+};
+
+struct hotplug_iface {
+    int                        ifindex;     /* 0 = free slot */
+    char                       driver[32];
+    char                       mac[32];
+    uint32_t                   chip;
+    const struct hotplug_rule *rule;        /* NULL = no rule, left alone */
+    struct config             *cf;          /* holds 'rule' */
+    struct iovar_session       s;
+    int                        done;        /* profile applied or given up */
+    unsigned                   retry_ms;
+    struct timespec            since;       /* attach time */
+    struct timespec            next;        /* next firmware probe */
+};
+
+struct hotplug {
+    struct hotplug_iface       ifaces[HOTPLUG_IFACES_MAX];
+};
+
+/* Rules resolve their profiles in 'cf', the config they become part of */
+static int hotplug_rules_load(const char *path, const struct config *cf,
+                              struct hotplug_rule **rules, size_t *n_rules,
+                              char *err, size_t err_len)
+{
+    char line[BATCH_LINE_MAX];
+    unsigned lineno = 0;
+    FILE *f;
+    int ret;
+
+    f = fopen(path, "r");
+    if (!f) {
+        snprintf(err, err_len, "Cannot open %s: %s", path, strerror(errno));
+        return -ENOENT;
+    }
+    *rules = calloc(HOTPLUG_RULES_MAX, sizeof(**rules));
+    if (!*rules) {
+        fclose(f);
+        snprintf(err, err_len, "%s", strerror(ENOMEM));
+        return -ENOMEM;
+    }
+
+    *n_rules = 0;
+    while ((ret = line_read(line, sizeof(line), f)) != 0) {
+        char *args[BATCH_MAX_ARGS];
+        struct hotplug_rule *r = &(*rules)[*n_rules];
+        int i, n;
+
+        lineno++;
+        n = ret < 0 ? ret : command_split(line, args);
+        if (n == 0)
+            continue;
+        if (n < 0) {
+            char reason[96];
+
+            command_line_reason(n, reason, sizeof(reason));
+            snprintf(err, err_len, "%s:%u: %s", path, lineno, reason);
+            goto fail;
+        }
+        if (*n_rules == HOTPLUG_RULES_MAX) {
+            snprintf(err, err_len, "%s:%u: More than %d rules", path,
+                     lineno, HOTPLUG_RULES_MAX);
+            goto fail;
+        }
+
+        memset(r, 0, sizeof(*r));
+        r->line = lineno;
+        r->profile = profile_find(cf, args[n - 1]);
+        if (!r->profile) {
+            snprintf(err, err_len, "%s:%u: Unknown profile '%s'", path,
+                     lineno, args[n - 1]);
+            goto fail;
+        }
+
+        for (i = 0; i < n - 1; i++) {
+            char *val = strchr(args[i], '=');
+            char *end;
+
+            if (val)
+                *val++ = '\0';
+            if (val && strcmp(args[i], "driver") == 0) {
+                snprintf(r->driver, sizeof(r->driver), "%s", val);
+            } else if (val && strcmp(args[i], "mac") == 0) {
+                snprintf(r->mac, sizeof(r->mac), "%s", val);
+            } else if (val && strcmp(args[i], "chip") == 0) {
+                errno = 0;
+                r->chip = (uint32_t)strtoul(val, &end, 16);
+                if (errno || end == val || *end != '\0') {
+                    snprintf(err, err_len, "%s:%u: Invalid chip '%s'",
+                             path, lineno, val);
+                    goto fail;
+                }
+                r->has_chip = 1;
+            } else {
+                snprintf(err, err_len, "%s:%u: Expected driver=, chip= or "
+                         "mac= before the profile, got '%s'", path, lineno,
+                         args[i]);
+                goto fail;
+            }
+        }
+        (*n_rules)++;
+    }
+
+    fclose(f);
+    return 0;
+
+fail:
+    fclose(f);
+    return -EINVAL;
+}
+
+/* Read the first line of a sysfs attribute under /sys/class/net/<ifname> */
+static int net_sysfs_read(const char *ifname, const char *attr, char *buf,
+                          size_t len)
+{
+    char path[128];
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/%s", ifname, attr);
+    f = fopen(path, "r");
+    if (!f)
+        return -errno;
+    ok = fgets(buf, (int)len, f) != NULL;
+    fclose(f);
+    if (!ok)
+        return -ENODATA;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/* Driver, chip ID and MAC of an interface; -ENODEV unless its device is
+ * bound to brcmfmac */
+static int hotplug_identify(const char *ifname, struct hotplug_iface *h)
+{
+    char path[128], link[256], id[16];
+    const char *base;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/driver", ifname);
+    n = readlink(path, link, sizeof(link) - 1);
+    if (n < 0)
+        return -ENODEV;
+    link[n] = '\0';
+    base = strrchr(link, '/');
+    base = base ? base + 1 : link;
+    if (strncmp(base, HOTPLUG_DRIVER, strlen(HOTPLUG_DRIVER)) != 0)
+        return -ENODEV;
+    snprintf(h->driver, sizeof(h->driver), "%.31s", base);
+
+    /* SDIO and PCI functions have a device ID, USB interfaces a parent
+     * device with a product ID */
+    h->chip = 0;
+    if (net_sysfs_read(ifname, "device/device", id, sizeof(id)) == 0 ||
+        net_sysfs_read(ifname, "device/../idProduct", id, sizeof(id)) == 0)
+        h->chip = (uint32_t)strtoul(id, NULL, 16);
+
+    if (net_sysfs_read(ifname, "address", h->mac, sizeof(h->mac)) != 0)
+        h->mac[0] = '\0';
+    return 0;
+}
+
+static const struct hotplug_rule *hotplug_match(const struct config *cf,
+                                                const struct hotplug_iface *h)
+{
+    size_t i;
+
+    for (i = 0; i < cf->n_rules; i++) {
+        const struct hotplug_rule *r = &cf->rules[i];
+
+        if (r->driver[0] && strcmp(r->driver, h->driver) != 0)
+            continue;
+        if (r->has_chip && r->chip != h->chip)
+            continue;
+        if (r->mac[0] && fnmatch(r->mac, h->mac, FNM_CASEFOLD) != 0)
+            continue;
+        return r;
+    }
+    return NULL;
+}
+
+static struct hotplug_iface *hotplug_find(struct hotplug *hp, int ifindex)
+{
+    size_t i;
+
+    for (i = 0; i < HOTPLUG_IFACES_MAX; i++) {
+        if (hp->ifaces[i].ifindex == ifindex)
+            return &hp->ifaces[i];
+    }
+    return NULL;
+}
+
+/* One line (text) or object (JSON) per attach, apply and release */
+static void hotplug_report(const struct hotplug_iface *h, const char *event,
+                           int err)
+{
+    const char *profile = h->rule ? h->rule->profile->name : NULL;
+    char chip[12];
+
+    out_ifname = h->s.ifname;
+    if (out_format == OUT_JSON) {
+        snprintf(chip, sizeof(chip), "0x%04x", h->chip);
+        json_begin("hotplug");
+        json_str("event", event);
+        json_str("driver", h->driver);
+        json_str("chip", chip);
+        json_str("mac", h->mac);
+        json_str("profile", profile);
+        if (h->rule)
+            json_u32("rule_line", h->rule->line);
+        json_error(err);
+        if (strcmp(event, "apply") == 0)
+            json_num("latency_us", "%ld", elapsed_us(&h->since));
+        json_end();
+        return;
+    }
+
+    if (strcmp(event, "attach") == 0)
+        printf("%s: attached (%s, chip 0x%04x, %s), %s%s\n", h->s.ifname,
+               h->driver, h->chip, h->mac, profile ? "profile " : "",
+               profile ? profile : "no rule matches");
+    else if (strcmp(event, "apply") == 0 && err == 0)
+        printf("%s: profile %s applied %.1f ms after attach\n", h->s.ifname,
+               profile, elapsed_us(&h->since) / 1000.0);
+    else if (strcmp(event, "apply") == 0)
+        log_error(NULL, err, "ERROR: %s: profile %s not applied: %s\n",
+                  h->s.ifname, profile, strerror(-err));
+    else
+        printf("%s: released\n", h->s.ifname);
+    fflush(stdout);
+}
+
+static void hotplug_attach(struct hotplug *hp, int ifindex, const char *name)
+{
+    struct hotplug_iface id, *h;
+
+    memset(&id, 0, sizeof(id));
+    if (hotplug_find(hp, ifindex) || hotplug_identify(name, &id) != 0)
+        return;
+
+    h = hotplug_find(hp, 0);
+    if (!h) {
+        log_error(NULL, 0, "ERROR: %s: more than %d brcmfmac interfaces, "
+                  "ignored\n", name, HOTPLUG_IFACES_MAX);
+        return;
+    }
+
+    *h = id;
+    h->cf = config_get();
+    h->rule = hotplug_match(h->cf, h);
+    clock_gettime(CLOCK_MONOTONIC, &h->since);
+    h->next = h->since;
+    h->retry_ms = WAIT_RETRY_MIN_MS;
+
+    /* Interfaces without a rule are tracked but get no session */
+    if (h->rule && session_open(&h->s, ifindex) != 0) {
+        log_error(NULL, 0, "ERROR: %s: no netlink session, ignored\n", name);
+        config_put(h->cf);
+        memset(h, 0, sizeof(*h));
+        return;
+    }
+    h->ifindex = ifindex;
+    h->done = !h->rule;
+    snprintf(h->s.ifname, sizeof(h->s.ifname), "%s", name);
+    hotplug_report(h, "attach", 0);
+}
+
+static void hotplug_release(struct hotplug_iface *h)
+{
+    hotplug_report(h, "release", 0);
+    session_close(&h->s);
+    config_put(h->cf);
+    memset(h, 0, sizeof(*h));
+}
+
+static void hotplug_scan(struct hotplug *hp)
+{
+    struct if_nameindex *all = if_nameindex(), *ni;
+
+    for (ni = all; ni && ni->if_index; ni++)
+        hotplug_attach(hp, (int)ni->if_index, ni->if_name);
+    if (all)
+        if_freenameindex(all);
+}
+
+static void hotplug_event(void *arg, int type, int ifindex, const char *name)
+{
+    struct hotplug *hp = arg;
+    struct hotplug_iface *h = ifindex ? hotplug_find(hp, ifindex) : NULL;
+    size_t i;
+
+    if (type == 0) {
+        /* Events were lost: drop what is gone, pick up what is new */
+        for (i = 0; i < HOTPLUG_IFACES_MAX; i++) {
+            char now[IF_NAMESIZE];
+
+            h = &hp->ifaces[i];
+            if (h->ifindex && !if_indextoname((unsigned)h->ifindex, now))
+                hotplug_release(h);
+        }
+        hotplug_scan(hp);
+    } else if (type == RTM_DELLINK) {
+        if (h)
+            hotplug_release(h);
+    } else if (h) {
+        if (name)
+            snprintf(h->s.ifname, sizeof(h->s.ifname), "%s", name);
+    } else if (name) {
+        hotplug_attach(hp, ifindex, name);
+    }
+}
+
+/* Probe and apply where due; returns ms until the next probe, -1 if none */
+static int hotplug_service(struct hotplug *hp)
+{
+    struct timespec now;
+    long wait = -1;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < HOTPLUG_IFACES_MAX; i++) {
+        struct hotplug_iface *h = &hp->ifaces[i];
+        long due;
+        int ret;
+
+        if (!h->ifindex || h->done)
+            continue;
+
+        due = (long)(timespec_diff(&now, &h->next) * 1000.0);
+        if (due <= 0) {
+            ret = firmware_probe(&h->s);
+            if (ret == -EAGAIN &&
+                timespec_diff(&h->since, &now) < HOTPLUG_FW_WAIT_S) {
+                h->next = now;
+                h->next.tv_nsec += (long)h->retry_ms * 1000000L;
+                if (h->next.tv_nsec >= 1000000000L) {
+                    h->next.tv_sec++;
+                    h->next.tv_nsec -= 1000000000L;
+                }
+                due = (long)h->retry_ms;
+                if (h->retry_ms < WAIT_RETRY_MAX_MS)
+                    h->retry_ms *= 2;
+            } else {
+                if (ret == 0)
+                    ret = profile_apply(&h->s, h->rule->profile);
+                h->done = 1;
+                hotplug_report(h, "apply", ret == -EAGAIN ? -ETIMEDOUT : ret);
+                continue;
+            }
+        }
+        if (wait < 0 || due < wait)
+            wait = due;
+    }
+    return (int)wait;
+}
+
+static int cmd_hotplug(struct iovar_session *s, int argc, char **argv)
+{
+    struct config *cf;
+    struct hotplug *hp;
+    char err[256];
+    size_t i;
+    int fd, wake;
+    (void)s; (void)argc;
+
+    cf = config_build(config_profiles_path, argv[0], err, sizeof(err));
+    if (!cf) {
+        fprintf(stderr, "ERROR: %s\n", err);
+        return 1;
+    }
+    cf->gen = 1;
+    config_put(atomic_exchange(&config_current, cf));
+
+    hp = calloc(1, sizeof(*hp));
+    if (!hp)
+        return 1;
+
+    /* Subscribe first, so nothing that appears during the scan is lost */
+    fd = link_events_open();
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Cannot subscribe to link events: %s\n",
+                strerror(-fd));
+        free(hp);
+        return 1;
+    }
+    install_stop_handlers();
+    wake = config_reload_init(argv[0]);
+    log_start();
+    hotplug_scan(hp);
+
+    while (!stop_requested) {
+        struct pollfd pfd[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = wake, .events = POLLIN },
+        };
+
+        if (poll(pfd, 2, hotplug_service(hp)) <= 0)
+            continue;
+        if (pfd[0].revents & POLLIN)
+            link_events_read(fd, hotplug_event, hp);
+        if (pfd[1].revents & POLLIN)
+            config_reload_poll();
+    }
+
+    for (i = 0; i < HOTPLUG_IFACES_MAX; i++) {
+        if (hp->ifaces[i].ifindex)
+            hotplug_release(&hp->ifaces[i]);
+    }
+    log_stop();
+    close(fd);
+    free(hp);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
         "brcm-iovar - Runtime iovar access via nl80211 vendor commands\n"
         "\n"
         "Usage:\n"
-        "  %s <interface> get_int <iovar>\n"
-        "  %s <interface> set_int <iovar> <value>\n"
+        "  %s [options] <interface> <command> [args...]\n"
+        "\n"
+        "Commands:\n"
+        "  %s <interface> get_int <iovar>...\n"
+        "  %s <interface> set_int <iovar> <value> | <iovar>=<value>...\n"
+        "  %s <interface> get <name>...           Typed read (see list)\n"
+        "  %s <interface> set <name> <value> | <name>=<value>...\n"
+        "                                         Typed, range-checked write\n"
+        "  %s <interface> list                    Known typed settings\n"
+        "  %s <interface> profile [<name>]        List or apply a profile\n"
+        "  %s <interface> profile-verify <name> [seconds]\n"
+        "                                         Apply profile, compare counters\n"
+        "  %s <interface> stream-guard <seconds|release> [baseline] [5g]\n"
+        "                                         No roam/scan while streaming\n"
+        "  %s <interface> wme [<ac> key=value...] Show/set EDCA parameters\n"
+        "  %s <interface> probe <host> [count] [interval-ms]\n"
+        "                                         ICMP latency, RSSI, rate\n"
+        "  %s <interface> arp-offload <on|off> [ipv4...]\n"
+        "  %s <interface> nd-offload <on|off> [ipv6...]\n"
+        "  %s <interface> pkt-filter add|enable|disable|delete|mode ...\n"
+        "  %s <interface> quiet-host <on|off> [seconds]\n"
+        "                                         Offloads + filters, wakeups\n"
+        "  %s <interface> wake-stats [seconds]    fw rx vs host rx vs irqs\n"
+        "  %s <interface> bus                     SDIO glom settings\n"
+        "  %s <interface> bus-bench tx|sweep <host[:port]> [seconds]\n"
+        "  %s <interface> bus-bench rx <port> [seconds]\n"
+        "                                         Throughput and CPU cost\n"
+        "  %s <interface> ack-bench [bytes] [count]\n"
+        "                                         Error reply bytes, CAP_ACK\n"
+        "  %s <interface> watch [interval] [count] [temp-limit]\n"
+        "                                         Temperature, tx power, rates\n"
+        "  %s <interface> coex [seconds]          BT coex statistics\n"
+        "  %s <interface> antenna [0|1|auto]      TX/RX antenna selection\n"
+        "  %s <interface> antenna-compare [seconds] [rounds]\n"
+        "                                         Pick antenna by RSSI/retries\n"
+        "  %s <interface> band [auto|5g|2g] [wait]\n"
+        "                                         Band lock, reports link move\n"
+        "  %s <interface> batch <file|->          One command per line, one\n"
+        "                                         session\n"
+        "  %s <interface> shell                   Interactive, one session,\n"
+        "                                         per-command timing\n"
+        "  %s <interface> serve [idle-seconds] [socket]\n"
+        "                                         Command lines from a Unix\n"
+        "                                         socket, warm session\n"
+        "  %s --connect <interface> reply-bench [max-bytes] [rounds]\n"
+        "                                         Inline vs memfd replies\n"
+        "  %s - decode <file|->                   --binary stream to text/JSON\n"
+        "  %s - hotplug <rules>                   Apply profiles to brcmfmac\n"
+        "                                         interfaces as they appear\n"
+        "\n"
+        "Options:\n"
+        "  --json    One JSON object per result (NDJSON), with interface,\n"
+        "            command, iovar, type, value, error and latency_us\n"
+        "  --binary  Fixed 32-byte records with a schema header (get_int,\n"
+        "            set_int, get, set, watch, batch); see 'decode'\n"
+        "  --emulate Answer from an in-process emulated firmware instead of\n"
+        "            the driver (no device needed; for benchmarks and PGO)\n"
+        "  --no-ack  Stream set/set_int writes without per-write ACKs;\n"
+        "            failures are still reported (profiles always do this);\n"
+        "            batch and shell ack once at the end of their input\n"
+        "  --wait-for-iface[=seconds]\n"
+        "            Wait for the interface to appear and its firmware to\n"
+        "            answer, then run the command (default: no timeout)\n"
+        "  --profiles=<file>\n"
+        "            More profiles, one per line: <name> <setting>=<value>...;\n"
+        "            serve and hotplug reload it on SIGHUP\n"
+        "  --connect[=socket]\n"
+        "            Run the command in the interface's serve daemon; large\n"
+        "            results arrive as a sealed memfd and are mapped\n"
         "\n"
         "Examples:\n"
         "  %s wlan0 get_int btc_mode          Read BT coexistence mode\n"
         "  %s wlan0 set_int btc_mode 4        Set BT coex to full TDM\n"
         "  %s wlan0 get_int btc_params        Read BT coex parameters\n"
+        "  %s wlan0 set btc_mode=4 frameburst=0   Two writes, one process\n"
+        "  %s wlan0 set frameburst 0          Disable frame bursting\n"
+        "  %s wlan0 profile-verify tput-bt    Apply tput-bt, show effect\n"
+        "  %s wlan0 stream-guard 0 &          Guard until killed (SIGTERM)\n"
+        "  %s wlan0 wme vi cwmin=3 cwmax=7    Tighten AC_VI contention\n"
         "\n"
         "Known btc_mode values:\n"
         "  0 = disabled\n"
@@ -442,59 +9935,149 @@ static void usage(const char *prog)
         "Requires: root or CAP_NET_ADMIN\n"
         "Driver:   brcmfmac (mainline kernel, no patches needed)\n"
         "\n",
-        prog, prog, prog, prog, prog);
+        prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+        prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+        prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+        prog, prog, prog, prog, prog, prog, prog, prog, prog);
 }
 
 int main(int argc, char *argv[])
 {
+    const char *prog = argv[0];
     const char *ifname;
     const char *command;
-    const char *iovar;
+    const struct command *cmd;
+    struct iovar_session session;
+    int emulate = 0;
+    int wait_iface = 0;
+    uint32_t wait_timeout = 0;
+    const char *connect_path = NULL;
+    int connect_daemon = 0;
     int ifindex;
+    int status;
+
+    /* Global options precede the interface */
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--json") == 0) {
+            out_format = OUT_JSON;
+        } else if (strcmp(argv[1], "--binary") == 0) {
+            out_format = OUT_BINARY;
+        } else if (strcmp(argv[1], "--emulate") == 0) {
+            emulate = 1;
+        } else if (strcmp(argv[1], "--no-ack") == 0) {
+            sets_unacked = 1;
+        } else if (strcmp(argv[1], "--wait-for-iface") == 0) {
+            wait_iface = 1;
+        } else if (strncmp(argv[1], "--wait-for-iface=", 17) == 0) {
+            wait_iface = 1;
+            if (parse_u32(argv[1] + 17, &wait_timeout) != 0) {
+                fprintf(stderr, "ERROR: Invalid timeout '%s'\n",
+                        argv[1] + 17);
+                return 1;
+            }
+        } else if (strncmp(argv[1], "--profiles=", 11) == 0) {
+            config_profiles_path = argv[1] + 11;
+        } else if (strcmp(argv[1], "--connect") == 0) {
+            connect_daemon = 1;
+        } else if (strncmp(argv[1], "--connect=", 10) == 0) {
+            connect_daemon = 1;
+            connect_path = argv[1] + 10;
+        } else {
+            fprintf(stderr, "ERROR: Unknown option '%s'\n", argv[1]);
+            usage(prog);
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
 
-    if (argc < 4) {
-        usage(argv[0]);
+    if (argc < 3) {
+        usage(prog);
         return 1;
     }
 
     ifname  = argv[1];
     command = argv[2];
-    iovar   = argv[3];
+    out_ifname = ifname;
+
+    if (connect_daemon) {
+        if (out_format != OUT_TEXT || emulate || sets_unacked || wait_iface ||
+            config_profiles_path) {
+            fprintf(stderr, "ERROR: With --connect, options belong on the "
+                    "serve daemon\n");
+            return 1;
+        }
+        return client_run(connect_path, ifname, argc - 2, argv + 2);
+    }
 
-    /* Resolve interface name to index */
-    ifindex = if_nametoindex(ifname);
-    if (ifindex == 0) {
-        fprintf(stderr, "ERROR: Interface '%s' not found: %s\n",
-                ifname, strerror(errno));
+    cmd = command_lookup(command);
+    if (!cmd) {
+        fprintf(stderr, "ERROR: Unknown command '%s'\n", command);
+        usage(prog);
         return 1;
     }
 
-    if (strcmp(command, "get_int") == 0) {
-        uint32_t value;
-        int ret = get_iovar_int(ifindex, iovar, &value);
-        if (ret == 0) {
-            printf("%s = %u\n", iovar, value);
-            return 0;
-        }
+    if (command_check_args(cmd, argc - 3) != 0) {
+        usage(prog);
         return 1;
     }
 
-    if (strcmp(command, "set_int") == 0) {
-        if (argc < 5) {
-            fprintf(stderr, "ERROR: set_int requires a value argument\n");
-            usage(argv[0]);
+    if (config_profiles_path) {
+        char err[256];
+        struct config *cf = config_build(config_profiles_path, NULL, err,
+                                         sizeof(err));
+
+        if (!cf) {
+            fprintf(stderr, "ERROR: %s\n", err);
             return 1;
         }
-        uint32_t value = (uint32_t)strtoul(argv[4], NULL, 0);
-        int ret = set_iovar_int(ifindex, iovar, value);
-        if (ret == 0) {
-            printf("%s set to %u\n", iovar, value);
-            return 0;
+        cf->gen = 1;
+        atomic_store(&config_current, cf);
+    }
+
+    if (out_format == OUT_BINARY) {
+        if (!cmd->binary) {
+            fprintf(stderr, "ERROR: %s has no --binary output\n", cmd->name);
+            return 1;
+        }
+        if (isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "ERROR: Not writing binary records to a "
+                    "terminal (redirect or pipe stdout)\n");
+            return 1;
         }
+    }
+    if (out_format == OUT_JSON && !cmd->json) {
+        fprintf(stderr, "ERROR: %s has no --json output\n", cmd->name);
+        json_failure(cmd->name, -EOPNOTSUPP);
         return 1;
     }
 
-    fprintf(stderr, "ERROR: Unknown command '%s'\n", command);
-    usage(argv[0]);
-    return 1;
+    if (cmd->offline)
+        return command_call(cmd, NULL, argc - 3, argv + 3);
+
+    if (emulate) {
+        session_open_emulated(&session, ifname);
+        return command_call(cmd, &session, argc - 3, argv + 3);
+    }
+
+    if (wait_iface) {
+        if (iface_wait(&session, ifname, wait_timeout) != 0)
+            return 1;
+    } else {
+        /* Resolve interface name to index */
+        ifindex = if_nametoindex(ifname);
+        if (ifindex == 0) {
+            fprintf(stderr, "ERROR: Interface '%s' not found: %s\n",
+                    ifname, strerror(errno));
+            return 1;
+        }
+
+        if (session_open(&session, ifindex) != 0)
+            return 1;
+    }
+
+    status = command_call(cmd, &session, argc - 3, argv + 3);
+
+    session_close(&session);
+    return status;
 }
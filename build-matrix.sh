@@ -1,13 +1,19 @@
 #!/bin/bash
 set -e
 # Build brcm-iovar for all Raspberry Pi targets (armv6l, armhf, arm64)
+# --static: fully static, size-optimized binaries (make static)
+# --pgo:    profile-guided + LTO binaries trained on the emulator (make pgo)
 
 ARCHS=("armv6" "armhf" "arm64")
 VERBOSE=""
+STATIC=""
+PGO=""
 
 for arg in "$@"; do
   case "$arg" in
     --verbose) VERBOSE="--verbose" ;;
+    --static) STATIC="--static" ;;
+    --pgo) PGO="--pgo" ;;
   esac
 done
 
@@ -16,7 +22,7 @@ for ARCH in "${ARCHS[@]}"; do
   echo "====================================="
   echo ">> Building for: $ARCH"
   echo "====================================="
-  ./docker/run-docker-brcmfmac_iovar.sh "$ARCH" $VERBOSE
+  ./docker/run-docker-brcmfmac_iovar.sh "$ARCH" $VERBOSE $STATIC $PGO
 done
 
 echo ""
@@ -2,14 +2,20 @@
 set -e
 
 VERBOSE=0
-if [[ "$2" == "--verbose" ]]; then
-  VERBOSE=1
-fi
+STATIC=0
+PGO=0
+for arg in "${@:2}"; do
+  case "$arg" in
+    --verbose) VERBOSE=1 ;;
+    --static) STATIC=1 ;;
+    --pgo) PGO=1 ;;
+  esac
+done
 
 ARCH=$1
 
 if [[ -z "$ARCH" ]]; then
-  echo "Usage: $0 <arch> [--verbose]"
+  echo "Usage: $0 <arch> [--verbose] [--static|--pgo]"
   echo "  arch: armv6 | armhf | arm64"
   echo "  Targets: armv6l (Pi Zero/1), armhf (Pi 2/3/4 32-bit), arm64 (Pi 3/4/5 64-bit)"
   exit 1
@@ -46,21 +52,32 @@ else
   docker build --platform=$PLATFORM --progress=auto -t $IMAGE_TAG -f $DOCKERFILE .
 fi
 
-echo "[+] Building brcm-iovar in Docker ($ARCH)..."
+# 'make static' and 'make pgo' strip their binaries themselves; PGO
+# training runs under the container's emulated CPU
+if [[ "$STATIC" -eq 1 ]]; then
+  TARGETS="static"
+  BINARY=brcm-iovar-static
+elif [[ "$PGO" -eq 1 ]]; then
+  TARGETS="pgo"
+  BINARY=brcm-iovar-pgo
+else
+  TARGETS="all strip"
+  BINARY=brcm-iovar
+fi
+
+echo "[+] Building $BINARY in Docker ($ARCH)..."
 if [[ "$ARCH" == "armv6" ]]; then
   docker run --rm --platform=$PLATFORM -v "$PWD":/build -w /build $IMAGE_TAG bash -c "\
     make clean || true && \
-    make EXTRA_CFLAGS='-march=armv6 -mfpu=vfp -mfloat-abi=hard -marm' && \
-    make strip"
+    make EXTRA_CFLAGS='-march=armv6 -mfpu=vfp -mfloat-abi=hard -marm' $TARGETS"
 else
   docker run --rm --platform=$PLATFORM -v "$PWD":/build -w /build $IMAGE_TAG bash -c "\
     make clean || true && \
-    make && \
-    make strip"
+    make $TARGETS"
 fi
 
 mkdir -p out/$ARCH
-cp -f brcm-iovar out/$ARCH/
+cp -f $BINARY out/$ARCH/brcm-iovar
 make clean 2>/dev/null || true
 
 echo "[OK] Binary: out/$ARCH/brcm-iovar"